@@ -16,6 +16,8 @@
 #include <glm/vec3.hpp>
 #include <glm/vec2.hpp>
 
+#include <tool_model_lib/obj_parser.h>
+
 using namespace std;
 
 std::vector< glm::vec3 > vertices;
@@ -23,108 +25,34 @@ std::vector< glm::vec2 > uvs;
 std::vector< glm::vec3 > normals;
 
 /**
-brief testing
+brief testing, the triangle corners of an OBJ file read with the parser ToolModel uses
 */
-bool loadOBJ(
-    const char * path, 
-    std::vector<glm::vec3> & out_vertices,
-    std::vector<glm::vec2> & out_uvs,
-    std::vector<glm::vec3> & out_normals
-){
-    printf("Loading OBJ file %s...\n", path);
-
-    std::vector< unsigned int > vertexIndices, uvIndices, normalIndices;
-    //std::vector< unsigned int > vertexIndices;
-	std::vector< glm::vec3 > temp_vertices;
-	std::vector< glm::vec2 > temp_uvs;
-	std::vector< glm::vec3 > temp_normals;
-
-    FILE * file = fopen(path, "r");
-    if( file == NULL ){
-        printf("Impossible to open the file ! Are you in the right path ? See Tutorial 1 for details\n");
-        return false;
+void debug() {
+    
+ 
+    objMesh mesh;
+    bool res = parseOBJ("ellipse.obj", mesh);
+    if (!res) {
+        printf("Impossible to read the file ! Are you in the right path ?\n");
+        return;
     }
 
-    while( 1 ){
-
-        char lineHeader[128];
-        // read the first word of the line
-        int res = fscanf(file, "%s", lineHeader);
-        if (res == EOF)
-            break; // EOF = End Of File. Quit the loop.
-
-        // else : parse lineHeader
-        
-        if ( strcmp( lineHeader, "v" ) == 0 ){
-            glm::vec3 vertex;
-            
-            fscanf(file, "%f %f %f\n", &vertex.x, &vertex.y, &vertex.z );
-            // cout<<"vertex x"<< vertex.x<<endl;
-            // cout<<"vertex y"<<vertex.y<<endl;
-            // cout<<"vertex z"<<vertex.z<<endl;
-            temp_vertices.push_back(vertex);
-        }
+    // For each vertex of each triangle
+    for (unsigned int i = 0; i < mesh.vertex_indices.size(); i++) {
+
+        const float *v = &mesh.vertices[3 * mesh.vertex_indices[i]];
+        vertices.push_back(glm::vec3(v[0], v[1], v[2]));
 
-        else if ( strcmp( lineHeader, "vt" ) == 0 ){
-	    glm::vec2 uv;
-	    fscanf(file, "%f %f\n", &uv.x, &uv.y );
-	    // cout<<"uv"<<uv.x<<endl;
-	    temp_uvs.push_back(uv);
-		} 
-        else if ( strcmp( lineHeader, "vn" ) == 0 ){
-            glm::vec3 normal;
-            fscanf(file, "%f %f %f\n", &normal.x, &normal.y, &normal.z );
-            // cout<<"normal x"<< normal.x<<endl;
-            // cout<<"normal y"<< normal.y<<endl;
-            // cout<<"normal z"<< normal.z<<endl;
-            temp_normals.push_back(normal);
+        if (mesh.uv_indices[i] >= 0) {
+            const float *uv = &mesh.uvs[2 * mesh.uv_indices[i]];
+            uvs.push_back(glm::vec2(uv[0], uv[1]));
         }
-        else if ( strcmp( lineHeader, "f" ) == 0 ){
-    std::string vertex1, vertex2, vertex3;
-    unsigned int vertexIndex[3], uvIndex[3], normalIndex[3];
-    int matches = fscanf(file, "%d/%d/%d %d/%d/%d %d/%d/%d\n", &vertexIndex[0], &uvIndex[0], &normalIndex[0], &vertexIndex[1], &uvIndex[1], &normalIndex[1], &vertexIndex[2], &uvIndex[2], &normalIndex[2] );
-    if (matches != 9){
-        printf("File can't be read by our simple parser : ( Try exporting with other options\n");
-        return false;
-    }
-    vertexIndices.push_back(vertexIndex[0]);
-    vertexIndices.push_back(vertexIndex[1]);
-    vertexIndices.push_back(vertexIndex[2]);
-    uvIndices    .push_back(uvIndex[0]);
-    uvIndices    .push_back(uvIndex[1]);
-    uvIndices    .push_back(uvIndex[2]);
-    normalIndices.push_back(normalIndex[0]);
-    normalIndices.push_back(normalIndex[1]);
-    normalIndices.push_back(normalIndex[2]);
-            
+        if (mesh.normal_indices[i] >= 0) {
+            const float *n = &mesh.normals[3 * mesh.normal_indices[i]];
+            normals.push_back(glm::vec3(n[0], n[1], n[2]));
         }
     }
-
-
-    // For each vertex of each triangle
-    for( unsigned int i=0; i<vertexIndices.size(); i++ ){
-
-        // Get the indices of its attributes
-        unsigned int vertexIndex = vertexIndices[i];
-        
-        // Get the attributes thanks to the index
-        glm::vec3 vertex = temp_vertices[ vertexIndex-1 ];
-        
-        // Put the attributes in buffers
-        out_vertices.push_back(vertex);
-    
-    }
-    cout<<"size"<< out_vertices.size()<<endl;
-    printf("loaded file %s successfully.\n", path);
-    return true;
-}
-
-
-void debug() {
-    
- 
-    bool res = loadOBJ("ellipse.obj", vertices, uvs, normals);
-    //bool res = loadOBJ("ellipse.obj", vertices);
+    cout<<"size"<< vertices.size()<<endl;
     
     puts("VERTEX______________________________________________________");
     
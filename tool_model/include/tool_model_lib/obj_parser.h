@@ -0,0 +1,72 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2016 Case Western Reserve University
+ *
+ *    Ran Hao <rxh349@case.edu>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of Case Western Reserve University, nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef OBJ_PARSER_H
+#define OBJ_PARSER_H
+
+#include <vector>
+
+/**
+ * @brief Flat arrays of a Wavefront OBJ mesh, shared by ToolModel and the load_model test.
+ * Faces are triangulated (polygons as fans), every index is 0-based and -1 marks a missing uv or normal.
+ */
+struct objMesh {
+    std::vector<float> vertices;    //x, y, z of every "v" line
+    std::vector<float> normals;     //x, y, z of every "vn" line
+    std::vector<float> uvs;         //u, v of every "vt" line
+
+    std::vector<int> vertex_indices;    //three per triangle
+    std::vector<int> uv_indices;
+    std::vector<int> normal_indices;
+
+    int numVertices() const { return vertices.size() / 3; };
+    int numNormals() const { return normals.size() / 3; };
+    int numTriangles() const { return vertex_indices.size() / 3; };
+};
+
+/**
+ * @brief Parsing an OBJ file. The file is memory-mapped and counted first, so every output array is reserved once,
+ * then parsed in place without any per-element allocation. Supports v, v/vt, v//vn and v/vt/vn corners, polygons
+ * up to 64 corners and negative (relative) indices; other statements are skipped.
+ * @param path : absolute path
+ * @param mesh : output mesh, cleared first
+ * @return false if the file cannot be read or a face is malformed
+ */
+bool parseOBJ(const char *path, objMesh &mesh);
+
+#endif
@@ -14,11 +14,8 @@
 
 #include <string>
 #include <cstring>
+#include <algorithm>
 
-#include <glm/glm.hpp>
-
-#include <glm/vec3.hpp>
-#include <glm/vec2.hpp>
 #include <cwru_opencv_common/projective_geometry.h>
 #include <ros/package.h>
 
@@ -87,75 +84,166 @@ public:
     };   //end struct
 
     /**
-     * The tool model pieces, including the vertices and vertex normals of cylinder, oval gripper 1 and 2
+     * @brief Per-frame scoring context: the inverted, normalized distance transform of one segmented image.
+     * Built once per camera per frame and shared by every particle scored against that image.
+     */
+    struct scoringContext {
+        cv::Mat normDIST;   //CV_32FC1, distance to the closest segmented edge, normalized to [0, 1], or its
+                            //CV_8UC1 / CV_16UC1 levels with quantizedDistance
+        double distance_scale;  //normalized distance of one level of normDIST, 1 for the CV_32FC1 one
+        std::vector<cv::Mat> directionalDIST;   //one CV_32FC1 line integral per orientation channel, see directionalChannels
+        cv::Mat blurSEG;        //CV_32FC1, the segmented image blurred and scaled to [0, 1], see correlationScoring
+        double blur_energy;     //sum of the squares of blurSEG
+
+        scoringContext() : distance_scale(1.0), blur_energy(0.0) {}
+    };
+
+    /**
+     * @brief Precision of the part meshes and of the silhouette kernels: double, or float when built with
+     * TOOL_MODEL_FLOAT_GEOMETRY. The pose transforms stay double, the tool is a few centimetres long so the float
+     * projections stay well within a pixel. The definition is exported to the packages finding tool_model, so they
+     * see the same structs as tool_model_lib
      */
-    std::vector<glm::vec3> body_vertices; ///cylinder
-    std::vector<glm::vec3> ellipse_vertices;   ///oval
-    std::vector<glm::vec3> griper1_vertices;   ///griper1
-    std::vector<glm::vec3> griper2_vertices;   ///griper2
+#ifdef TOOL_MODEL_FLOAT_GEOMETRY
+    typedef float meshScalar;
+#else
+    typedef double meshScalar;
+#endif
 
-    std::vector<glm::vec3> body_Vnormal;    //vertex normal, for the computation of the silhouette
-    std::vector<glm::vec3> ellipse_Vnormal;
-    std::vector<glm::vec3> griper1_Vnormal;
-    std::vector<glm::vec3> griper2_Vnormal;
+    /**
+     * @brief Closed form of a part that is a capped circular cylinder about the y axis of its own frame
+     */
+    struct cylinderShape {
+        double center_x, center_z;  //axis position
+        double radius;
+        double y_min, y_max;        //the two end faces
+        bool valid;                 //false when the part is not such a cylinder
+
+        cylinderShape() : center_x(0.0), center_z(0.0), radius(0.0), y_min(0.0), y_max(0.0), valid(false) {}
+    };
+
+    /**
+     * @brief One tool part in meters, as structure of arrays: the vertex and vertex normal coordinates, flat face
+     * indices, the neighbor faces in CSR form and the per-face normal and centroid
+     */
+    struct toolMesh {
+        std::vector<meshScalar> vx, vy, vz;     //vertices
+        std::vector<meshScalar> nx, ny, nz;     //vertex normals
 
-    std::vector<cv::Point3d> body_Vpts;     ////to save time from converting in real time
-    std::vector<cv::Point3d> ellipse_Vpts;
-    std::vector<cv::Point3d> griper1_Vpts;
-    std::vector<cv::Point3d> griper2_Vpts;
+        std::vector<int> face_v;            //three vertex indices per face
+        std::vector<int> face_n;            //the corresponding three vertex normal indices
 
-    std::vector<cv::Point3d> body_Npts;    //vertex normal, for the computation of the silhouette
-    std::vector<cv::Point3d> ellipse_Npts;
-    std::vector<cv::Point3d> griper1_Npts;
-    std::vector<cv::Point3d> griper2_Npts;
+        std::vector<int> neighbor_start;    //the neighbors of face i are neighbor_data[neighbor_start[i], neighbor_start[i + 1])
+        std::vector<int> neighbor_data;     //five per neighbor: neighbor face, first shared vertex, its normal, second shared vertex, its normal
 
-    cv::Mat body_Vmat;
-    cv::Mat ellipse_Vmat;
-    cv::Mat gripper1_Vmat;
-    cv::Mat gripper2_Vmat;
+        std::vector<int> edge_data;         //ten per shared edge: face a, face b, the shared vertices with their normals (v1, n1, v2, n2) as seen from a, then as seen from b
+        std::vector<int> face_edge_start;   //the shared edges of face i are face_edge_data[face_edge_start[i], face_edge_start[i + 1])
+        std::vector<int> face_edge_data;    //indices into edge_data
 
-    cv::Mat body_Nmat;
-    cv::Mat ellipse_Nmat;
-    cv::Mat gripper1_Nmat;
-    cv::Mat gripper2_Nmat;
+        std::vector<int> cluster_faces;     //faces ordered so every cluster is a contiguous range, empty without a hierarchy
+        std::vector<int> cluster_data;      //five per cluster: first face in cluster_faces, face count, first child (the second follows it) or -1 for a leaf, first leaf, leaf count
+        std::vector<double> cluster_bounds; //eight per cluster: normal cone axis, cosine of the cone half angle, centroid sphere center, sphere radius
+        std::vector<int> cluster_position;  //where every face is in cluster_faces
+        std::vector<int> cluster_leaf;      //the leaf holding cluster_faces[p]
+        std::vector<int> cluster_edge_start;    //the shared edges whose two faces part ways at cluster i are entries [cluster_edge_start[i], cluster_edge_start[i + 1])
+        std::vector<int> cluster_edge_data;     //five per entry: index into edge_data, positions of its two faces in cluster_faces, their leaves
+
+        std::vector<meshScalar> fnx, fny, fnz;  //face normals, pointing outward
+        std::vector<meshScalar> fcx, fcy, fcz;  //face centroids, in the part frame
+
+        cv::Point3d box_min, box_max;       //axis aligned bounding box of the vertices, in the part frame
+        cylinderShape cylinder;             //closed form of the part, only fitted for the body, see fitCylinder
+
+        int numVertices() const { return vx.size(); };
+        int numNormals() const { return nx.size(); };
+        int numFaces() const { return face_v.size() / 3; };
+        int numEdges() const { return edge_data.size() / 10; };
+        int numClusters() const { return cluster_data.size() / 5; };
+    };
+
+    /**
+     * @brief The vertices and vertex normals of one part transformed under the camera frame, for one pose
+     */
+    struct cameraMesh {
+        cv::Matx44d transform;              //CamMat * [R | t] of the pose
+        std::vector<cv::Point2f> projected; //every vertex projected to the image, P * CamMat * [R | t], only the silhouette edge ends with clusters
+        std::vector<meshScalar> nx, ny, nz; //vertex normals under the camera frame, only filled when asked for
+        std::vector<meshScalar> facing;     //face normal dot (centroid - camera position), negative when front facing, in cluster_faces order with clusters
+        std::vector<signed char> cluster_state;  //per leaf cluster: -1 every face front facing, 1 every face back facing, 0 faces classified in facing
+        std::vector<int> silhouette;        //silhouette edges found through the clusters, indices into edge_data
+    };
 
     /**
-     * The Faces information, including the face and the corresponding neighbor face of cylinder, oval gripper 1 and 2
+     * @brief The silhouette edges of one part for the last pose rendered through a buffer, and the scratch to re-test
+     * only the faces around them for the next pose, see incrementalSilhouetteAngle
      */
-    std::vector<std::vector<int> > body_faces;
-    std::vector<std::vector<int> > ellipse_faces;
-    std::vector<std::vector<int> > griper1_faces;
-    std::vector<std::vector<int> > griper2_faces;
+    struct silhouetteCache {
+        const toolMesh *mesh;           //the part
+        bool valid;                     //false until a pose of the part was rendered
+        cv::Point3d eye;                //camera position in the part frame, for that pose
+        std::vector<int> edges;         //its silhouette edges, indices into edge_data in increasing order
 
-    std::vector<std::vector<int> > body_neighbors;
-    std::vector<std::vector<int> > ellipse_neighbors;
-    std::vector<std::vector<int> > griper1_neighbors;
-    std::vector<std::vector<int> > griper2_neighbors;
+        int stamp;                      //current pass, the stamps below tell which entries it already computed
+        std::vector<int> face_stamp, queued_stamp, edge_stamp, vertex_stamp;
+        std::vector<meshScalar> facing;
+        std::vector<cv::Point2f> projected;
+        std::vector<int> queue;         //faces whose edges are re-tested
 
-    cv::Mat bodyFace_normal;
-    cv::Mat ellipseFace_normal;
-    cv::Mat gripper1Face_normal;
-    cv::Mat gripper2Face_normal;
+        silhouetteCache(const toolMesh *part = NULL) : mesh(part), valid(false), stamp(0) {}
+    };
 
-    cv::Mat bodyFace_centroid;
-    cv::Mat ellipseFace_centroid;
-    cv::Mat gripper1Face_centroid;
-    cv::Mat gripper2Face_centroid;
+    /**
+     * @brief Scratch buffers for the sparse scoring path, holding the rasterized silhouette pixels of one rendering
+     */
+    struct renderBuffer {
+        cameraMesh camera_mesh;            //the part being rendered, under the camera frame
+        std::vector<cv::Point2d> edges;    //projected end points of the silhouette edges, two per edge
+        std::vector<cv::Point3d> edge_points;  //their part frame points, kept when a Jacobian is asked for
+        std::vector<cv::Point> points;     //unique silhouette pixels
+        cv::Mat visited;                   //CV_8UC1 mask of the image size, all zero between renderings
+        int sample_step;                   //keep every sample_step-th pixel along an edge, 1 keeps all of them
+        cv::Rect roi;                      //projected bounding box of the last rendering, clipped to the image
+        std::vector<silhouetteCache> silhouette_caches;    //one per part, see incrementalSilhouetteAngle
+        std::vector<cv::Point2d> tool_edges;   //edges of every part of the last renderToolPoints, for calculateDirectionalScore
+
+        renderBuffer(int rows = 480, int cols = 640, int step = 1) {
+            visited = cv::Mat::zeros(rows, cols, CV_8UC1);
+            sample_step = step;
+        }
+    };
 
     /**
-     * This is the part for UKF tracking, in order to get part of the oval vertice and normals
+     * @brief Buffers of renderToolBatch: the silhouette pixels of every pose, and the scratch of the block of poses
+     * being evaluated together
      */
-    std::vector<glm::vec3> oval_normal_vertices;
-    std::vector<glm::vec3> oval_normal_Vnormal;
-    std::vector<cv::Point3d> oval_normal_Vpts;
-    std::vector<cv::Point3d> oval_normal_Npts;
-    cv::Mat oval_normal_Vmat;
-    cv::Mat oval_normal_Nmat;
+    struct renderBatch {
+        renderBuffer buffer;                            //mask and sample step shared by every pose, see renderBuffer
+        renderBuffer right_buffer;                      //the right camera of scoreToolPoints, buffer is the left one
+        std::vector<std::vector<cv::Point> > points;    //unique silhouette pixels of every pose
+        std::vector<cv::Rect> rois;                     //projected bounding box of every pose, clipped to the image
+
+        std::vector<int> visible;                       //poses whose bounding box reaches the image
+        std::vector<cv::Point2f> projected;             //every vertex projected for every pose of the block, pose minor
+        std::vector<meshScalar> facing;                 //every face classified for every pose of the block, pose minor
+        std::vector<std::vector<cv::Point2d> > edges;   //projected end points of the silhouette edges of every block pose
+        std::vector<std::vector<cv::Point2d> > tool_edges;  //the silhouette edges of every pose, for calculateDirectionalScore
+
+        renderBatch(int rows = 480, int cols = 640, int step = 1) : buffer(rows, cols, step),
+                                                                    right_buffer(rows, cols, step) {}
+    };
 
-    std::vector<std::vector<int> > oval_normal_faces;
-    std::vector<std::vector<int> > oval_normal_neighbors;
-    cv::Mat oval_normalFace_normal;
-    cv::Mat oval_normalFace_centroid;
+    /**
+     * The tool model pieces: cylinder, oval, gripper 1 and 2
+     */
+    toolMesh body_mesh;         ///cylinder
+    toolMesh ellipse_mesh;      ///oval
+    toolMesh gripper1_mesh;     ///griper1
+    toolMesh gripper2_mesh;     ///griper2
+
+    /**
+     * This is the part for UKF tracking, in order to get part of the oval vertice and normals
+     */
+    toolMesh oval_normal_mesh;
 
     /**
      * The offsets for modify model
@@ -164,15 +252,99 @@ public:
     double offset_ellipse; // all in meters
     double offset_gripper; //
 
+    /**
+     * Drawing the body from its closed form, two tangent lines and the end face ellipses, instead of walking its
+     * mesh edges. Within a pixel of the mesh silhouette; off by default. The UKF rendering always uses the mesh
+     */
+    bool analyticBody;
+
+    /**
+     * Rendering through a renderBuffer, only re-test the faces around the previous silhouette of the part when the
+     * camera moved by less than this angle (radians, seen from the part) since that pose, following the silhouette as
+     * it moves. A silhouette loop appearing away from the old one is missed, so keep it small; 0 tests every face.
+     * The pixels of a pose then depend on the pose rendered before it through the same buffer: the particle filter
+     * resets the caches for every stripe of particles, so its scores depend on the thread count when this is set
+     */
+    double incrementalSilhouetteAngle;
+
+    /**
+     * Parts of at least this many faces get the face cluster hierarchy, see buildClusters. It only pays off above
+     * about 16k faces (the default), which none of the tool_parts reaches; cluster_benchmark measures the crossover.
+     * Read when a part is loaded, it is part of the mesh cache key
+     */
+    int clusterMinFaces;
+
+    /**
+     * Orientation channels of the directional chamfer: with channels, prepareScoringContext also splits the segmented
+     * edges by orientation and integrates, along every channel direction, a distance that adds directionalWeight
+     * pixels per radian of orientation mismatch, truncated at directionalTruncation pixels. calculateDirectionalScore
+     * then costs a few lookups per silhouette edge whatever its length. 0 (default) only builds the plain distance
+     */
+    int directionalChannels;
+    double directionalWeight;
+    double directionalTruncation;
+
+    /**
+     * Storing the distance transform of the scoring context quantized, 8 bits per pixel when its levels stay within
+     * distanceTolerance pixels, 16 otherwise, so the map of a frame stays in cache while the particles are scored.
+     * Distances saturate at distanceTruncation pixels, 0 keeps the farthest one and the scores stay within the
+     * tolerance of the float map; a radius also changes the scores of the particles beyond it. Off by default
+     */
+    bool quantizedDistance;
+    double distanceTruncation;
+    double distanceTolerance;
+
+    /**
+     * prepareScoringContext also caches the blurred segmented image of calculateMatchingScore, and its energy, so
+     * the normalized cross correlation of a rendering is a gather over its pixels; the particle filter then scores
+     * with it instead of the chamfer. Off by default
+     */
+    bool correlationScoring;
+
     /**
      * Constructor
      */
     ToolModel();
 
     /**
-     * Offset the model parts
+     * @brief Offset a model part: move its lowest vertex to y = 0, then shift it along y, in inches
+     * @param mesh
+     * @param y_shift
+     */
+    void offsetModel(toolMesh &mesh, double y_shift);
+
+    /**
+     * @brief Loading one tool part with its offsets, meter-space geometry, adjacency and face info. Maps the baked
+     * mesh cache (path + ".cache", or $ROS_HOME/tool_model/<name>.cache when the package directory is read-only) when
+     * its key matches the OBJ file, otherwise parses the OBJ and bakes the cache.
+     * @param path : absolute path of the OBJ file
+     * @param recenter : apply offsetModel to the vertices
+     * @param y_shift : shift given to offsetModel
+     * @param mesh : output part
      */
-    void offsetModel();
+    void loadToolPart(const std::string &path, bool recenter, double y_shift, toolMesh &mesh);
+
+    /**
+     * @brief Key of the mesh cache: hash of the OBJ file content, the offsets, clusterMinFaces and the cache version
+     * @param path
+     * @param recenter
+     * @param y_shift
+     * @return the key, 0 if the OBJ file cannot be read
+     */
+    uint64_t meshCacheKey(const std::string &path, bool recenter, double y_shift);
+
+    /**
+     * @brief Mapping a baked mesh cache, fails if it is missing, truncated, indexes out of its own arrays or was
+     * baked with another key
+     * @return true if the outputs are filled from the cache
+     */
+    bool loadMeshCache(const std::string &cache_path, uint64_t key, toolMesh &mesh);
+
+    /**
+     * @brief Baking a loaded part into the mesh cache, creating the directories above it if needed
+     * @return false if the cache cannot be written
+     */
+    bool saveMeshCache(const std::string &cache_path, uint64_t key, const toolMesh &mesh);
 
     /**
      * @brief Random number generators
@@ -182,29 +354,18 @@ public:
 
     /**
      * @brief loading the vertices and normals of the tool model and use the faces to represent the tool, offline.
+     * The file is read by parseOBJ (obj_parser.h), polygons come out as triangle fans.
      * @param path : absolute path
-     * @param out_vertices : output vertices
-     * @param vertex_normal : output vertex normals
-     * @param out_faces : output faces
-     * @param neighbor_faces : output neighbor faces
+     * @param mesh : output vertices, vertex normals, faces and neighbor faces, in inches
+     * @return false if the file cannot be parsed or a face has no vertex normals
      */
-    void
-    load_model_vertices(const char *path, std::vector<glm::vec3> &out_vertices, std::vector<glm::vec3> &vertex_normal,
-                        std::vector<std::vector<int> > &out_faces, std::vector<std::vector<int> > &neighbor_faces);
+    bool load_model_vertices(const char *path, toolMesh &mesh);
 
     /**
-     * @brief Adjusting the model geometry put four body parts back to their own frames
-     * @param input_vertices
-     * @param input_Vnormal
-     * @param input_Vpts
-     * @param input_Npts
-     * @param offset
-     * @param input_Vmat
-     * @param input_Nmat
+     * @brief Adjusting the model geometry put four body parts back to their own frames, converting them to meters
+     * @param mesh
      */
-    void modify_model_(std::vector<glm::vec3> &input_vertices, std::vector<glm::vec3> &input_Vnormal,
-                       std::vector<cv::Point3d> &input_Vpts, std::vector<cv::Point3d> &input_Npts, double &offset,
-                       cv::Mat &input_Vmat, cv::Mat &input_Nmat);//there are offsets when loading the model convert
+    void modify_model_(toolMesh &mesh);
 
     /**
      * @brief Generating random particles when given a seed pose
@@ -228,15 +389,66 @@ public:
                           const double &theta_grip_2);
 
     /**
-     * @brief The rendering function  of four body parts, for PF
+     * @brief Projecting the bounding boxes of the four body parts for one pose, eight corners per part
+     * @param tool
+     * @param CamMat
+     * @param P
+     * @param image_size
+     * @return the box holding every silhouette pixel of the pose, clipped to the image: empty when the tool is
+     * entirely off-image, the whole image when a part reaches behind the camera
+     */
+    cv::Rect projectedBoundingBox(const toolModel &tool, const cv::Mat &CamMat, const cv::Mat &P,
+                                  const cv::Size &image_size);
+
+    /**
+     * @brief The rendering function  of four body parts, for PF. Draws with cv::line, for showing the result;
+     * the scoring renders go through renderToolPoints
      * @param image
      * @param tool
      * @param CamMat
      * @param P
+     * @param jac : optional, one row per end point of the drawn silhouette edges (two per edge, part by part): its
+     * u and v derivatives with respect to q = (rvec_cyl, tvec_cyl, theta_ellipse, theta_grip_1, theta_grip_2), 2 x 9
+     * CV_64FC1 columns. The joint angles follow computeEllipsePose, with the jaws open
      */
     void renderTool(cv::Mat &image, const toolModel &tool, cv::Mat &CamMat, const cv::Mat &P,
                         cv::OutputArray = cv::noArray());
 
+    /**
+     * @brief The rendering function of four body parts into a silhouette point list, for the sparse PF scoring.
+     * Poses whose projected bounding box misses the image are rejected before any silhouette work
+     * @param buffer : output silhouette pixels in buffer.points, their bounding box in buffer.roi
+     * @param tool
+     * @param CamMat
+     * @param P
+     * @param jac : optional, as for renderTool, no rows for a rejected pose
+     */
+    void renderToolPoints(renderBuffer &buffer, const toolModel &tool, cv::Mat &CamMat, const cv::Mat &P,
+                          cv::OutputArray = cv::noArray());
+
+    /**
+     * @brief The rendering function of four body parts for many poses into silhouette point lists, for the sparse PF
+     * scoring. The poses go through in blocks: every vertex is projected and every face classified for the whole
+     * block at once (SIMD across the poses when the compiler targets AVX or SSE2), and each edge list is walked once
+     * per block. Gives the same pixels as renderToolPoints on every pose (with incrementalSilhouetteAngle at 0)
+     * @param tools
+     * @param cams : camera matrix of every pose
+     * @param P
+     * @param outputs : outputs.points[i] and outputs.rois[i] of pose range.start + i
+     * @param range : the poses to render, all of them by default
+     * @param level : the pyramid level P projects onto, P scaled by 2^-level with the pixel centres aligned as
+     * cv::resize aligns them; the silhouette edges are kept within the same part of the image as at full resolution
+     */
+    void renderToolBatch(const std::vector<toolModel> &tools, const std::vector<cv::Mat> &cams, const cv::Mat &P,
+                         renderBatch &outputs, const cv::Range &range = cv::Range::all(), int level = 0);
+
+    /**
+     * @brief Forgetting the silhouettes kept in a render buffer (see incrementalSilhouetteAngle), so its next pose of
+     * every part tests every face, as after construction
+     * @param buffer
+     */
+    void resetSilhouetteCaches(renderBuffer &buffer);
+
     /**
      * @brief The rendering function for UKF, need vertex normals to compute measurement model
      * @param image
@@ -245,6 +457,8 @@ public:
      * @param P
      * @param tool_points
      * @param tool_normals
+     * @param jac : optional, one row per row of tool_points: the derivatives of u, v and of the normal projected
+     * measurement tool_normals . (u, v) with respect to q as in renderTool, 3 x 9 CV_64FC1 columns
      */
     void renderToolUKF(cv::Mat &image, const toolModel &tool, cv::Mat &CamMat, const cv::Mat &P,
                        cv::Mat &tool_points, cv::Mat &tool_normals, cv::OutputArray = cv::noArray());
@@ -258,59 +472,210 @@ public:
     cv::Point2d reproject(const cv::Mat &point, const cv::Mat &P);
 
     /**
-     * @brief Computing the matching score using opencv function: templatemathcing.
+     * @brief Computing the matching score using normalized cross correlation, as opencv templatematching of two
+     * images of the same size, building the blurred segmented image on the fly.
+     * Use the scoringContext version when scoring many rendered images against the same segmented image.
      * @param toolImage
      * @param segmentedImage
      * @return
      */
     float calculateMatchingScore(cv::Mat &toolImage, const cv::Mat &segmentedImage);
+
+    /**
+     * @brief Computing the matching score using normalized cross correlation against the cached blurred image
+     * @param toolImage : rendered CV_8UC3 image, or a CV_8UC1 grey / mask image used as is
+     * @param context : scoring context built with correlationScoring, see prepareScoringContext
+     * @return the correlation, 0 for an empty render or a context without the blurred image
+     */
+    float calculateMatchingScore(cv::Mat &toolImage, const scoringContext &context);
+
+    /**
+     * @brief Computing the matching score using normalized cross correlation on a list of silhouette pixels: the
+     * render has one grey level, so it is the sum of the blurred image at the pixels over sqrt(pixels * energy).
+     * Matches the rendered image version
+     * @param points : silhouette pixels of one rendering, see renderToolPoints and renderToolBatch
+     * @param sample_step : the sample step they were rasterized with
+     * @param context : scoring context built with correlationScoring, see prepareScoringContext
+     * @return the correlation, 0 for an empty render or a context without the blurred image
+     */
+    float calculateMatchingScore(const std::vector<cv::Point> &points, int sample_step, const scoringContext &context);
+    /**
+     * @brief Building the per-frame scoring context (distance transform) of a segmented image, quantized with
+     * quantizedDistance
+     * @param segmentedImage
+     * @param context : output scoring context
+     * @param directional : also build the orientation channels of directionalChannels
+     */
+    void prepareScoringContext(const cv::Mat &segmentedImage, scoringContext &context, bool directional = true);
+
     /**
      * @brief Computing the matching score using Chamfer matching algorithm.
+     * @param toolImage : rendered CV_8UC3 image, or a CV_8UC1 grey / mask image used as is
+     * @param context : scoring context of the segmented image, see prepareScoringContext
+     * @return
+     */
+    float calculateChamferScore(cv::Mat &toolImage, const scoringContext &context);
+
+    /**
+     * @brief Computing the matching score using Chamfer matching algorithm on the silhouette pixels of renderToolPoints.
+     * The cost is a gather of the distance transform at those pixels, and matches the rendered image version.
+     * @param buffer
+     * @param context : scoring context of the segmented image, see prepareScoringContext
+     * @return
+     */
+    float calculateChamferScore(const renderBuffer &buffer, const scoringContext &context);
+
+    /**
+     * @brief Computing the matching score using Chamfer matching algorithm on a list of silhouette pixels
+     * @param points : silhouette pixels of one rendering, see renderToolPoints and renderToolBatch
+     * @param sample_step : the sample step they were rasterized with
+     * @param context : scoring context of the segmented image, see prepareScoringContext
+     * @return
+     */
+    float calculateChamferScore(const std::vector<cv::Point> &points, int sample_step, const scoringContext &context);
+
+    /**
+     * @brief renderToolPoints and the sparse calculateChamferScore of one pose under both cameras, part by part from
+     * the shaft with the two cameras in turn, giving up on the pose as soon as sqrt(left^2 + right^2) cannot reach
+     * min_score: the distances only add up, so the partial sums bound both scores from above, and a camera that has
+     * not rendered anything yet is bounded by 1. Same score as the four calls when it runs to the end
+     * @param buffer_left : as for renderToolPoints, the pixels rendered under the left camera until it stopped
+     * @param buffer_right : the same under the right camera
+     * @param tool
+     * @param Cam_left
+     * @param P_left
+     * @param context_left : scoring context of the left segmented image, see prepareScoringContext
+     * @param Cam_right
+     * @param P_right
+     * @param context_right : scoring context of the right segmented image
+     * @param min_score : the combined score the pose has to reach, 0 renders every part
+     * @param aborted : output, true when it stopped early
+     * @return the combined score sqrt(left^2 + right^2), or when aborted its upper bound, below min_score
+     */
+    double scoreToolPoints(renderBuffer &buffer_left, renderBuffer &buffer_right, const toolModel &tool,
+                           cv::Mat &Cam_left, const cv::Mat &P_left, const scoringContext &context_left,
+                           cv::Mat &Cam_right, const cv::Mat &P_right, const scoringContext &context_right,
+                           double min_score, bool &aborted);
+
+    /**
+     * @brief Computing the matching score using Chamfer matching algorithm, building the scoring context on the fly.
+     * Use the scoringContext version when scoring many rendered images against the same segmented image.
      * @param toolImage
      * @param segmentedImage
      * @return
      */
     float calculateChamferScore(cv::Mat &toolImage, const cv::Mat &segmentedImage);
 
+    /**
+     * @brief Computing the matching score using directional Chamfer matching: every silhouette edge is matched against
+     * the segmented edges of its own orientation, summed from the line integrals of the context. Same scale as
+     * calculateChamferScore with a sample step of 1, except that pixels shared by two edges count twice.
+     * @param edges : projected end points of the silhouette edges, two per edge, see renderBuffer and renderBatch tool_edges
+     * @param context : scoring context built with directionalChannels, see prepareScoringContext
+     * @return
+     */
+    float calculateDirectionalScore(const std::vector<cv::Point2d> &edges, const scoringContext &context);
+
     /**
      * @brief Silhouette extraction function, using the prepared vertex normals and vertices
-     * @param input_faces
-     * @param neighbor_faces
-     * @param input_Vmat
-     * @param input_Nmat
+     * @param mesh
      * @param CamMat
      * @param image
      * @param rvec
      * @param tvec
      * @param P
-     * @param jac
+     * @param jac : optional, one row per end point of the drawn silhouette edges (two per edge): its u and v
+     * derivatives with respect to (rvec, tvec) of the part, 2 x 6 CV_64FC1 columns
      */
-    void Compute_Silhouette(const std::vector<std::vector<int> > &input_faces,
-                            const std::vector<std::vector<int> > &neighbor_faces,
-                            const cv::Mat &input_Vmat, const cv::Mat &input_Nmat,
-                            cv::Mat &CamMat, cv::Mat &image, const cv::Mat &rvec, const cv::Mat &tvec,
-                            const cv::Mat &P, cv::OutputArray jac);
+    void Compute_Silhouette(const toolMesh &mesh, cv::Mat &CamMat, cv::Mat &image, const cv::Mat &rvec, const cv::Mat &tvec,
+                            const cv::Mat &P, cv::OutputArray jac = cv::noArray());
+
+    /**
+     * @brief Silhouette extraction function rasterizing into the silhouette pixel list of the buffer
+     * @param mesh
+     * @param CamMat
+     * @param buffer
+     * @param rvec
+     * @param tvec
+     * @param P
+     * @param jac : optional, as for the image, for the end points of buffer.edges
+     */
+    void Compute_Silhouette(const toolMesh &mesh, cv::Mat &CamMat, renderBuffer &buffer, const cv::Mat &rvec, const cv::Mat &tvec,
+                            const cv::Mat &P, cv::OutputArray jac = cv::noArray());
+
+    /**
+     * @brief Rasterizing one line into a binary CV_8UC1 mask with the pixels of cv::line (thickness 1, 8-connected):
+     * end points rounded, clipped to the mask, walked left to right. Pixels already set in the mask are skipped
+     * @param mask : binary mask, the new pixels are set to 1
+     * @param pt1
+     * @param pt2
+     * @param step : keep every step-th pixel along the line, 1 keeps all of them
+     * @param points : output, the new pixels are appended
+     * @return the number of new pixels
+     */
+    int rasterizeEdge(cv::Mat &mask, const cv::Point2d &pt1, const cv::Point2d &pt2, int step,
+                      std::vector<cv::Point> &points);
+
+    /**
+     * @brief Finding the silhouette edges of one part, shared by the Compute_Silhouette functions. With analyticBody,
+     * a part with a valid closed form is drawn from it, falling back to the mesh when the camera is inside its axis
+     * cylinder
+     * Parts with a cluster hierarchy skip the clusters entirely front or back facing, see buildClusters
+     * @param mesh
+     * @param camera_mesh : scratch for the part under the camera frame, not filled by the closed form or the clusters
+     * @param CamMat
+     * @param rvec
+     * @param tvec
+     * @param P
+     * @param silhouette_edges : output projected end points, two per edge
+     * @param cache : previous silhouette of the part, re-tested instead of every face when the pose is close enough
+     * (see incrementalSilhouetteAngle) and updated; NULL tests every face
+     * @param edge_points : optional output, the part frame point of every end point, for the Jacobians
+     */
+    void Compute_Silhouette_Edges(const toolMesh &mesh, cameraMesh &camera_mesh, cv::Mat &CamMat,
+                                  const cv::Mat &rvec, const cv::Mat &tvec, const cv::Mat &P,
+                                  std::vector<cv::Point2d> &silhouette_edges, silhouetteCache *cache = NULL,
+                                  std::vector<cv::Point3d> *edge_points = NULL);
 
     /**
      * @brief Silhouette extraction function for UKF, need extra vertices_vector, stores the sampled vertices
-     * @param input_faces
-     * @param neighbor_faces
-     * @param input_Vmat
-     * @param input_Nmat
+     * @param mesh
      * @param CamMat
      * @param image
      * @param rvec
      * @param tvec
      * @param P
-     * @param vertices_vector
-     * @param jac
+     * @param vertices_vector : output samples, the edge midpoint x, y, its normal x, y, then the part frame end
+     * points of the edge
+     * @param jac : optional, one row per sample added: the derivatives of x, y and of the normal projected
+     * measurement unit normal . (x, y) with respect to (rvec, tvec) of the part, 3 x 6 CV_64FC1 columns
      */
-    void Compute_Silhouette_UKF(const std::vector<std::vector<int> > &input_faces,
-                                           const std::vector<std::vector<int> > &neighbor_faces,
-                                           const cv::Mat &input_Vmat, const cv::Mat &input_Nmat,
-                                           cv::Mat &CamMat, cv::Mat &image, const cv::Mat &rvec, const cv::Mat &tvec,
-                                           const cv::Mat &P, std::vector<std::vector<double> > &vertices_vector,
-                                           cv::OutputArray jac);
+    void Compute_Silhouette_UKF(const toolMesh &mesh, cv::Mat &CamMat, cv::Mat &image, const cv::Mat &rvec,
+                                const cv::Mat &tvec, const cv::Mat &P,
+                                std::vector<std::vector<double> > &vertices_vector, cv::OutputArray jac = cv::noArray());
+
+    /**
+     * @brief Bringing a part to the image for one pose: builds CamMat * [R(rvec) | tvec] and projects every vertex
+     * once with the fused P * CamMat * [R | tvec] (SIMD when the compiler targets AVX or SSE2)
+     * @param mesh
+     * @param CamMat
+     * @param rvec
+     * @param tvec
+     * @param P
+     * @param camera_mesh : output
+     * @param with_normals : also transform the vertex normals under the camera frame, only the UKF measurement needs them
+     */
+    void transformMesh(const toolMesh &mesh, const cv::Mat &CamMat, const cv::Mat &rvec, const cv::Mat &tvec,
+                       const cv::Mat &P, cameraMesh &camera_mesh, bool with_normals = false);
+
+    /**
+     * @brief Classifying every face of the part once for the current pose, fills camera_mesh.facing. The pose is rigid,
+     * so rotating the cached face normal and centroid into the camera frame is the same as testing them against the
+     * camera position brought into the part frame: one dot product per face
+     * @param mesh
+     * @param camera_mesh : the part under the camera frame, see transformMesh
+     */
+    void classifyFaces(const toolMesh &mesh, cameraMesh &camera_mesh);
 
     /**
      * @brief Computing cross product for cv::Point3d
@@ -335,19 +700,6 @@ public:
      */
     cv::Point3d Normalize(cv::Point3d &vec1);
 
-    /**
-     * @brief Converting the 3D points in inch to meters, using this in the loading function
-     * @param input_vertices
-     */
-    void ConvertInchtoMeters(std::vector<cv::Point3d> &input_vertices);
-
-    /**
-     * @brief Converting the opengl points to opencv points
-     * @param input_vertices
-     * @param out_vertices
-     */
-    void Convert_glTocv_pts(std::vector<glm::vec3> &input_vertices, std::vector<cv::Point3d> &out_vertices);
-
     /**
      * @brief Compute a so(3) skew symetric matrix using the w vector
      * @param w
@@ -378,23 +730,81 @@ public:
 
     /**
      * @brief Computing the shared vertices in orderto find the neighbor face later in the load_model_vertices function
-     * @param vec1
-     * @param vec2
-     * @param match_vec
+     * @param mesh
+     * @param face1
+     * @param face2
+     * @param match_vec : the shared vertices of face1, each followed by its vertex normal
      * @return
      */
-    int Compare_vertex(std::vector<int> &vec1, std::vector<int> &vec2, std::vector<int> &match_vec);
+    int Compare_vertex(const toolMesh &mesh, int face1, int face2, std::vector<int> &match_vec);
+
+    /**
+     * @brief Finding the neighbor faces (sharing an edge) of every face, in O(F) using an edge -> face hash map.
+     * Gives the same neighbor lists as comparing every pair of faces with Compare_vertex
+     * @param mesh : fills neighbor_start and neighbor_data from the faces
+     */
+    void buildNeighborFaces(toolMesh &mesh);
+
+    /**
+     * @brief Building the list of shared edges from the neighbor faces, every pair of neighbor faces once.
+     * Both views of the shared vertices are kept so the silhouette is drawn from the front facing side, as before
+     * @param mesh : fills edge_data from neighbor_start and neighbor_data
+     */
+    void buildEdgeList(toolMesh &mesh);
+
+    /**
+     * @brief Building the face cluster hierarchy of a part with many faces, offline (it is baked in the mesh cache).
+     * Clusters are split in halves along their widest spread of face normal or centroid down to a few faces, and keep
+     * the cone bounding their face normals and the sphere bounding their centroids: from some viewpoints this proves
+     * every face of the cluster front facing, or every face back facing, and its faces and edges are skipped
+     * @param mesh : fills cluster_faces, cluster_data and cluster_bounds from the face info, or clears them for parts
+     * under clusterMinFaces faces, where testing every face is cheaper
+     */
+    void buildClusters(toolMesh &mesh);
+
+    /**
+     * @brief Finding the leaf of every face and the cluster where the two faces of every shared edge part ways
+     * @param mesh : fills cluster_position, cluster_leaf, cluster_edge_start and cluster_edge_data from the hierarchy
+     * and the edge list
+     */
+    void buildClusterEdges(toolMesh &mesh);
+
+    /**
+     * @brief Listing the shared edges of every face, from the edge list
+     * @param mesh : fills face_edge_start and face_edge_data from edge_data
+     */
+    void buildFaceEdges(toolMesh &mesh);
+
+    /**
+     * @brief Hash key of an undirected edge, the sorted vertex indices packed in 64 bits
+     * @param v1
+     * @param v2
+     * @return
+     */
+    static uint64_t edgeKey(int v1, int v2) {
+        uint32_t lo = (uint32_t) std::min(v1, v2);
+        uint32_t hi = (uint32_t) std::max(v1, v2);
+        return ((uint64_t) hi << 32) | lo;
+    };
 
     /**
      * @brief Finding the face centroid and the face normal
-     * @param input_faces
-     * @param input_vertices
-     * @param input_Vnormal
-     * @param face_normals
-     * @param face_centroids
+     * @param mesh : fills the face normals and centroids from the vertices, vertex normals and faces
+     */
+    void getFaceInfo(toolMesh &mesh);
+
+    /**
+     * @brief Fitting the closed form of a cylindrical part: the axis and end faces from the bounding box, the radius
+     * from the rim vertices
+     * @param mesh : fills mesh.cylinder, left invalid if a vertex is neither on the axis nor on the rim
+     */
+    void fitCylinder(toolMesh &mesh);
+
+    /**
+     * @brief Finding the axis aligned bounding box of a part
+     * @param mesh : fills box_min and box_max from the vertices
      */
-    void getFaceInfo(const std::vector<std::vector<int> > &input_faces, const std::vector<cv::Point3d> &input_vertices,
-                     const std::vector<cv::Point3d> &input_Vnormal, cv::Mat &face_normals, cv::Mat &face_centroids);
+    void getBoundingBox(toolMesh &mesh);
 
     /**
      * @brief Transforming the input matrix under the camera frame
@@ -411,8 +821,10 @@ public:
      * @param part3_normals
      * @param tool_points
      * @param tool_normals
+     * @param samples : optional output, the samples kept, in the order of tool_points
      */
-    void gatherNormals(std::vector< std::vector<double> > &part1_normals, std::vector< std::vector<double> > &part2_normals, std::vector< std::vector<double> > &part3_normals, cv::Mat &tool_points, cv::Mat &tool_normals);
+    void gatherNormals(std::vector< std::vector<double> > &part1_normals, std::vector< std::vector<double> > &part2_normals, std::vector< std::vector<double> > &part3_normals, cv::Mat &tool_points, cv::Mat &tool_normals,
+                       std::vector< std::vector<double> > *samples = NULL);
 
 };
 
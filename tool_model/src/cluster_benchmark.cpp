@@ -0,0 +1,152 @@
+/*
+*  Copyright (c) 2016
+*  Ran Hao <rxh349@case.edu>
+*
+*  All rights reserved.
+*
+*  @The functions in this file time the silhouette pass with and without the face cluster hierarchy
+*/
+
+#include <ros/ros.h>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <tool_model_lib/tool_model.h>
+
+using namespace std;
+
+/*** a torus of about num_faces faces in the tool_parts units (inches), with its vertex normals ***/
+bool writeTorus(const std::string &path, int num_faces) {
+
+    int nu = std::max(8, (int) sqrt(num_faces));
+    int nv = std::max(4, num_faces / (2 * nu));
+    double R = 0.4, r = 0.16;
+
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == NULL) return false;
+
+    for (int i = 0; i < nu; ++i) {
+        for (int j = 0; j < nv; ++j) {
+            double u = 2 * CV_PI * i / nu, v = 2 * CV_PI * j / nv;
+            fprintf(file, "v %.9f %.9f %.9f\n", (R + r * cos(v)) * cos(u), r * sin(v), (R + r * cos(v)) * sin(u));
+        }
+    }
+    for (int i = 0; i < nu; ++i) {
+        for (int j = 0; j < nv; ++j) {
+            double u = 2 * CV_PI * i / nu, v = 2 * CV_PI * j / nv;
+            fprintf(file, "vn %.9f %.9f %.9f\n", cos(v) * cos(u), sin(v), cos(v) * sin(u));
+        }
+    }
+    for (int i = 0; i < nu; ++i) {
+        for (int j = 0; j < nv; ++j) {
+            int a = i * nv + j + 1, b = (i + 1) % nu * nv + j + 1;
+            int c = (i + 1) % nu * nv + (j + 1) % nv + 1, d = i * nv + (j + 1) % nv + 1;
+            fprintf(file, "f %d//%d %d//%d %d//%d\n", a, a, c, c, b, b);
+            fprintf(file, "f %d//%d %d//%d %d//%d\n", a, a, d, d, c, c);
+        }
+    }
+
+    return fclose(file) == 0;
+}
+
+/*** the full pass against the cluster pass on the same random poses: time per pose, and the poses whose edges differ ***/
+void benchmark(ToolModel &model, const ToolModel::toolMesh &mesh, const std::string &name, const cv::Mat &P,
+               int num_poses) {
+
+    /* the same part with and without the hierarchy, whatever its size */
+    ToolModel::toolMesh flat = mesh, clustered = mesh;
+    flat.cluster_faces.clear();
+    flat.cluster_data.clear();
+    flat.cluster_bounds.clear();
+    model.buildClusterEdges(flat);
+    int min_faces = model.clusterMinFaces;
+    model.clusterMinFaces = 0;
+    model.buildClusters(clustered);
+    model.buildClusterEdges(clustered);
+    model.clusterMinFaces = min_faces;
+
+    /* the part about 20 diagonals in front of the camera, it fills a good part of the image */
+    cv::Point3d center = (flat.box_min + flat.box_max) * 0.5;
+    double distance = 20.0 * cv::norm(flat.box_max - flat.box_min);
+
+    cv::Mat CamMat = cv::Mat::eye(4, 4, CV_64FC1);
+    ToolModel::cameraMesh camera_mesh;
+    std::vector<cv::Point2d> flat_edges, cluster_edges;
+    double flat_time = 0.0, cluster_time = 0.0;
+    int mismatches = 0;
+
+    for (int i = 0; i < num_poses; ++i) {
+        cv::Mat rvec(3, 1, CV_64FC1), R;
+        for (int k = 0; k < 3; ++k) {
+            rvec.at<double>(k) = model.randomNum(-CV_PI, CV_PI);
+        }
+        cv::Rodrigues(rvec, R);
+        cv::Mat offset = (cv::Mat_<double>(3, 1) << model.randomNum(-0.1, 0.1) * distance,
+                model.randomNum(-0.1, 0.1) * distance, distance);
+        cv::Mat origin = (cv::Mat_<double>(3, 1) << center.x, center.y, center.z);
+        cv::Mat tvec = offset - R * origin;
+
+        flat_edges.clear();
+        cluster_edges.clear();
+        double start = (double) cv::getTickCount();
+        model.Compute_Silhouette_Edges(flat, camera_mesh, CamMat, rvec, tvec, P, flat_edges);
+        double middle = (double) cv::getTickCount();
+        model.Compute_Silhouette_Edges(clustered, camera_mesh, CamMat, rvec, tvec, P, cluster_edges);
+        double end = (double) cv::getTickCount();
+        flat_time += middle - start;
+        cluster_time += end - middle;
+
+        if (flat_edges != cluster_edges) mismatches++;
+    }
+
+    double us = 1e6 / (cv::getTickFrequency() * num_poses);
+    ROS_INFO("%s: %d faces, %d edges, %d clusters: full pass %.1f us, clusters %.1f us (%.2fx), %d of %d poses differ",
+             name.c_str(), flat.numFaces(), flat.numEdges(), clustered.numClusters(), flat_time * us,
+             cluster_time * us, flat_time / std::max(cluster_time, 1.0), mismatches, num_poses);
+}
+
+/*** times the tool parts and tori of 4k to 256k faces, or the OBJ files given ***/
+int main(int argc, char **argv) {
+
+    ros::init(argc, argv, "cluster_benchmark");
+
+    ToolModel newToolModel;
+    newToolModel.analyticBody = false;
+
+    cv::Mat P = (cv::Mat_<double>(3, 4) << 893.7852590197848, 0, 288.4443244934082, 0,
+            0, 893.7852590197848, 259.7727756500244, 0,
+            0, 0, 1, 0);
+    int num_poses = 1000;
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            ToolModel::toolMesh mesh;
+            newToolModel.loadToolPart(argv[i], false, 0.0, mesh);
+            if (mesh.numFaces() > 0) benchmark(newToolModel, mesh, argv[i], P, num_poses);
+        }
+        return 0;
+    }
+
+    benchmark(newToolModel, newToolModel.body_mesh, "body", P, num_poses);
+    benchmark(newToolModel, newToolModel.ellipse_mesh, "ellipse", P, num_poses);
+    benchmark(newToolModel, newToolModel.gripper1_mesh, "gripper", P, num_poses);
+
+    /* the high resolution meshes are generated under $ROS_HOME, with their mesh caches */
+    const char *ros_home = getenv("ROS_HOME");
+    const char *home = getenv("HOME");
+    std::string directory = ros_home != NULL ? ros_home : std::string(home != NULL ? home : "/tmp") + "/.ros";
+    for (int faces = 4096; faces <= 262144; faces *= 4) {
+        char name[64];
+        sprintf(name, "/cluster_benchmark_torus_%d.obj", faces);
+        std::string path = directory + name;
+        ToolModel::toolMesh mesh;
+        if (!writeTorus(path, faces)) {
+            ROS_WARN("Cannot write %s", path.c_str());
+            continue;
+        }
+        newToolModel.loadToolPart(path, false, 0.0, mesh);
+        if (mesh.numFaces() > 0) benchmark(newToolModel, mesh, path, P, num_poses);
+    }
+
+    return 0;
+}
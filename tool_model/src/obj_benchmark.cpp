@@ -0,0 +1,161 @@
+/*
+*  Copyright (c) 2016
+*  Ran Hao <rxh349@case.edu>
+*
+*  All rights reserved.
+*
+*  @The functions in this file time the shared OBJ parser against the fscanf loader it replaced
+*/
+
+#include <ros/ros.h>
+#include <ros/package.h>
+#include <dirent.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <opencv2/core/core.hpp>
+#include <tool_model_lib/obj_parser.h>
+
+using namespace std;
+
+/*** the fscanf loader ToolModel and load_model used before parseOBJ, filling the same arrays. It only read v/vt/vn
+ * triangles, a v//vn fallback is added so load_model/obj_tool.obj can be timed too (one more fscanf per face) ***/
+bool fscanfOBJ(const char *path, objMesh &mesh) {
+
+    mesh = objMesh();
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return false;
+
+    bool ok = true;
+    while (1) {
+
+        char lineHeader[128];
+        // read the first word of the line
+        int res = fscanf(file, "%s", lineHeader);
+        if (res == EOF)
+            break; // EOF = End Of File. Quit the loop.
+        // else : parse lineHeader
+        if (strcmp(lineHeader, "v") == 0) {
+            float x, y, z;
+            fscanf(file, "%f %f %f\n", &x, &y, &z);
+            mesh.vertices.push_back(x);
+            mesh.vertices.push_back(y);
+            mesh.vertices.push_back(z);
+        } else if (strcmp(lineHeader, "vt") == 0) {
+            float u, v;
+            fscanf(file, "%f %f\n", &u, &v);
+            mesh.uvs.push_back(u);
+            mesh.uvs.push_back(v);
+        } else if (strcmp(lineHeader, "vn") == 0) {
+            float x, y, z;
+            fscanf(file, "%f %f %f\n", &x, &y, &z);
+            mesh.normals.push_back(x);
+            mesh.normals.push_back(y);
+            mesh.normals.push_back(z);
+        } else if (strcmp(lineHeader, "f") == 0) {
+
+            int vertexIndex[3], uvIndex[3], normalIndex[3];
+            long corners = ftell(file);
+            int matches = fscanf(file, "%d/%d/%d %d/%d/%d %d/%d/%d\n", &vertexIndex[0], &uvIndex[0], &normalIndex[0],
+                                 &vertexIndex[1], &uvIndex[1], &normalIndex[1], &vertexIndex[2], &uvIndex[2],
+                                 &normalIndex[2]);
+            if (matches != 9 && fseek(file, corners, SEEK_SET) == 0) {
+                matches = fscanf(file, "%d//%d %d//%d %d//%d\n", &vertexIndex[0], &normalIndex[0], &vertexIndex[1],
+                                 &normalIndex[1], &vertexIndex[2], &normalIndex[2]);
+                uvIndex[0] = uvIndex[1] = uvIndex[2] = 0;
+                matches = matches == 6 ? 9 : matches;
+            }
+            if (matches != 9) {
+                ok = false;
+                break;
+            }
+            for (int k = 0; k < 3; ++k) {
+                mesh.vertex_indices.push_back(vertexIndex[k] - 1);
+                mesh.uv_indices.push_back(uvIndex[k] - 1);
+                mesh.normal_indices.push_back(normalIndex[k] - 1);
+            }
+        }
+    }
+
+    fclose(file);
+    return ok;
+}
+
+/*** same arrays, bit for bit ***/
+bool sameMesh(const objMesh &a, const objMesh &b) {
+
+    return a.vertices == b.vertices && a.normals == b.normals && a.uvs == b.uvs &&
+           a.vertex_indices == b.vertex_indices && a.uv_indices == b.uv_indices &&
+           a.normal_indices == b.normal_indices;
+}
+
+/*** time per load of both loaders on one file, repeats times each ***/
+void benchmark(const std::string &path, int repeats) {
+
+    objMesh fscanf_mesh, parser_mesh;
+    bool fscanf_ok = true, parser_ok = true;
+
+    double start = (double) cv::getTickCount();
+    for (int i = 0; i < repeats && fscanf_ok; ++i) {
+        fscanf_ok = fscanfOBJ(path.c_str(), fscanf_mesh);
+    }
+    double middle = (double) cv::getTickCount();
+    for (int i = 0; i < repeats && parser_ok; ++i) {
+        parser_ok = parseOBJ(path.c_str(), parser_mesh);
+    }
+    double end = (double) cv::getTickCount();
+
+    double ms = 1e3 / (cv::getTickFrequency() * repeats);
+    if (!parser_ok) {
+        ROS_WARN("%s: parseOBJ cannot read it", path.c_str());
+        return;
+    }
+    if (!fscanf_ok) {
+        ROS_INFO("%s: %d vertices, %d triangles: parseOBJ %.3f ms, the fscanf loader cannot read it",
+                 path.c_str(), parser_mesh.numVertices(), parser_mesh.numTriangles(), (end - middle) * ms);
+        return;
+    }
+    bool same = sameMesh(fscanf_mesh, parser_mesh);
+    ROS_INFO("%s: %d vertices, %d triangles: fscanf %.3f ms, parseOBJ %.3f ms (%.1fx), %s output", path.c_str(),
+             parser_mesh.numVertices(), parser_mesh.numTriangles(), (middle - start) * ms, (end - middle) * ms,
+             (middle - start) / std::max(end - middle, 1.0), same ? "same" : "different");
+}
+
+/*** times load_model/obj_tool.obj and every OBJ file of tool_parts, or the OBJ files given ***/
+int main(int argc, char **argv) {
+
+    ros::init(argc, argv, "obj_benchmark");
+
+    int repeats = 20;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        paths.push_back(argv[i]);
+    }
+
+    if (paths.empty()) {
+        std::string tool_model_pkg = ros::package::getPath("tool_model");
+        paths.push_back(tool_model_pkg + "/../load_model/obj_tool.obj");
+
+        std::string parts = tool_model_pkg + "/tool_parts";
+        std::vector<std::string> names;
+        DIR *dir = opendir(parts.c_str());
+        if (dir != NULL) {
+            for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+                std::string name = entry->d_name;
+                if (name.size() > 4 && name.compare(name.size() - 4, 4, ".obj") == 0) names.push_back(name);
+            }
+            closedir(dir);
+        }
+        std::sort(names.begin(), names.end());
+        for (int i = 0; i < names.size(); ++i) {
+            paths.push_back(parts + "/" + names[i]);
+        }
+    }
+
+    for (int i = 0; i < paths.size(); ++i) {
+        benchmark(paths[i], repeats);
+    }
+
+    return 0;
+}
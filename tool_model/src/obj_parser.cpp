@@ -0,0 +1,389 @@
+/*
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2016 Case Western Reserve University
+ *
+ *    Ran Hao <rxh349@case.edu>
+ *
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of Case Western Reserve University, nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <tool_model_lib/obj_parser.h>
+
+/* corners kept on the stack for one face before it is fanned into triangles */
+static const int max_face_corners = 64;
+
+/* powers of ten that are exact in a double, used by the fast path of parseFloat */
+static const double exact_pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14,
+                                     1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+static inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+};
+
+static inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+};
+
+static inline void skipBlanks(const char *&p, const char *end) {
+    while (p < end && isBlank(*p)) ++p;
+};
+
+static inline const char *nextLine(const char *p, const char *end) {
+    const char *eol = (const char *) memchr(p, '\n', end - p);
+    return eol == NULL ? end : eol + 1;
+};
+
+/* a token ends at a blank, the end of the line or a trailing comment */
+static inline bool atTokenEnd(const char *p, const char *end) {
+    return p == end || isBlank(*p) || *p == '\n' || *p == '#';
+};
+
+/*** decimal to float without locale or allocation: mantissa and exponent are gathered as integers, and when both
+ * are exactly representable a single double multiply or divide gives the correctly rounded value. Anything longer
+ * falls back to strtod on a stack copy of the token ***/
+static bool parseFloat(const char *&p, const char *end, float &out) {
+
+    const char *start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exp10 = 0;
+    bool any_digit = false;
+    bool truncated = false;
+
+    for (; p < end && isDigit(*p); ++p) {
+        any_digit = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa != 0) ++digits;
+        } else {
+            ++exp10;
+            truncated = true;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && isDigit(*p); ++p) {
+            any_digit = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa != 0) ++digits;
+                --exp10;
+            } else {
+                truncated = true;
+            }
+        }
+    }
+    if (!any_digit) {
+        p = start;
+        return false;
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *exp_start = p;
+        ++p;
+        bool exp_negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exp_negative = *p == '-';
+            ++p;
+        }
+        if (p < end && isDigit(*p)) {
+            int exponent = 0;
+            for (; p < end && isDigit(*p); ++p) {
+                if (exponent < 10000) exponent = exponent * 10 + (*p - '0');
+            }
+            exp10 += exp_negative ? -exponent : exponent;
+        } else {
+            p = exp_start;  //a lone 'e' is not part of the number
+        }
+    }
+
+    if (!truncated && mantissa <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+        double value = (double) mantissa;
+        value = exp10 < 0 ? value / exact_pow10[-exp10] : value * exact_pow10[exp10];
+        out = (float) (negative ? -value : value);
+        return true;
+    }
+
+    char token[128];
+    size_t length = p - start;
+    if (length >= sizeof(token)) {
+        p = start;
+        return false;
+    }
+    memcpy(token, start, length);
+    token[length] = '\0';
+    out = strtof(token, NULL);
+    return true;
+};
+
+static bool parseInt(const char *&p, const char *end, int &out) {
+
+    const char *start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+    if (p == end || !isDigit(*p)) {
+        p = start;
+        return false;
+    }
+
+    int value = 0;
+    for (; p < end && isDigit(*p); ++p) {
+        value = value * 10 + (*p - '0');
+    }
+    out = negative ? -value : value;
+    return true;
+};
+
+/*** parse up to count floats of a v/vn/vt line; extra values (w, the third texture coordinate) are ignored ***/
+static bool parseFloats(const char *&p, const char *end, int count, std::vector<float> &out) {
+
+    for (int i = 0; i < count; ++i) {
+        skipBlanks(p, end);
+        float value;
+        if (!parseFloat(p, end, value)) return false;
+        out.push_back(value);
+    }
+    return true;
+};
+
+/*** OBJ indices are 1-based, negative ones count back from the last element read so far ***/
+static inline int resolveIndex(int index, int count) {
+    return index > 0 ? index - 1 : count + index;
+};
+
+/*** one face corner: v, v/vt, v//vn or v/vt/vn ***/
+static bool parseCorner(const char *&p, const char *end, int &v, int &vt, int &vn) {
+
+    vt = 0;
+    vn = 0;
+    if (!parseInt(p, end, v)) return false;
+    if (p < end && *p == '/') {
+        ++p;
+        if (p < end && *p != '/') {
+            if (!parseInt(p, end, vt)) return false;
+        }
+        if (p < end && *p == '/') {
+            ++p;
+            if (!parseInt(p, end, vn)) return false;
+        }
+    }
+    return atTokenEnd(p, end);
+};
+
+/*** number of corners on a face line, used to reserve the triangle arrays ***/
+static int countCorners(const char *p, const char *end) {
+
+    int corners = 0;
+    while (true) {
+        skipBlanks(p, end);
+        if (p == end || *p == '\n' || *p == '#') break;
+        ++corners;
+        while (!atTokenEnd(p, end)) ++p;
+    }
+    return corners;
+};
+
+/*** the statement keyword of a line, as 'v', 'n' (vn), 't' (vt), 'f' or 0 for anything else ***/
+static char lineKeyword(const char *&p, const char *end) {
+
+    skipBlanks(p, end);
+    if (p == end) return 0;
+
+    char keyword = 0;
+    if (*p == 'v') {
+        if (p + 1 < end && isBlank(p[1])) {
+            keyword = 'v';
+            p += 1;
+        } else if (p + 2 < end && (p[1] == 'n' || p[1] == 't') && isBlank(p[2])) {
+            keyword = p[1];
+            p += 2;
+        }
+    } else if (*p == 'f' && p + 1 < end && isBlank(p[1])) {
+        keyword = 'f';
+        p += 1;
+    }
+    return keyword;
+};
+
+static bool parseBuffer(const char *begin, const char *end, const char *path, objMesh &mesh) {
+
+    /* first pass: count every statement so the arrays below never reallocate */
+    size_t num_v = 0, num_vn = 0, num_vt = 0, num_triangles = 0;
+    for (const char *line = begin; line < end; line = nextLine(line, end)) {
+        const char *p = line;
+        switch (lineKeyword(p, end)) {
+            case 'v': ++num_v; break;
+            case 'n': ++num_vn; break;
+            case 't': ++num_vt; break;
+            case 'f': {
+                int corners = countCorners(p, end);
+                if (corners > 2) num_triangles += corners - 2;
+                break;
+            }
+            default: break;
+        }
+    }
+
+    mesh.vertices.reserve(3 * num_v);
+    mesh.normals.reserve(3 * num_vn);
+    mesh.uvs.reserve(2 * num_vt);
+    mesh.vertex_indices.reserve(3 * num_triangles);
+    mesh.uv_indices.reserve(3 * num_triangles);
+    mesh.normal_indices.reserve(3 * num_triangles);
+
+    int corner_v[max_face_corners], corner_vt[max_face_corners], corner_vn[max_face_corners];
+
+    int line_number = 0;
+    for (const char *line = begin; line < end; line = nextLine(line, end)) {
+        ++line_number;
+        const char *p = line;
+        bool ok = true;
+
+        switch (lineKeyword(p, end)) {
+            case 'v': ok = parseFloats(p, end, 3, mesh.vertices); break;
+            case 'n': ok = parseFloats(p, end, 3, mesh.normals); break;
+            case 't': ok = parseFloats(p, end, 2, mesh.uvs); break;
+            case 'f': {
+                int corners = 0;
+                while (ok) {
+                    skipBlanks(p, end);
+                    if (p == end || *p == '\n' || *p == '#') break;
+                    if (corners == max_face_corners) {
+                        ok = false;
+                        break;
+                    }
+                    int v, vt, vn;
+                    ok = parseCorner(p, end, v, vt, vn);
+                    /* a zero index is invalid, a zero uv / normal means the corner does not have one */
+                    if (ok && v == 0) ok = false;
+                    if (!ok) break;
+                    corner_v[corners] = resolveIndex(v, mesh.vertices.size() / 3);
+                    corner_vt[corners] = vt == 0 ? -1 : resolveIndex(vt, mesh.uvs.size() / 2);
+                    corner_vn[corners] = vn == 0 ? -1 : resolveIndex(vn, mesh.normals.size() / 3);
+                    ++corners;
+                }
+                if (corners < 3) ok = false;
+                if (!ok) break;
+
+                for (int k = 1; k + 1 < corners; ++k) {
+                    mesh.vertex_indices.push_back(corner_v[0]);
+                    mesh.vertex_indices.push_back(corner_v[k]);
+                    mesh.vertex_indices.push_back(corner_v[k + 1]);
+                    mesh.uv_indices.push_back(corner_vt[0]);
+                    mesh.uv_indices.push_back(corner_vt[k]);
+                    mesh.uv_indices.push_back(corner_vt[k + 1]);
+                    mesh.normal_indices.push_back(corner_vn[0]);
+                    mesh.normal_indices.push_back(corner_vn[k]);
+                    mesh.normal_indices.push_back(corner_vn[k + 1]);
+                }
+                break;
+            }
+            default: break;
+        }
+
+        if (!ok) {
+            printf("%s:%d: malformed OBJ statement\n", path, line_number);
+            return false;
+        }
+    }
+
+    /* indices may point forward in the file, so they are range checked once everything is read */
+    int num_vertices = mesh.numVertices(), num_normals = mesh.numNormals(), num_uvs = mesh.uvs.size() / 2;
+    for (size_t i = 0; i < mesh.vertex_indices.size(); ++i) {
+        if (mesh.vertex_indices[i] < 0 || mesh.vertex_indices[i] >= num_vertices ||
+            mesh.uv_indices[i] < -1 || mesh.uv_indices[i] >= num_uvs ||
+            mesh.normal_indices[i] < -1 || mesh.normal_indices[i] >= num_normals) {
+            printf("%s: face index out of range\n", path);
+            return false;
+        }
+    }
+
+    return true;
+};
+
+bool parseOBJ(const char *path, objMesh &mesh) {
+
+    mesh.vertices.clear();
+    mesh.normals.clear();
+    mesh.uvs.clear();
+    mesh.vertex_indices.clear();
+    mesh.uv_indices.clear();
+    mesh.normal_indices.clear();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Impossible to open the file %s ! Are you in the right path ?\n", path);
+        return false;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        printf("Impossible to open the file %s ! Are you in the right path ?\n", path);
+        return false;
+    }
+    if (file_stat.st_size == 0) {
+        close(fd);
+        return true;
+    }
+
+    size_t file_size = file_stat.st_size;
+    void *data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("Impossible to map the file %s\n", path);
+        return false;
+    }
+
+    const char *begin = (const char *) data;
+    bool ok = parseBuffer(begin, begin + file_size, path, mesh);
+    munmap(data, file_size);
+
+    return ok;
+};
@@ -38,16 +38,37 @@
 
 #include <ros/ros.h>
 #include <boost/random.hpp>
+#include <unordered_map>
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <tool_model_lib/tool_model.h>
+#include <tool_model_lib/obj_parser.h>
 
 
 using cv_projective::reprojectPoint;
 using cv_projective::transformPoints;
 using namespace std;
 
+typedef ToolModel::meshScalar meshScalar;
+typedef cv::Matx<meshScalar, 3, 4> meshMatx34;  //P * g_CT * [R | t] as the kernels read it
+
 boost::mt19937 rng((const uint32_t &) time(0));
 
+/* the PF renders the silhouette in (255, 255, 0), which is this intensity after the BGR2GRAY conversion in the dense
+ * calculateChamferScore; the sparse score weights every silhouette pixel with it so both give the same scores */
+static const double silhouette_grey = 179.0 / 255.0;
+
 ToolModel::ToolModel() {
 
     ///adjust the model params according to the tool geometry
@@ -64,98 +85,364 @@ ToolModel::ToolModel() {
     std::string gripper1 = tool_model_pkg + "/tool_parts/gripper2_1.obj";
     std::string gripper2 = tool_model_pkg + "/tool_parts/gripper2_2.obj";
 
-    load_model_vertices(cylinder.c_str(),
-                        body_vertices, body_Vnormal, body_faces, body_neighbors);
-    load_model_vertices(ellipse.c_str(),
-                        ellipse_vertices, ellipse_Vnormal, ellipse_faces, ellipse_neighbors);
-    load_model_vertices(gripper1.c_str(), griper1_vertices,
-                        griper1_Vnormal, griper1_faces, griper1_neighbors);
-    load_model_vertices(gripper2.c_str(), griper2_vertices,
-                        griper2_Vnormal, griper2_faces, griper2_neighbors);
-
-    offsetModel();
-    modify_model_(body_vertices, body_Vnormal, body_Vpts, body_Npts, offset_body, body_Vmat, body_Nmat);
-    modify_model_(ellipse_vertices, ellipse_Vnormal, ellipse_Vpts, ellipse_Npts, offset_ellipse, ellipse_Vmat,
-                  ellipse_Nmat);
-    modify_model_(griper1_vertices, griper1_Vnormal, griper1_Vpts, griper1_Npts, offset_gripper, gripper1_Vmat,
-                  gripper1_Nmat);
-    modify_model_(griper2_vertices, griper2_Vnormal, griper2_Vpts, griper2_Npts, offset_gripper, gripper2_Vmat,
-                  gripper2_Nmat);
-
-    getFaceInfo(body_faces, body_Vpts, body_Npts, bodyFace_normal, bodyFace_centroid);
-    getFaceInfo(ellipse_faces, ellipse_Vpts, ellipse_Npts, ellipseFace_normal, ellipseFace_centroid);
-    getFaceInfo(griper1_faces, griper1_Vpts, griper1_Npts, gripper1Face_normal, gripper1Face_centroid);
-    getFaceInfo(griper2_faces, griper2_Vpts, griper2_Npts, gripper2Face_normal, gripper2Face_centroid);
+    offset_ellipse = 0.0; //the joint
+    offset_gripper = offset_ellipse + 0.0091;
+    offset_body = 10.54; //the cylinder offset from the real origin of the real tool origin, offset_body * 0.0254
+
+    clusterMinFaces = 16384;
+
+    /* Offsets the cylinder according to the caudier, this is to render from the 4th joint space; the caudier and
+     * grippers are moved to their joints, all in INCHES */
+    loadToolPart(cylinder, true, -offset_body, body_mesh);
+    loadToolPart(ellipse, true, 0.005, ellipse_mesh);
+    loadToolPart(gripper1, true, 0.13, gripper1_mesh); //move the origin to screw position
+    loadToolPart(gripper2, true, 0.13, gripper2_mesh);
+
+    /* the shaft is a capped cylinder, keep its closed form for analyticBody */
+    analyticBody = false;
+    fitCylinder(body_mesh);
+
+    incrementalSilhouetteAngle = 0.0;
+
+    directionalChannels = 0;
+    directionalWeight = 10.0;
+    directionalTruncation = 20.0;
+
+    quantizedDistance = false;
+    distanceTruncation = 0.0;
+    distanceTolerance = 0.25;
+
+    correlationScoring = false;
 
     /* prepare to get the oval normals for UKF */
     std::string oval_normal = tool_model_pkg + "/tool_parts/new_less_normal.obj";  //contains only the faces with useful normals
-    load_model_vertices(oval_normal.c_str(),
-                        oval_normal_vertices, oval_normal_Vnormal, oval_normal_faces, oval_normal_neighbors);
-    modify_model_(oval_normal_vertices, oval_normal_Vnormal, oval_normal_Vpts, oval_normal_Npts, offset_ellipse, oval_normal_Vmat, oval_normal_Nmat);
-    getFaceInfo(oval_normal_faces, oval_normal_Vpts, oval_normal_Npts, oval_normalFace_normal, oval_normalFace_centroid);
+    loadToolPart(oval_normal, false, 0.0, oval_normal_mesh);
 
 
     srand((unsigned) time(NULL)); //for the random number generator, use only once
 };
 
-void ToolModel::offsetModel(){
+/*offset the part back to origin, since some of the vertices may not start from origin, then move it by y_shift*/
+void ToolModel::offsetModel(toolMesh &mesh, double y_shift){
 
     double min_y = 1000;
 
-    /*offset everything back to origin, since some of the vertices may not start from origin*/
-    for (int i = 0; i < body_vertices.size(); ++i) {
-        if (min_y > body_vertices[i].y) min_y = body_vertices[i].y;
+    for (int i = 0; i < mesh.numVertices(); ++i) {
+        if (min_y > mesh.vy[i]) min_y = mesh.vy[i];
     }
-    for (int i = 0; i < body_vertices.size(); ++i) {
-        body_vertices[i].y = body_vertices[i].y - min_y;
+    for (int i = 0; i < mesh.numVertices(); ++i) {
+        mesh.vy[i] = mesh.vy[i] - min_y;
     }
 
-    min_y = 1000;
-    for (int i = 0; i < griper1_vertices.size(); ++i) {
-        if (min_y > griper1_vertices[i].y) min_y = griper1_vertices[i].y;
+    for (int i = 0; i < mesh.numVertices(); ++i) {
+        mesh.vy[i] = mesh.vy[i] + y_shift;
     }
-    for (int i = 0; i < griper1_vertices.size(); ++i) {
-        griper1_vertices[i].y = griper1_vertices[i].y - min_y;
-        // griper1_vertices[i].x = griper1_vertices[i].x - 0.03937; //0.03937
+
+}
+
+/*** the mesh cache under $ROS_HOME (default ~/.ros), used when the package directory is read-only, "" if there is none ***/
+static std::string userCachePath(const std::string &path) {
+
+    std::string ros_home;
+    const char *env = getenv("ROS_HOME");
+    if (env != NULL && env[0] != '\0') {
+        ros_home = env;
+    } else {
+        env = getenv("HOME");
+        if (env == NULL || env[0] == '\0') return "";
+        ros_home = std::string(env) + "/.ros";
     }
 
-    min_y = 1000;
-    for (int i = 0; i < griper2_vertices.size(); ++i) {
-        if (min_y > griper2_vertices[i].y) min_y = griper2_vertices[i].y;
+    size_t slash = path.find_last_of('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    return ros_home + "/tool_model/" + name + ".cache";
+}
+
+/*** create the missing directories above path, like mkdir -p on its parent ***/
+static void makeParentDirectories(const std::string &path) {
+
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        mkdir(path.substr(0, slash).c_str(), 0755);
     }
-    for (int i = 0; i < griper2_vertices.size(); ++i) {
-        griper2_vertices[i].y = griper2_vertices[i].y - min_y;
-        // griper2_vertices[i].x = griper2_vertices[i].x - 0.03937;
+}
+
+/*** load one tool part, from the baked mesh cache when it is up to date, otherwise from the OBJ file ***/
+void ToolModel::loadToolPart(const std::string &path, bool recenter, double y_shift, toolMesh &mesh) {
+
+    std::string cache_path = path + ".cache";
+    std::string user_cache_path = userCachePath(path);
+    uint64_t key = meshCacheKey(path, recenter, y_shift);
+
+    if (key != 0 && (loadMeshCache(cache_path, key, mesh) ||
+                     (!user_cache_path.empty() && loadMeshCache(user_cache_path, key, mesh)))) {
+        ROS_INFO("loaded %s from the mesh cache.", path.c_str());
+        getBoundingBox(mesh);
+        buildFaceEdges(mesh);
+        buildClusterEdges(mesh);
+        return;
     }
 
-    min_y = 1000;
-    for (int i = 0; i < ellipse_vertices.size(); ++i) {
-        if (min_y > ellipse_vertices[i].y) min_y = ellipse_vertices[i].y;
+    if (!load_model_vertices(path.c_str(), mesh)) {
+        return;
     }
-    for (int i = 0; i < ellipse_vertices.size(); ++i) {
-        ellipse_vertices[i].y = ellipse_vertices[i].y - min_y;
+    if (recenter) {
+        offsetModel(mesh, y_shift);
     }
+    modify_model_(mesh);
+    getFaceInfo(mesh);
+    buildClusters(mesh);
+    getBoundingBox(mesh);
+    buildFaceEdges(mesh);
+    buildClusterEdges(mesh);
+
+    /* an installed package is usually read-only, bake next to the OBJ if possible, under $ROS_HOME otherwise */
+    if (key != 0 && !saveMeshCache(cache_path, key, mesh) &&
+        (user_cache_path.empty() || !saveMeshCache(user_cache_path, key, mesh))) {
+        ROS_WARN("Cannot write the mesh cache of %s, the part will be parsed again on the next start.",
+                 path.c_str());
+    }
+}
 
+/* The baked mesh cache: a fixed header followed by the toolMesh arrays, doubles first so every array stays aligned.
+ * Bump the version whenever the loading pipeline (offsets, unit conversion, adjacency, face info, clusters) changes. */
+static const char mesh_cache_magic[8] = {'T', 'M', 'C', 'A', 'C', 'H', 'E', '\0'};
+static const uint32_t mesh_cache_version = 6;
+
+struct meshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t num_vertices;
+    int32_t num_normals;
+    int32_t num_faces;
+    int32_t num_neighbor_ints;
+    int32_t num_edges;
+    int32_t num_clusters;
+    uint64_t key;
+};
 
-    /* add the offset for the caudier and grippers */
-    for (int i = 0; i < ellipse_vertices.size(); ++i) {
-        ellipse_vertices[i].y = ellipse_vertices[i].y + 0.005;
+static uint64_t fnv1a(const void *data, size_t size, uint64_t hash) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
     }
-    for (int i = 0; i < griper1_vertices.size(); ++i) {
-        griper1_vertices[i].y = griper1_vertices[i].y + 0.13; //move the origin to screw position
+    return hash;
+}
+
+/*** hash of the OBJ file content and of the offsets applied to it, 0 if the file cannot be read ***/
+uint64_t ToolModel::meshCacheKey(const std::string &path, bool recenter, double y_shift) {
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(fd);
+        return 0;
     }
-    for (int i = 0; i < griper2_vertices.size(); ++i) {
-        griper2_vertices[i].y = griper2_vertices[i].y + 0.13;
+
+    void *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+
+    uint64_t hash = fnv1a(data, file_stat.st_size, 14695981039346656037ULL);
+    munmap(data, file_stat.st_size);
+
+    unsigned char flag = recenter ? 1 : 0;
+    hash = fnv1a(&flag, sizeof(flag), hash);
+    hash = fnv1a(&y_shift, sizeof(y_shift), hash);
+    int32_t min_faces = clusterMinFaces;  //whether the cache holds a hierarchy
+    hash = fnv1a(&min_faces, sizeof(min_faces), hash);
+    hash = fnv1a(&mesh_cache_version, sizeof(mesh_cache_version), hash);
+    uint32_t scalar_size = sizeof(meshScalar);  //a float build does not read the arrays of a double one
+    hash = fnv1a(&scalar_size, sizeof(scalar_size), hash);
+
+    return hash == 0 ? 1 : hash;
+}
+
+/*** the cluster ranges nest as buildClusters lays them out, so the traversal can index without checks ***/
+static bool validClusters(const ToolModel::toolMesh &mesh) {
+
+    int face_num = mesh.numFaces();
+    int cluster_num = mesh.numClusters();
+    const std::vector<int> &data = mesh.cluster_data;
+
+    std::vector<bool> listed(face_num, false);
+    for (int p = 0; p < mesh.cluster_faces.size(); ++p) {
+        int face = mesh.cluster_faces[p];
+        if (face < 0 || face >= face_num || listed[face]) return false;
+        listed[face] = true;
     }
+    if (mesh.cluster_faces.size() != face_num || data[0] != 0 || data[1] != face_num || data[3] != 0) return false;
+
+    /* children come after their parent, so following them always ends */
+    for (int i = 0; i < cluster_num; ++i) {
+        const int *node = &data[5 * i];
+        if (node[0] < 0 || node[1] <= 0 || node[0] + node[1] > face_num) return false;
+        if (node[3] < 0 || node[4] <= 0 || node[3] + node[4] > data[4]) return false;
+        if (node[2] < 0) {
+            if (node[2] != -1 || node[4] != 1) return false;
+            continue;
+        }
+        if (node[2] <= i || node[2] + 1 >= cluster_num) return false;
+        const int *left = &data[5 * node[2]];
+        const int *right = left + 5;
+        if (left[0] != node[0] || right[0] != node[0] + left[1] || left[1] + right[1] != node[1]) return false;
+        if (left[3] != node[3] || right[3] != node[3] + left[4] || left[4] + right[4] != node[4]) return false;
+    }
+    return true;
+}
 
-    offset_ellipse = 0.0; //the joint
-    offset_gripper = offset_ellipse + 0.0091;
-    offset_body = 10.54; //the cylinder offset from the real origin of the real tool origin, offset_body * 0.0254
-    /* Offsets the cylinder according to the caudier, this is to render from the 4th joint space */
-    for (int i = 0; i < body_vertices.size(); ++i) {
-        body_vertices[i].y = body_vertices[i].y - offset_body;  //these are in INCHES
+bool ToolModel::loadMeshCache(const std::string &cache_path, uint64_t key, toolMesh &mesh) {
+
+    int fd = open(cache_path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < (off_t) sizeof(meshCacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t file_size = file_stat.st_size;
+    void *data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    const meshCacheHeader *header = (const meshCacheHeader *) data;
+    bool valid = memcmp(header->magic, mesh_cache_magic, sizeof(mesh_cache_magic)) == 0 &&
+                 header->version == mesh_cache_version && header->key == key && header->num_vertices >= 0 &&
+                 header->num_normals >= 0 && header->num_faces >= 0 && header->num_neighbor_ints >= 0 &&
+                 header->num_edges >= 0 && header->num_clusters >= 0;
+
+    size_t V = header->num_vertices;
+    size_t N = header->num_normals;
+    size_t F = header->num_faces;
+    size_t K = header->num_neighbor_ints;
+    size_t E = header->num_edges;
+    size_t C = header->num_clusters;
+    size_t CF = C > 0 ? F : 0;  //cluster_faces
+
+    size_t expected_size = sizeof(meshCacheHeader) + sizeof(double) * 8 * C +
+                           sizeof(meshScalar) * 3 * (V + N + F + F) +
+                           sizeof(int32_t) * (6 * F + F + 1 + K + 10 * E + CF + 5 * C);
+    if (!valid || file_size != expected_size) {
+        munmap(data, file_size);
+        return false;
+    }
+
+    /* the doubles first, so every array stays aligned */
+    const double *doubles = (const double *) ((const char *) data + sizeof(meshCacheHeader));
+    mesh.cluster_bounds.assign(doubles, doubles + 8 * C);
+    doubles += 8 * C;
+
+    const meshScalar *scalars = (const meshScalar *) doubles;
+    std::vector<meshScalar> *scalar_arrays[12] = {&mesh.vx, &mesh.vy, &mesh.vz, &mesh.nx, &mesh.ny, &mesh.nz,
+                                                  &mesh.fnx, &mesh.fny, &mesh.fnz, &mesh.fcx, &mesh.fcy, &mesh.fcz};
+    size_t scalar_sizes[12] = {V, V, V, N, N, N, F, F, F, F, F, F};
+    for (int a = 0; a < 12; ++a) {
+        scalar_arrays[a]->assign(scalars, scalars + scalar_sizes[a]);
+        scalars += scalar_sizes[a];
+    }
+
+    const int32_t *ints = (const int32_t *) scalars;
+    mesh.face_v.assign(ints, ints + 3 * F);
+    ints += 3 * F;
+    mesh.face_n.assign(ints, ints + 3 * F);
+    ints += 3 * F;
+    mesh.neighbor_start.assign(ints, ints + F + 1);
+    ints += F + 1;
+    mesh.neighbor_data.assign(ints, ints + K);
+    ints += K;
+    mesh.edge_data.assign(ints, ints + 10 * E);
+    ints += 10 * E;
+    mesh.cluster_faces.assign(ints, ints + CF);
+    ints += CF;
+    mesh.cluster_data.assign(ints, ints + 5 * C);
+
+    munmap(data, file_size);
+
+    /* the render loops index without checks, reject a cache whose indices do not fit its arrays */
+    for (size_t i = 0; i < 3 * F; ++i) {
+        if (mesh.face_v[i] < 0 || mesh.face_v[i] >= (int) V || mesh.face_n[i] < 0 || mesh.face_n[i] >= (int) N) {
+            valid = false;
+        }
+    }
+    for (size_t i = 0; i < F; ++i) {
+        if (mesh.neighbor_start[i] < 0 || mesh.neighbor_start[i] > mesh.neighbor_start[i + 1]) valid = false;
+    }
+    if (mesh.neighbor_start[0] != 0 || mesh.neighbor_start[F] != (int) K || K % 5 != 0) valid = false;
+    for (size_t i = 0; i < F && valid; ++i) {
+        if (mesh.neighbor_start[i] % 5 != 0) valid = false;
+    }
+    for (size_t j = 0; j + 4 < K && valid; j += 5) {
+        const int *neighbor = &mesh.neighbor_data[j];
+        if (neighbor[0] < 0 || neighbor[0] >= (int) F) valid = false;
+        for (int k = 1; k < 5; k += 2) {
+            if (neighbor[k] < 0 || neighbor[k] >= (int) V || neighbor[k + 1] < 0 || neighbor[k + 1] >= (int) N) {
+                valid = false;
+            }
+        }
+    }
+    for (size_t e = 0; e < E; ++e) {
+        const int *edge = &mesh.edge_data[10 * e];
+        if (edge[0] < 0 || edge[0] >= (int) F || edge[1] < 0 || edge[1] >= (int) F) valid = false;
+        for (int k = 2; k < 10; k += 2) {
+            if (edge[k] < 0 || edge[k] >= (int) V || edge[k + 1] < 0 || edge[k + 1] >= (int) N) valid = false;
+        }
+    }
+    if (C > 0 && !validClusters(mesh)) valid = false;
+
+    if (!valid) {
+        mesh = toolMesh();
+    }
+    return valid;
+}
+
+/*** bake the loaded part, written to a temporary file and renamed so a concurrent start never reads half of it ***/
+bool ToolModel::saveMeshCache(const std::string &cache_path, uint64_t key, const toolMesh &mesh) {
+
+    meshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, mesh_cache_magic, sizeof(mesh_cache_magic));
+    header.version = mesh_cache_version;
+    header.num_vertices = mesh.numVertices();
+    header.num_normals = mesh.numNormals();
+    header.num_faces = mesh.numFaces();
+    header.num_neighbor_ints = mesh.neighbor_data.size();
+    header.num_edges = mesh.numEdges();
+    header.num_clusters = mesh.numClusters();
+    header.key = key;
+
+    /* the user cache directory is only created when a part gets baked into it */
+    makeParentDirectories(cache_path);
+    std::string temp_path = cache_path + ".tmp";
+    FILE *file = fopen(temp_path.c_str(), "wb");
+    if (file == NULL) return false;
+
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    written = written && fwrite(mesh.cluster_bounds.data(), sizeof(double), mesh.cluster_bounds.size(), file) ==
+                         mesh.cluster_bounds.size();
+    const std::vector<meshScalar> *scalar_arrays[12] = {&mesh.vx, &mesh.vy, &mesh.vz, &mesh.nx, &mesh.ny, &mesh.nz,
+                                                        &mesh.fnx, &mesh.fny, &mesh.fnz, &mesh.fcx, &mesh.fcy,
+                                                        &mesh.fcz};
+    for (int a = 0; a < 12; ++a) {
+        const std::vector<meshScalar> &array = *scalar_arrays[a];
+        written = written && fwrite(array.data(), sizeof(meshScalar), array.size(), file) == array.size();
+    }
+    const std::vector<int> *int_arrays[7] = {&mesh.face_v, &mesh.face_n, &mesh.neighbor_start, &mesh.neighbor_data,
+                                             &mesh.edge_data, &mesh.cluster_faces, &mesh.cluster_data};
+    for (int a = 0; a < 7; ++a) {
+        const std::vector<int> &array = *int_arrays[a];
+        written = written && fwrite(array.data(), sizeof(int32_t), array.size(), file) == array.size();
     }
+    written = (fclose(file) == 0) && written;
 
+    if (!written || rename(temp_path.c_str(), cache_path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
 }
 
 double ToolModel::randomNumber(double stdev, double mean) {
@@ -180,129 +467,438 @@ double ToolModel::randomNum(double min, double max){
     return res;
 };
 
-void ToolModel::ConvertInchtoMeters(std::vector<cv::Point3d> &input_vertices) {
+bool ToolModel::load_model_vertices(const char *path, toolMesh &mesh) {
+
+    mesh = toolMesh();
+
+    objMesh obj;
+    if (!parseOBJ(path, obj)) {
+        ROS_ERROR("File can't be read by our simple parser : ( Try exporting with other options\n");
+        return false;
+    }
+
+    int V = obj.numVertices();
+    mesh.vx.resize(V);
+    mesh.vy.resize(V);
+    mesh.vz.resize(V);
+    for (int i = 0; i < V; ++i) {
+        mesh.vx[i] = obj.vertices[3 * i];
+        mesh.vy[i] = obj.vertices[3 * i + 1];
+        mesh.vz[i] = obj.vertices[3 * i + 2];
+    }
+
+    int N = obj.numNormals();
+    mesh.nx.resize(N);
+    mesh.ny.resize(N);
+    mesh.nz.resize(N);
+    for (int i = 0; i < N; ++i) {
+        mesh.nx[i] = obj.normals[3 * i];
+        mesh.ny[i] = obj.normals[3 * i + 1];
+        mesh.nz[i] = obj.normals[3 * i + 2];
+    }
 
-    int size = (int) input_vertices.size();
-    for (int i = 0; i < size; ++i) {
-        input_vertices[i].x = input_vertices[i].x * 0.0254;
-        input_vertices[i].y = input_vertices[i].y * 0.0254;
-        input_vertices[i].z = input_vertices[i].z * 0.0254;
+    /* every face keeps three vertex and corresponding normal indices */
+    for (int i = 0; i < 3 * obj.numTriangles(); ++i) {
+        if (obj.normal_indices[i] < 0) {
+            ROS_ERROR("%s has faces without vertex normals, the silhouette needs them\n", path);
+            mesh = toolMesh();
+            return false;
+        }
     }
+    mesh.face_v = obj.vertex_indices;
+    mesh.face_n = obj.normal_indices;
+
+    /***find neighbor faces***/
+    buildNeighborFaces(mesh);
+    buildEdgeList(mesh);
+
+    printf("loaded file %s successfully.\n", path);
+    return true;
 };
 
-void ToolModel::load_model_vertices(const char *path, std::vector<glm::vec3> &out_vertices,
-                                    std::vector<glm::vec3> &vertex_normal,
-                                    std::vector<std::vector<int> > &out_faces,
-                                    std::vector<std::vector<int> > &neighbor_faces) {
+/*** O(F) adjacency: faces can only be neighbors if they share an edge, or a vertex with a face repeating one, so look
+ * them up in an edge -> face map and around the vertices of the degenerate faces ***/
+void ToolModel::buildNeighborFaces(toolMesh &mesh) {
 
-    std::vector<unsigned int> vertexIndices, uvIndices, normalIndices;
-    std::vector<glm::vec2> temp_uvs;
+    int face_num = mesh.numFaces();
+    const std::vector<int> &face_v = mesh.face_v;
 
-    std::vector<int> temp_face;
-    temp_face.resize(6);  //need three vertex and corresponding normals
+    /* every face adds its three edges, keyed on the sorted vertex indices; the faces sharing a key are chained
+     * through edge_next, so the map never allocates per edge. Slot 3 * i + k is the k-th edge of face i */
+    std::unordered_map<uint64_t, int> edge_head;
+    edge_head.reserve(3 * face_num);
+    std::vector<int> edge_next(3 * face_num, -1);
 
-    FILE *file = fopen(path, "r");
-    if (file == NULL) {
-        printf("Impossible to open the file ! Are you in the right path ?\n");
-        return;
+    /* faces repeating a vertex can match Compare_vertex on a single shared vertex, so they get compared to every face
+     * around their vertices, and those faces to them */
+    std::vector<int> degenerate_faces;
+
+    for (int i = 0; i < face_num; ++i) {
+        const int *face = &face_v[3 * i];
+        if (face[0] == face[1] || face[1] == face[2] || face[0] == face[2]) {
+            degenerate_faces.push_back(i);
+        }
+
+        for (int k = 0; k < 3; ++k) {
+            int slot = 3 * i + k;
+            std::pair<std::unordered_map<uint64_t, int>::iterator, bool> inserted =
+                    edge_head.insert(std::make_pair(edgeKey(face[k], face[(k + 1) % 3]), slot));
+            if (!inserted.second) {
+                edge_next[slot] = inserted.first->second;
+                inserted.first->second = slot;
+            }
+        }
     }
 
-    while (1) {
-
-        char lineHeader[128];
-        // read the first word of the line
-        int res = fscanf(file, "%s", lineHeader);
-        if (res == EOF)
-            break; // EOF = End Of File. Quit the loop.
-        // else : parse lineHeader
-        if (strcmp(lineHeader, "v") == 0) {
-            glm::vec3 vertex;
-
-            fscanf(file, "%f %f %f\n", &vertex.x, &vertex.y, &vertex.z);
-            out_vertices.push_back(vertex);
-        } else if (strcmp(lineHeader, "vt") == 0) {
-            glm::vec2 uv;
-            fscanf(file, "%f %f\n", &uv.x, &uv.y);
-            temp_uvs.push_back(uv);
-        } else if (strcmp(lineHeader, "vn") == 0) {
-            glm::vec3 normal;
-            fscanf(file, "%f %f %f\n", &normal.x, &normal.y, &normal.z);
-            vertex_normal.push_back(normal);
-
-        } else if (strcmp(lineHeader, "f") == 0) {
-
-            unsigned int vertexIndex[3], uvIndex[3], normalIndex[3];
-            int matches = fscanf(file, "%d/%d/%d %d/%d/%d %d/%d/%d\n", &vertexIndex[0], &uvIndex[0], &normalIndex[0],
-                                 &vertexIndex[1], &uvIndex[1], &normalIndex[1], &vertexIndex[2], &uvIndex[2],
-                                 &normalIndex[2]);
-            if (matches != 9) {
-                ROS_ERROR("File can't be read by our simple parser : ( Try exporting with other options\n");
+    /* the vertices of the degenerate faces, with every face around them and the degenerate ones among those */
+    std::unordered_map<int, int> vertex_slot;
+    std::vector<std::vector<int> > faces_around, degenerate_around;
+    for (int d = 0; d < degenerate_faces.size(); ++d) {
+        const int *face = &face_v[3 * degenerate_faces[d]];
+        for (int k = 0; k < 3; ++k) {
+            if (vertex_slot.insert(std::make_pair(face[k], (int) faces_around.size())).second) {
+                faces_around.push_back(std::vector<int>());
+                degenerate_around.push_back(std::vector<int>());
             }
+        }
+    }
+    if (!vertex_slot.empty()) {
+        for (int i = 0; i < face_num; ++i) {
+            const int *face = &face_v[3 * i];
+            bool is_degenerate = face[0] == face[1] || face[1] == face[2] || face[0] == face[2];
+            for (int k = 0; k < 3; ++k) {
+                std::unordered_map<int, int>::const_iterator found = vertex_slot.find(face[k]);
+                if (found == vertex_slot.end()) continue;
+                faces_around[found->second].push_back(i);
+                if (is_degenerate) degenerate_around[found->second].push_back(i);
+            }
+        }
+    }
+
+    mesh.neighbor_start.assign(1, 0);
+    mesh.neighbor_start.reserve(face_num + 1);
+    mesh.neighbor_data.clear();
+    mesh.neighbor_data.reserve(3 * 5 * face_num);
+
+    std::vector<int> candidates;
+    std::vector<int> temp_vec;
 
-            /* this mean for later use, just in case */
-            vertexIndices.push_back(vertexIndex[0]);
-            vertexIndices.push_back(vertexIndex[1]);
-            vertexIndices.push_back(vertexIndex[2]);
-            uvIndices.push_back(uvIndex[0]);
-            uvIndices.push_back(uvIndex[1]);
-            uvIndices.push_back(uvIndex[2]);
-            normalIndices.push_back(normalIndex[0]);
-            normalIndices.push_back(normalIndex[1]);
-            normalIndices.push_back(normalIndex[2]);
+    for (int i = 0; i < face_num; ++i) {
+        candidates.clear();
 
-            temp_face[0] = vertexIndex[0] - 1;
-            temp_face[1] = vertexIndex[1] - 1;
-            temp_face[2] = vertexIndex[2] - 1;
-            temp_face[3] = normalIndex[0] - 1;
-            temp_face[4] = normalIndex[1] - 1;
-            temp_face[5] = normalIndex[2] - 1;
+        const int *face = &face_v[3 * i];
+        bool is_degenerate = std::binary_search(degenerate_faces.begin(), degenerate_faces.end(), i);
+        for (int k = 0; k < 3; ++k) {
+            if (is_degenerate) {
+                const std::vector<int> &around = faces_around[vertex_slot[face[k]]];
+                candidates.insert(candidates.end(), around.begin(), around.end());
+                continue;
+            }
 
-            out_faces.push_back(temp_face);
+            int slot = edge_head[edgeKey(face[k], face[(k + 1) % 3])];
+            for (; slot >= 0; slot = edge_next[slot]) {
+                candidates.push_back(slot / 3);
+            }
+            std::unordered_map<int, int>::const_iterator found = vertex_slot.find(face[k]);
+            if (found != vertex_slot.end()) {
+                const std::vector<int> &around = degenerate_around[found->second];
+                candidates.insert(candidates.end(), around.begin(), around.end());
+            }
         }
-    }
 
-    /***find neighbor faces***/
-    neighbor_faces.resize(out_faces.size());
-    std::vector<int> temp_vec;
+        /* keep the neighbors in increasing face order, like the full pairwise search did */
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
 
-    for (int i = 0; i < neighbor_faces.size(); ++i) {
-        /*********find the neighbor faces************/
-        for (int j = 0; j < out_faces.size(); ++j) {
+        for (int c = 0; c < candidates.size(); ++c) {
+            int j = candidates[c];
             if (j != i) {  //don't repeat yourself
-                int match = Compare_vertex(out_faces[i], out_faces[j], temp_vec);
+                int match = Compare_vertex(mesh, i, j, temp_vec);
 
                 if (match == 2) //so face i and face j share an edge
                 {
-                    //ROS_INFO_STREAM("SIZE FO THE TEMP VEC: " << temp_vec.size() );
-                    neighbor_faces[i].push_back(j); // mark the neighbor face index
-                    neighbor_faces[i].push_back(temp_vec[0]);  //first vertex
-                    neighbor_faces[i].push_back(temp_vec[1]);  //corresponding normal
-                    neighbor_faces[i].push_back(temp_vec[2]);  //second vertex
-                    neighbor_faces[i].push_back(temp_vec[3]);  //corresponding normal
-                    //ROS_INFO_STREAM("neighbor_faces[i]" << neighbor_faces[i].size());
+                    mesh.neighbor_data.push_back(j); // mark the neighbor face index
+                    mesh.neighbor_data.push_back(temp_vec[0]);  //first vertex
+                    mesh.neighbor_data.push_back(temp_vec[1]);  //corresponding normal
+                    mesh.neighbor_data.push_back(temp_vec[2]);  //second vertex
+                    mesh.neighbor_data.push_back(temp_vec[3]);  //corresponding normal
                 }
                 temp_vec.clear();
             }
+        }
+        mesh.neighbor_start.push_back(mesh.neighbor_data.size());
+    }
 
+};
+
+/*** every neighbor pair becomes one edge, keeping the shared vertices as listed by both faces ***/
+void ToolModel::buildEdgeList(toolMesh &mesh) {
+
+    mesh.edge_data.clear();
+    mesh.edge_data.reserve(mesh.neighbor_data.size());
+
+    for (int i = 0; i < mesh.numFaces(); ++i) {
+        for (int j = mesh.neighbor_start[i]; j < mesh.neighbor_start[i + 1]; j += 5) {
+            int neighbor = mesh.neighbor_data[j];
+            if (neighbor < i) continue;  //already added from the neighbor's list
+
+            /* the same edge in the neighbor's list, the adjacency is symmetric */
+            int back = j;
+            for (int k = mesh.neighbor_start[neighbor]; k < mesh.neighbor_start[neighbor + 1]; k += 5) {
+                if (mesh.neighbor_data[k] == i) {
+                    back = k;
+                    break;
+                }
+            }
+
+            mesh.edge_data.push_back(i);
+            mesh.edge_data.push_back(neighbor);
+            mesh.edge_data.insert(mesh.edge_data.end(), &mesh.neighbor_data[j + 1], &mesh.neighbor_data[j + 5]);
+            mesh.edge_data.insert(mesh.edge_data.end(), &mesh.neighbor_data[back + 1], &mesh.neighbor_data[back + 5]);
         }
+    }
+
+};
 
+void ToolModel::buildFaceEdges(toolMesh &mesh) {
+
+    int face_num = mesh.numFaces();
+    mesh.face_edge_start.assign(face_num + 1, 0);
+    for (int e = 0; e < mesh.numEdges(); ++e) {
+        mesh.face_edge_start[mesh.edge_data[10 * e] + 1]++;
+        mesh.face_edge_start[mesh.edge_data[10 * e + 1] + 1]++;
+    }
+    for (int i = 0; i < face_num; ++i) {
+        mesh.face_edge_start[i + 1] += mesh.face_edge_start[i];
     }
 
-    printf("loaded file %s successfully.\n", path);
+    std::vector<int> fill(mesh.face_edge_start.begin(), mesh.face_edge_start.end() - 1);
+    mesh.face_edge_data.resize(mesh.face_edge_start[face_num]);
+    for (int e = 0; e < mesh.numEdges(); ++e) {
+        mesh.face_edge_data[fill[mesh.edge_data[10 * e]]++] = e;
+        mesh.face_edge_data[fill[mesh.edge_data[10 * e + 1]]++] = e;
+    }
 };
 
-void ToolModel::Convert_glTocv_pts(std::vector<glm::vec3> &input_vertices, std::vector<cv::Point3d> &out_vertices) {
+/*** faces per leaf cluster ***/
+static const int cluster_leaf_faces = 16;
+
+/*** the normal cone (axis, cosine of the half angle) and centroid sphere (center, radius) of faces[0, count) ***/
+static void clusterBounds(const ToolModel::toolMesh &mesh, const std::vector<cv::Point3d> &unit_normals,
+                          const int *faces, int count, double *bounds) {
+
+    cv::Point3d axis(0.0, 0.0, 0.0);
+    bool degenerate = false;
+    cv::Point3d low(mesh.fcx[faces[0]], mesh.fcy[faces[0]], mesh.fcz[faces[0]]), high = low;
+    for (int i = 0; i < count; ++i) {
+        int face = faces[i];
+        axis += unit_normals[face];
+        degenerate = degenerate || unit_normals[face] == cv::Point3d(0.0, 0.0, 0.0);
+        low.x = std::min<double>(low.x, mesh.fcx[face]);
+        low.y = std::min<double>(low.y, mesh.fcy[face]);
+        low.z = std::min<double>(low.z, mesh.fcz[face]);
+        high.x = std::max<double>(high.x, mesh.fcx[face]);
+        high.y = std::max<double>(high.y, mesh.fcy[face]);
+        high.z = std::max<double>(high.z, mesh.fcz[face]);
+    }
+
+    /* a face without a normal is edge-on from everywhere, such a cluster is never skipped */
+    double length = cv::norm(axis);
+    double half_angle = CV_PI;
+    if (!degenerate && length > 0.0) {
+        axis *= 1.0 / length;
+        half_angle = 0.0;
+        for (int i = 0; i < count; ++i) {
+            double cosine = std::max(-1.0, std::min(1.0, axis.dot(unit_normals[faces[i]])));
+            half_angle = std::max(half_angle, std::acos(cosine));
+        }
+        half_angle = std::min(CV_PI, half_angle + 1e-6);  //acos loses up to 1e-8 rad next to the axis
+    }
+    double cos_half = half_angle < CV_PI / 2 ? std::cos(half_angle) : -1.0;
+
+    cv::Point3d center = (low + high) * 0.5;
+    double radius = 0.0;
+    for (int i = 0; i < count; ++i) {
+        int face = faces[i];
+        radius = std::max(radius, cv::norm(cv::Point3d(mesh.fcx[face], mesh.fcy[face], mesh.fcz[face]) - center));
+    }
+
+    bounds[0] = axis.x;
+    bounds[1] = axis.y;
+    bounds[2] = axis.z;
+    bounds[3] = cos_half;
+    bounds[4] = center.x;
+    bounds[5] = center.y;
+    bounds[6] = center.z;
+    bounds[7] = radius;
+}
 
-    unsigned long vsize = input_vertices.size();
+/*** the k-th split coordinate of a face: its unit normal, then its centroid scaled to the same span ***/
+static inline double clusterKey(const ToolModel::toolMesh &mesh, const std::vector<cv::Point3d> &unit_normals,
+                                double scale, int face, int k) {
+
+    switch (k) {
+        case 0: return unit_normals[face].x;
+        case 1: return unit_normals[face].y;
+        case 2: return unit_normals[face].z;
+        case 3: return mesh.fcx[face] * scale;
+        case 4: return mesh.fcy[face] * scale;
+        default: return mesh.fcz[face] * scale;
+    }
+}
+
+/*** split cluster node in halves along the widest of its normal and scaled centroid coordinates, down to the leaves ***/
+static void splitCluster(ToolModel::toolMesh &mesh, const std::vector<cv::Point3d> &unit_normals, double scale,
+                         int node, int &leaves) {
+
+    int first = mesh.cluster_data[5 * node];
+    int count = mesh.cluster_data[5 * node + 1];
+    int *faces = &mesh.cluster_faces[first];
+    clusterBounds(mesh, unit_normals, faces, count, &mesh.cluster_bounds[8 * node]);
+
+    if (count <= cluster_leaf_faces) {
+        mesh.cluster_data[5 * node + 3] = leaves++;
+        mesh.cluster_data[5 * node + 4] = 1;
+        return;
+    }
+
+    int widest = 0;
+    double widest_spread = -1.0;
+    for (int k = 0; k < 6; ++k) {
+        double low = clusterKey(mesh, unit_normals, scale, faces[0], k), high = low;
+        for (int i = 1; i < count; ++i) {
+            double key = clusterKey(mesh, unit_normals, scale, faces[i], k);
+            low = std::min(low, key);
+            high = std::max(high, key);
+        }
+        if (high - low > widest_spread) {
+            widest = k;
+            widest_spread = high - low;
+        }
+    }
 
-    out_vertices.resize(vsize);
-    for (int i = 0; i < vsize; ++i) {
-        out_vertices[i].x = input_vertices[i].x;
-        out_vertices[i].y = input_vertices[i].y;
-        out_vertices[i].z = input_vertices[i].z;
+    /* the median split, ties broken on the face index so the hierarchy does not depend on the sort */
+    std::vector<std::pair<double, int> > sorted(count);
+    for (int i = 0; i < count; ++i) {
+        sorted[i] = std::make_pair(clusterKey(mesh, unit_normals, scale, faces[i], widest), faces[i]);
     }
+    std::sort(sorted.begin(), sorted.end());
+    for (int i = 0; i < count; ++i) {
+        faces[i] = sorted[i].second;
+    }
+
+    /* both children at once, so the second always follows the first */
+    int child = mesh.numClusters();
+    int half = count / 2;
+    int children[10] = {first, half, -1, 0, 0, first + half, count - half, -1, 0, 0};
+    mesh.cluster_data.insert(mesh.cluster_data.end(), children, children + 10);
+    mesh.cluster_bounds.resize(8 * (child + 2));
+    mesh.cluster_data[5 * node + 2] = child;
+
+    splitCluster(mesh, unit_normals, scale, child, leaves);
+    splitCluster(mesh, unit_normals, scale, child + 1, leaves);
+    mesh.cluster_data[5 * node + 3] = mesh.cluster_data[5 * child + 3];
+    mesh.cluster_data[5 * node + 4] = mesh.cluster_data[5 * child + 4] + mesh.cluster_data[5 * child + 9];
+}
+
+void ToolModel::buildClusters(toolMesh &mesh) {
+
+    mesh.cluster_faces.clear();
+    mesh.cluster_data.clear();
+    mesh.cluster_bounds.clear();
+
+    int face_num = mesh.numFaces();
+    if (face_num < clusterMinFaces) return;
+
+    std::vector<cv::Point3d> unit_normals(face_num);
+    cv::Point3d low(mesh.fcx[0], mesh.fcy[0], mesh.fcz[0]), high = low;
+    for (int i = 0; i < face_num; ++i) {
+        cv::Point3d normal(mesh.fnx[i], mesh.fny[i], mesh.fnz[i]);
+        double length = cv::norm(normal);
+        unit_normals[i] = length > 0.0 ? normal * (1.0 / length) : cv::Point3d(0.0, 0.0, 0.0);
+        low.x = std::min<double>(low.x, mesh.fcx[i]);
+        low.y = std::min<double>(low.y, mesh.fcy[i]);
+        low.z = std::min<double>(low.z, mesh.fcz[i]);
+        high.x = std::max<double>(high.x, mesh.fcx[i]);
+        high.y = std::max<double>(high.y, mesh.fcy[i]);
+        high.z = std::max<double>(high.z, mesh.fcz[i]);
+    }
+
+    /* centroids scaled to span about 2 like the normals, so neither wins every split */
+    double diagonal = cv::norm(high - low);
+    double scale = diagonal > 0.0 ? 2.0 / diagonal : 1.0;
+
+    mesh.cluster_faces.resize(face_num);
+    for (int i = 0; i < face_num; ++i) {
+        mesh.cluster_faces[i] = i;
+    }
+    int root[5] = {0, face_num, -1, 0, 0};
+    mesh.cluster_data.assign(root, root + 5);
+    mesh.cluster_bounds.resize(8);
+
+    int leaves = 0;
+    splitCluster(mesh, unit_normals, scale, 0, leaves);
 };
 
+/*** an edge is tested at the deepest cluster holding both its faces, the face positions in cluster_faces tell where.
+ * The face positions and leaves are kept with the edge, so the cluster pass reads them in order ***/
+void ToolModel::buildClusterEdges(toolMesh &mesh) {
+
+    mesh.cluster_position.clear();
+    mesh.cluster_leaf.clear();
+    mesh.cluster_edge_start.clear();
+    mesh.cluster_edge_data.clear();
+
+    int cluster_num = mesh.numClusters();
+    if (cluster_num == 0) return;
+
+    std::vector<int> &position = mesh.cluster_position;
+    position.resize(mesh.numFaces());
+    for (int p = 0; p < mesh.cluster_faces.size(); ++p) {
+        position[mesh.cluster_faces[p]] = p;
+    }
+    mesh.cluster_leaf.resize(mesh.numFaces());
+    for (int i = 0; i < cluster_num; ++i) {
+        const int *node = &mesh.cluster_data[5 * i];
+        if (node[2] >= 0) continue;
+        std::fill(mesh.cluster_leaf.begin() + node[0], mesh.cluster_leaf.begin() + node[0] + node[1], node[3]);
+    }
+
+    std::vector<int> edge_cluster(mesh.numEdges());
+    mesh.cluster_edge_start.assign(cluster_num + 1, 0);
+    for (int e = 0; e < mesh.numEdges(); ++e) {
+        int p1 = position[mesh.edge_data[10 * e]];
+        int p2 = position[mesh.edge_data[10 * e + 1]];
+        int cluster = 0;
+        while (mesh.cluster_data[5 * cluster + 2] >= 0) {
+            int child = mesh.cluster_data[5 * cluster + 2];
+            int split = mesh.cluster_data[5 * child] + mesh.cluster_data[5 * child + 1];
+            if (p1 < split && p2 < split) {
+                cluster = child;
+            } else if (p1 >= split && p2 >= split) {
+                cluster = child + 1;
+            } else {
+                break;
+            }
+        }
+        edge_cluster[e] = cluster;
+        mesh.cluster_edge_start[cluster + 1]++;
+    }
+    for (int i = 0; i < cluster_num; ++i) {
+        mesh.cluster_edge_start[i + 1] += mesh.cluster_edge_start[i];
+    }
+
+    std::vector<int> fill(mesh.cluster_edge_start.begin(), mesh.cluster_edge_start.end() - 1);
+    mesh.cluster_edge_data.resize(5 * mesh.numEdges());
+    for (int e = 0; e < mesh.numEdges(); ++e) {
+        int *entry = &mesh.cluster_edge_data[5 * fill[edge_cluster[e]]++];
+        entry[0] = e;
+        entry[1] = position[mesh.edge_data[10 * e]];
+        entry[2] = position[mesh.edge_data[10 * e + 1]];
+        entry[3] = mesh.cluster_leaf[entry[1]];
+        entry[4] = mesh.cluster_leaf[entry[2]];
+    }
+};
 
 /* find the camera view point, should it be (0,0,0), input faces stores the indices of the vertices and normals,
 which are not related to the pose of the tool object*/
@@ -310,260 +906,1078 @@ cv::Mat ToolModel::camTransformMats(cv::Mat &cam_mat, cv::Mat &input_mat) {
     /*cam mat should be a 4x4 extrinsic parameter*/
     cv::Mat output_mat = cam_mat * input_mat; //transform the obj to camera frames, g_CT
 
-    return output_mat;
+    return output_mat;
+};
+
+/*** u, v of M * [x y z 1] for one vertex, in the precision of the mesh ***/
+static inline cv::Point2f projectVertex(const meshMatx34 &M, meshScalar x, meshScalar y, meshScalar z) {
+
+    meshScalar u = M(0, 0) * x + M(0, 1) * y + M(0, 2) * z + M(0, 3);
+    meshScalar v = M(1, 0) * x + M(1, 1) * y + M(1, 2) * z + M(1, 3);
+    meshScalar w = M(2, 0) * x + M(2, 1) * y + M(2, 2) * z + M(2, 3);
+    return cv::Point2f((float) (u / w), (float) (v / w));
+}
+
+/*** u, v of M * [x y z 1] for n vertices, four (AVX) or two (SSE2) at a time, eight or four in float, the rest in
+ * the same order of operations ***/
+static void projectVertices(const meshMatx34 &M, const meshScalar *x, const meshScalar *y, const meshScalar *z, int n,
+                            cv::Point2f *out) {
+
+    float *uv = (float *) out;  //cv::Point2f is two packed floats
+    int i = 0;
+
+#if defined(TOOL_MODEL_FLOAT_GEOMETRY) && defined(__AVX__)
+    __m256 m[12];
+    for (int k = 0; k < 12; ++k) m[k] = _mm256_set1_ps(M.val[k]);
+    for (; i + 8 <= n; i += 8) {
+        __m256 px = _mm256_loadu_ps(x + i), py = _mm256_loadu_ps(y + i), pz = _mm256_loadu_ps(z + i);
+        __m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[0], px), _mm256_mul_ps(m[1], py)),
+                                               _mm256_mul_ps(m[2], pz)), m[3]);
+        __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[4], px), _mm256_mul_ps(m[5], py)),
+                                               _mm256_mul_ps(m[6], pz)), m[7]);
+        __m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m[8], px), _mm256_mul_ps(m[9], py)),
+                                               _mm256_mul_ps(m[10], pz)), m[11]);
+        __m256 fu = _mm256_div_ps(u, w), fv = _mm256_div_ps(v, w);
+        __m256 lo = _mm256_unpacklo_ps(fu, fv), hi = _mm256_unpackhi_ps(fu, fv);  //vertices 0 1 4 5, then 2 3 6 7
+        _mm256_storeu_ps(uv + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+        _mm256_storeu_ps(uv + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+    }
+#elif defined(TOOL_MODEL_FLOAT_GEOMETRY) && defined(__SSE2__)
+    __m128 m[12];
+    for (int k = 0; k < 12; ++k) m[k] = _mm_set1_ps(M.val[k]);
+    for (; i + 4 <= n; i += 4) {
+        __m128 px = _mm_loadu_ps(x + i), py = _mm_loadu_ps(y + i), pz = _mm_loadu_ps(z + i);
+        __m128 u = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[0], px), _mm_mul_ps(m[1], py)),
+                                         _mm_mul_ps(m[2], pz)), m[3]);
+        __m128 v = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[4], px), _mm_mul_ps(m[5], py)),
+                                         _mm_mul_ps(m[6], pz)), m[7]);
+        __m128 w = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m[8], px), _mm_mul_ps(m[9], py)),
+                                         _mm_mul_ps(m[10], pz)), m[11]);
+        __m128 fu = _mm_div_ps(u, w), fv = _mm_div_ps(v, w);
+        _mm_storeu_ps(uv + 2 * i, _mm_unpacklo_ps(fu, fv));
+        _mm_storeu_ps(uv + 2 * i + 4, _mm_unpackhi_ps(fu, fv));
+    }
+#elif defined(__AVX__)
+    __m256d m[12];
+    for (int k = 0; k < 12; ++k) m[k] = _mm256_set1_pd(M.val[k]);
+    for (; i + 4 <= n; i += 4) {
+        __m256d px = _mm256_loadu_pd(x + i), py = _mm256_loadu_pd(y + i), pz = _mm256_loadu_pd(z + i);
+        __m256d u = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(m[0], px), _mm256_mul_pd(m[1], py)),
+                                                _mm256_mul_pd(m[2], pz)), m[3]);
+        __m256d v = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(m[4], px), _mm256_mul_pd(m[5], py)),
+                                                _mm256_mul_pd(m[6], pz)), m[7]);
+        __m256d w = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(m[8], px), _mm256_mul_pd(m[9], py)),
+                                                _mm256_mul_pd(m[10], pz)), m[11]);
+        __m128 fu = _mm256_cvtpd_ps(_mm256_div_pd(u, w));
+        __m128 fv = _mm256_cvtpd_ps(_mm256_div_pd(v, w));
+        _mm_storeu_ps(uv + 2 * i, _mm_unpacklo_ps(fu, fv));
+        _mm_storeu_ps(uv + 2 * i + 4, _mm_unpackhi_ps(fu, fv));
+    }
+#elif defined(__SSE2__)
+    __m128d m[12];
+    for (int k = 0; k < 12; ++k) m[k] = _mm_set1_pd(M.val[k]);
+    for (; i + 2 <= n; i += 2) {
+        __m128d px = _mm_loadu_pd(x + i), py = _mm_loadu_pd(y + i), pz = _mm_loadu_pd(z + i);
+        __m128d u = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(m[0], px), _mm_mul_pd(m[1], py)),
+                                          _mm_mul_pd(m[2], pz)), m[3]);
+        __m128d v = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(m[4], px), _mm_mul_pd(m[5], py)),
+                                          _mm_mul_pd(m[6], pz)), m[7]);
+        __m128d w = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(m[8], px), _mm_mul_pd(m[9], py)),
+                                          _mm_mul_pd(m[10], pz)), m[11]);
+        __m128 fu = _mm_cvtpd_ps(_mm_div_pd(u, w));
+        __m128 fv = _mm_cvtpd_ps(_mm_div_pd(v, w));
+        _mm_storeu_ps(uv + 2 * i, _mm_unpacklo_ps(fu, fv));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        out[i] = projectVertex(M, x[i], y[i], z[i]);
+    }
+}
+
+/*** poses evaluated together by renderToolBatch, two AVX or four SSE2 registers of doubles, one or two of floats ***/
+static const int render_block = 8;
+
+/*** u, v of M_b * [x y z 1] for n vertices and a block of poses, out[i * render_block + b]. The matrix entries are
+ * laid out pose minor, m[k * render_block + b], so the poses of the block sit in one register and every vertex is
+ * read once per block; each pose gets the order of operations of projectVertices ***/
+static void projectVerticesBlock(const meshScalar *m, const meshScalar *x, const meshScalar *y, const meshScalar *z,
+                                 int n, cv::Point2f *out) {
+
+    for (int i = 0; i < n; ++i) {
+        float *uv = (float *) (out + i * render_block);
+        int b = 0;
+
+#if defined(TOOL_MODEL_FLOAT_GEOMETRY) && defined(__AVX__)
+        __m256 px = _mm256_set1_ps(x[i]), py = _mm256_set1_ps(y[i]), pz = _mm256_set1_ps(z[i]);
+        for (; b + 8 <= render_block; b += 8) {
+            const float *mb = m + b;
+            __m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+                    _mm256_mul_ps(_mm256_loadu_ps(mb), px), _mm256_mul_ps(_mm256_loadu_ps(mb + render_block), py)),
+                    _mm256_mul_ps(_mm256_loadu_ps(mb + 2 * render_block), pz)), _mm256_loadu_ps(mb + 3 * render_block));
+            __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+                    _mm256_mul_ps(_mm256_loadu_ps(mb + 4 * render_block), px), _mm256_mul_ps(_mm256_loadu_ps(mb + 5 * render_block), py)),
+                    _mm256_mul_ps(_mm256_loadu_ps(mb + 6 * render_block), pz)), _mm256_loadu_ps(mb + 7 * render_block));
+            __m256 w = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+                    _mm256_mul_ps(_mm256_loadu_ps(mb + 8 * render_block), px), _mm256_mul_ps(_mm256_loadu_ps(mb + 9 * render_block), py)),
+                    _mm256_mul_ps(_mm256_loadu_ps(mb + 10 * render_block), pz)), _mm256_loadu_ps(mb + 11 * render_block));
+            __m256 fu = _mm256_div_ps(u, w), fv = _mm256_div_ps(v, w);
+            __m256 lo = _mm256_unpacklo_ps(fu, fv), hi = _mm256_unpackhi_ps(fu, fv);  //poses 0 1 4 5, then 2 3 6 7
+            _mm256_storeu_ps(uv + 2 * b, _mm256_permute2f128_ps(lo, hi, 0x20));
+            _mm256_storeu_ps(uv + 2 * b + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+        }
+#elif defined(TOOL_MODEL_FLOAT_GEOMETRY) && defined(__SSE2__)
+        __m128 px = _mm_set1_ps(x[i]), py = _mm_set1_ps(y[i]), pz = _mm_set1_ps(z[i]);
+        for (; b + 4 <= render_block; b += 4) {
+            const float *mb = m + b;
+            __m128 u = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+                    _mm_mul_ps(_mm_loadu_ps(mb), px), _mm_mul_ps(_mm_loadu_ps(mb + render_block), py)),
+                    _mm_mul_ps(_mm_loadu_ps(mb + 2 * render_block), pz)), _mm_loadu_ps(mb + 3 * render_block));
+            __m128 v = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+                    _mm_mul_ps(_mm_loadu_ps(mb + 4 * render_block), px), _mm_mul_ps(_mm_loadu_ps(mb + 5 * render_block), py)),
+                    _mm_mul_ps(_mm_loadu_ps(mb + 6 * render_block), pz)), _mm_loadu_ps(mb + 7 * render_block));
+            __m128 w = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+                    _mm_mul_ps(_mm_loadu_ps(mb + 8 * render_block), px), _mm_mul_ps(_mm_loadu_ps(mb + 9 * render_block), py)),
+                    _mm_mul_ps(_mm_loadu_ps(mb + 10 * render_block), pz)), _mm_loadu_ps(mb + 11 * render_block));
+            __m128 fu = _mm_div_ps(u, w), fv = _mm_div_ps(v, w);
+            _mm_storeu_ps(uv + 2 * b, _mm_unpacklo_ps(fu, fv));
+            _mm_storeu_ps(uv + 2 * b + 4, _mm_unpackhi_ps(fu, fv));
+        }
+#elif defined(__AVX__)
+        __m256d px = _mm256_set1_pd(x[i]), py = _mm256_set1_pd(y[i]), pz = _mm256_set1_pd(z[i]);
+        for (; b + 4 <= render_block; b += 4) {
+            const double *mb = m + b;
+            __m256d u = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(
+                    _mm256_mul_pd(_mm256_loadu_pd(mb), px), _mm256_mul_pd(_mm256_loadu_pd(mb + render_block), py)),
+                    _mm256_mul_pd(_mm256_loadu_pd(mb + 2 * render_block), pz)), _mm256_loadu_pd(mb + 3 * render_block));
+            __m256d v = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(
+                    _mm256_mul_pd(_mm256_loadu_pd(mb + 4 * render_block), px), _mm256_mul_pd(_mm256_loadu_pd(mb + 5 * render_block), py)),
+                    _mm256_mul_pd(_mm256_loadu_pd(mb + 6 * render_block), pz)), _mm256_loadu_pd(mb + 7 * render_block));
+            __m256d w = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(
+                    _mm256_mul_pd(_mm256_loadu_pd(mb + 8 * render_block), px), _mm256_mul_pd(_mm256_loadu_pd(mb + 9 * render_block), py)),
+                    _mm256_mul_pd(_mm256_loadu_pd(mb + 10 * render_block), pz)), _mm256_loadu_pd(mb + 11 * render_block));
+            __m128 fu = _mm256_cvtpd_ps(_mm256_div_pd(u, w));
+            __m128 fv = _mm256_cvtpd_ps(_mm256_div_pd(v, w));
+            _mm_storeu_ps(uv + 2 * b, _mm_unpacklo_ps(fu, fv));
+            _mm_storeu_ps(uv + 2 * b + 4, _mm_unpackhi_ps(fu, fv));
+        }
+#elif defined(__SSE2__)
+        __m128d px = _mm_set1_pd(x[i]), py = _mm_set1_pd(y[i]), pz = _mm_set1_pd(z[i]);
+        for (; b + 2 <= render_block; b += 2) {
+            const double *mb = m + b;
+            __m128d u = _mm_add_pd(_mm_add_pd(_mm_add_pd(
+                    _mm_mul_pd(_mm_loadu_pd(mb), px), _mm_mul_pd(_mm_loadu_pd(mb + render_block), py)),
+                    _mm_mul_pd(_mm_loadu_pd(mb + 2 * render_block), pz)), _mm_loadu_pd(mb + 3 * render_block));
+            __m128d v = _mm_add_pd(_mm_add_pd(_mm_add_pd(
+                    _mm_mul_pd(_mm_loadu_pd(mb + 4 * render_block), px), _mm_mul_pd(_mm_loadu_pd(mb + 5 * render_block), py)),
+                    _mm_mul_pd(_mm_loadu_pd(mb + 6 * render_block), pz)), _mm_loadu_pd(mb + 7 * render_block));
+            __m128d w = _mm_add_pd(_mm_add_pd(_mm_add_pd(
+                    _mm_mul_pd(_mm_loadu_pd(mb + 8 * render_block), px), _mm_mul_pd(_mm_loadu_pd(mb + 9 * render_block), py)),
+                    _mm_mul_pd(_mm_loadu_pd(mb + 10 * render_block), pz)), _mm_loadu_pd(mb + 11 * render_block));
+            __m128 fu = _mm_cvtpd_ps(_mm_div_pd(u, w));
+            __m128 fv = _mm_cvtpd_ps(_mm_div_pd(v, w));
+            _mm_storeu_ps(uv + 2 * b, _mm_unpacklo_ps(fu, fv));
+        }
+#endif
+
+        for (; b < render_block; ++b) {
+            const meshScalar *mb = m + b;
+            meshScalar u = mb[0] * x[i] + mb[render_block] * y[i] + mb[2 * render_block] * z[i] + mb[3 * render_block];
+            meshScalar v = mb[4 * render_block] * x[i] + mb[5 * render_block] * y[i] + mb[6 * render_block] * z[i] + mb[7 * render_block];
+            meshScalar w = mb[8 * render_block] * x[i] + mb[9 * render_block] * y[i] + mb[10 * render_block] * z[i] + mb[11 * render_block];
+            uv[2 * b] = (float) (u / w);
+            uv[2 * b + 1] = (float) (v / w);
+        }
+    }
+}
+
+/*** the facing of classifyFaces for n faces and a block of camera positions, facing[i * render_block + b] ***/
+static void classifyFacesBlock(const meshScalar *fnx, const meshScalar *fny, const meshScalar *fnz,
+                               const meshScalar *fcx, const meshScalar *fcy, const meshScalar *fcz, int n,
+                               const meshScalar *eye_x, const meshScalar *eye_y, const meshScalar *eye_z,
+                               meshScalar *facing) {
+
+    for (int i = 0; i < n; ++i) {
+        meshScalar *out = facing + i * render_block;
+        int b = 0;
+
+#if defined(TOOL_MODEL_FLOAT_GEOMETRY) && defined(__AVX__)
+        __m256 nx = _mm256_set1_ps(fnx[i]), ny = _mm256_set1_ps(fny[i]), nz = _mm256_set1_ps(fnz[i]);
+        __m256 cx = _mm256_set1_ps(fcx[i]), cy = _mm256_set1_ps(fcy[i]), cz = _mm256_set1_ps(fcz[i]);
+        for (; b + 8 <= render_block; b += 8) {
+            __m256 d = _mm256_add_ps(_mm256_add_ps(
+                    _mm256_mul_ps(nx, _mm256_sub_ps(cx, _mm256_loadu_ps(eye_x + b))),
+                    _mm256_mul_ps(ny, _mm256_sub_ps(cy, _mm256_loadu_ps(eye_y + b)))),
+                    _mm256_mul_ps(nz, _mm256_sub_ps(cz, _mm256_loadu_ps(eye_z + b))));
+            _mm256_storeu_ps(out + b, d);
+        }
+#elif defined(TOOL_MODEL_FLOAT_GEOMETRY) && defined(__SSE2__)
+        __m128 nx = _mm_set1_ps(fnx[i]), ny = _mm_set1_ps(fny[i]), nz = _mm_set1_ps(fnz[i]);
+        __m128 cx = _mm_set1_ps(fcx[i]), cy = _mm_set1_ps(fcy[i]), cz = _mm_set1_ps(fcz[i]);
+        for (; b + 4 <= render_block; b += 4) {
+            __m128 d = _mm_add_ps(_mm_add_ps(
+                    _mm_mul_ps(nx, _mm_sub_ps(cx, _mm_loadu_ps(eye_x + b))),
+                    _mm_mul_ps(ny, _mm_sub_ps(cy, _mm_loadu_ps(eye_y + b)))),
+                    _mm_mul_ps(nz, _mm_sub_ps(cz, _mm_loadu_ps(eye_z + b))));
+            _mm_storeu_ps(out + b, d);
+        }
+#elif defined(__AVX__)
+        __m256d nx = _mm256_set1_pd(fnx[i]), ny = _mm256_set1_pd(fny[i]), nz = _mm256_set1_pd(fnz[i]);
+        __m256d cx = _mm256_set1_pd(fcx[i]), cy = _mm256_set1_pd(fcy[i]), cz = _mm256_set1_pd(fcz[i]);
+        for (; b + 4 <= render_block; b += 4) {
+            __m256d d = _mm256_add_pd(_mm256_add_pd(
+                    _mm256_mul_pd(nx, _mm256_sub_pd(cx, _mm256_loadu_pd(eye_x + b))),
+                    _mm256_mul_pd(ny, _mm256_sub_pd(cy, _mm256_loadu_pd(eye_y + b)))),
+                    _mm256_mul_pd(nz, _mm256_sub_pd(cz, _mm256_loadu_pd(eye_z + b))));
+            _mm256_storeu_pd(out + b, d);
+        }
+#elif defined(__SSE2__)
+        __m128d nx = _mm_set1_pd(fnx[i]), ny = _mm_set1_pd(fny[i]), nz = _mm_set1_pd(fnz[i]);
+        __m128d cx = _mm_set1_pd(fcx[i]), cy = _mm_set1_pd(fcy[i]), cz = _mm_set1_pd(fcz[i]);
+        for (; b + 2 <= render_block; b += 2) {
+            __m128d d = _mm_add_pd(_mm_add_pd(
+                    _mm_mul_pd(nx, _mm_sub_pd(cx, _mm_loadu_pd(eye_x + b))),
+                    _mm_mul_pd(ny, _mm_sub_pd(cy, _mm_loadu_pd(eye_y + b)))),
+                    _mm_mul_pd(nz, _mm_sub_pd(cz, _mm_loadu_pd(eye_z + b))));
+            _mm_storeu_pd(out + b, d);
+        }
+#endif
+
+        for (; b < render_block; ++b) {
+            out[b] = fnx[i] * (fcx[i] - eye_x[b]) + fny[i] * (fcy[i] - eye_y[b]) + fnz[i] * (fcz[i] - eye_z[b]);
+        }
+    }
+}
+
+/*** g_CT * [R(rvec) | tvec] of one part pose ***/
+static cv::Matx44d poseTransform(const cv::Mat &CamMat, const cv::Mat &rvec, const cv::Mat &tvec) {
+
+    cv::Mat rot(3, 3, CV_64FC1);
+    cv::Rodrigues(rvec, rot);
+
+    cv::Matx44d pose = cv::Matx44d::eye();
+    cv::Matx44d cam;
+    for (int r = 0; r < 3; ++r) {
+        for (int c = 0; c < 3; ++c) {
+            pose(r, c) = rot.at<double>(r, c);
+        }
+        pose(r, 3) = tvec.at<double>(r, 0);
+    }
+    for (int r = 0; r < 4; ++r) {
+        for (int c = 0; c < 4; ++c) {
+            cam(r, c) = CamMat.at<double>(r, c);
+        }
+    }
+    return cam * pose;
+}
+
+static cv::Matx34d projectionMatx(const cv::Mat &P) {
+
+    cv::Matx34d projection;
+    for (int r = 0; r < 3; ++r) {
+        for (int c = 0; c < 4; ++c) {
+            projection(r, c) = P.at<double>(r, c);
+        }
+    }
+    return projection;
+}
+
+/*** P * g_CT, the projection of a point of the tool frame ***/
+static cv::Matx34d cameraProjection(const cv::Mat &CamMat, const cv::Mat &P) {
+
+    cv::Matx44d cam;
+    for (int r = 0; r < 4; ++r) {
+        for (int c = 0; c < 4; ++c) {
+            cam(r, c) = CamMat.at<double>(r, c);
+        }
+    }
+    return projectionMatx(P) * cam;
+}
+
+/*** R(rvec), and its derivatives dR / drvec_k from cv::Rodrigues when dR is not NULL ***/
+static cv::Matx33d rotationMatx(const cv::Mat &rvec, cv::Matx33d *dR = NULL) {
+
+    cv::Mat rot, jacobian;
+    cv::Rodrigues(rvec, rot, jacobian);  //jacobian is 3 x 9, row k holds dR / drvec_k row major
+
+    cv::Matx33d R;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            R(i, j) = rot.at<double>(i, j);
+            for (int k = 0; k < 3 && dR != NULL; ++k) {
+                dR[k](i, j) = jacobian.at<double>(k, 3 * i + j);
+            }
+        }
+    }
+    return R;
+}
+
+static inline cv::Point3d rotatePoint(const cv::Matx33d &R, const cv::Point3d &p) {
+
+    return cv::Point3d(R(0, 0) * p.x + R(0, 1) * p.y + R(0, 2) * p.z, R(1, 0) * p.x + R(1, 1) * p.y + R(1, 2) * p.z,
+                       R(2, 0) * p.x + R(2, 1) * p.y + R(2, 2) * p.z);
+}
+
+/*** the rows d(u, v) / dX of the image point of X, a point of the tool frame, through M = P * g_CT ***/
+static inline void imageDerivative(const cv::Matx34d &M, const cv::Point3d &X, cv::Point3d &du, cv::Point3d &dv) {
+
+    double w = M(2, 0) * X.x + M(2, 1) * X.y + M(2, 2) * X.z + M(2, 3);
+    double u = (M(0, 0) * X.x + M(0, 1) * X.y + M(0, 2) * X.z + M(0, 3)) / w;
+    double v = (M(1, 0) * X.x + M(1, 1) * X.y + M(1, 2) * X.z + M(1, 3)) / w;
+    du = cv::Point3d(M(0, 0) - u * M(2, 0), M(0, 1) - u * M(2, 1), M(0, 2) - u * M(2, 2)) * (1.0 / w);
+    dv = cv::Point3d(M(1, 0) - v * M(2, 0), M(1, 1) - v * M(2, 1), M(1, 2) - v * M(2, 2)) * (1.0 / w);
+}
+
+/*** the Jacobian of Compute_Silhouette: for every part frame point one row, d(u, v) / d(rvec, tvec) of the part ***/
+static void partJacobian(const cv::Matx34d &M, const cv::Mat &rvec, const cv::Mat &tvec,
+                         const std::vector<cv::Point3d> &points, cv::Mat &jac) {
+
+    cv::Matx33d dR[3];
+    cv::Matx33d R = rotationMatx(rvec, dR);
+    cv::Point3d t(tvec.at<double>(0, 0), tvec.at<double>(1, 0), tvec.at<double>(2, 0));
+
+    jac.create(points.size(), 12, CV_64FC1);
+    for (int i = 0; i < points.size(); ++i) {
+        cv::Point3d du, dv;
+        imageDerivative(M, rotatePoint(R, points[i]) + t, du, dv);
+
+        double *row = jac.ptr<double>(i);
+        for (int k = 0; k < 3; ++k) {
+            cv::Point3d dX = rotatePoint(dR[k], points[i]);  //dX / drvec_k, dX / dtvec is the identity
+            row[k] = du.dot(dX);
+            row[6 + k] = dv.dot(dX);
+        }
+        row[3] = du.x;
+        row[4] = du.y;
+        row[5] = du.z;
+        row[9] = dv.x;
+        row[10] = dv.y;
+        row[11] = dv.z;
+    }
+}
+
+/*************** the part in the image: g_CT * [R | t] of the pose, and every vertex projected once through P * g_CT * [R | t] *******************/
+void ToolModel::transformMesh(const toolMesh &mesh, const cv::Mat &CamMat, const cv::Mat &rvec, const cv::Mat &tvec,
+                              const cv::Mat &P, cameraMesh &camera_mesh, bool with_normals) {
+
+    camera_mesh.transform = poseTransform(CamMat, rvec, tvec);
+    const cv::Matx44d &G = camera_mesh.transform;
+
+    int V = mesh.numVertices();
+    camera_mesh.projected.resize(V);
+    projectVertices(projectionMatx(P) * G, mesh.vx.data(), mesh.vy.data(), mesh.vz.data(), V,
+                    camera_mesh.projected.data());
+
+    if (!with_normals) return;
+
+    int N = mesh.numNormals();
+    camera_mesh.nx.resize(N);
+    camera_mesh.ny.resize(N);
+    camera_mesh.nz.resize(N);
+    for (int i = 0; i < N; ++i) {
+        double x = mesh.nx[i], y = mesh.ny[i], z = mesh.nz[i];
+        camera_mesh.nx[i] = G(0, 0) * x + G(0, 1) * y + G(0, 2) * z;
+        camera_mesh.ny[i] = G(1, 0) * x + G(1, 1) * y + G(1, 2) * z;
+        camera_mesh.nz[i] = G(2, 0) * x + G(2, 1) * y + G(2, 2) * z;
+    }
+};
+
+/*** camera position in the part frame, -Q^T d for G = [Q | d] ***/
+static cv::Point3d cameraPosition(const cv::Matx44d &G) {
+
+    return cv::Point3d(-(G(0, 0) * G(0, 3) + G(1, 0) * G(1, 3) + G(2, 0) * G(2, 3)),
+                       -(G(0, 1) * G(0, 3) + G(1, 1) * G(1, 3) + G(2, 1) * G(2, 3)),
+                       -(G(0, 2) * G(0, 3) + G(1, 2) * G(1, 3) + G(2, 2) * G(2, 3)));
+}
+
+/*** the facing of one face, in the precision of the mesh so every pass finds the same signs ***/
+static inline meshScalar faceFacing(const ToolModel::toolMesh &mesh, int face, meshScalar eye_x, meshScalar eye_y,
+                                    meshScalar eye_z) {
+
+    return mesh.fnx[face] * (mesh.fcx[face] - eye_x) + mesh.fny[face] * (mesh.fcy[face] - eye_y) +
+           mesh.fnz[face] * (mesh.fcz[face] - eye_z);
+}
+
+/*** (G n) . (G c) with G = [Q | d] rigid equals n . (c + Q^T d): bring the camera into the part frame once ***/
+void ToolModel::classifyFaces(const toolMesh &mesh, cameraMesh &camera_mesh) {
+
+    cv::Point3d eye = cameraPosition(camera_mesh.transform);
+    meshScalar eye_x = eye.x, eye_y = eye.y, eye_z = eye.z;
+
+    int face_num = mesh.numFaces();
+    camera_mesh.facing.resize(face_num);
+    for (int i = 0; i < face_num; ++i) {
+        camera_mesh.facing[i] = faceFacing(mesh, i, eye_x, eye_y, eye_z);
+    }
+};
+
+/* the side of a shared edge that draws it: the front facing face whose neighbor is not front facing, with its own
+ * view of the shared vertices. strict follows the UKF, which skips neighbors exactly edge-on. NULL if no silhouette */
+static inline const int *silhouetteEnds(const int *edge, double facing_a, double facing_b, bool strict) {
+
+    double product = facing_a * facing_b;
+    bool differ = strict ? product < 0.0 : product <= 0.0;
+
+    if (!differ) return NULL;
+    if (facing_a < 0.0) return edge + 2;
+    if (facing_b < 0.0) return edge + 6;
+    return NULL;
+}
+
+static inline const int *silhouetteEnds(const int *edge, const meshScalar *facing, int stride, bool strict) {
+
+    return silhouetteEnds(edge, facing[edge[0] * stride], facing[edge[1] * stride], strict);
+}
+
+/*** the horizontal range the PF renders keep a silhouette edge in, in the pixels of the image rendered to ***/
+struct edgeRange {
+    double x_min;
+    double x_max;
+};
+
+static const edgeRange full_edge_range = {-100.0, 640.0};
+
+/*** the full resolution range on a pyramid level, scaled as renderToolBatch expects its projection to be ***/
+static edgeRange pyramidEdgeRange(int level) {
+
+    double s = 1.0 / (1 << level);
+    edgeRange range = {full_edge_range.x_min * s + 0.5 * (s - 1), full_edge_range.x_max * s + 0.5 * (s - 1)};
+    return range;
+}
+
+static inline bool keepEdge(const cv::Point2d &prjpt_1, const cv::Point2d &prjpt_2, const edgeRange &range) {
+
+    return prjpt_1.x <= range.x_max && prjpt_1.x >= range.x_min && prjpt_2.x < range.x_max &&
+           prjpt_2.x >= range.x_min;
+}
+
+/*** one point of the part frame to the image through M = P * g_CT * [R | t], false if it is not in front of the camera ***/
+static inline bool projectPoint(const cv::Matx34d &M, double x, double y, double z, cv::Point2d &pt) {
+
+    double w = M(2, 0) * x + M(2, 1) * y + M(2, 2) * z + M(2, 3);
+    if (w <= 0.0) return false;
+    pt.x = (M(0, 0) * x + M(0, 1) * y + M(0, 2) * z + M(0, 3)) / w;
+    pt.y = (M(1, 0) * x + M(1, 1) * y + M(1, 2) * z + M(1, 3)) / w;
+    return true;
+}
+
+/*** clip a projected edge to the horizontal range keepEdge accepts, false if nothing is left ***/
+static bool clipEdge(cv::Point2d &prjpt_1, cv::Point2d &prjpt_2, const edgeRange &range) {
+
+    const double x_min = range.x_min, x_max = range.x_max;
+    if (prjpt_1.x > prjpt_2.x) std::swap(prjpt_1, prjpt_2);
+    if (prjpt_2.x < x_min || prjpt_1.x >= x_max) return false;
+
+    cv::Point2d direction = prjpt_2 - prjpt_1;
+    if (prjpt_1.x < x_min) prjpt_1 = prjpt_1 + direction * ((x_min - prjpt_1.x) / direction.x);
+    if (prjpt_2.x > x_max) prjpt_2 = prjpt_1 + direction * ((x_max - prjpt_1.x) / direction.x);
+    return true;
+}
+
+/*** the point of the part frame segment [a, b] projecting to pt through M, for an end point moved by clipEdge ***/
+static cv::Point3d segmentPoint(const cv::Matx34d &M, const cv::Point3d &a, const cv::Point3d &b,
+                                const cv::Point2d &pt) {
+
+    cv::Point3d d = b - a;
+    double w_a = M(2, 0) * a.x + M(2, 1) * a.y + M(2, 2) * a.z + M(2, 3);
+    double w_d = M(2, 0) * d.x + M(2, 1) * d.y + M(2, 2) * d.z;
+    double u_a = M(0, 0) * a.x + M(0, 1) * a.y + M(0, 2) * a.z + M(0, 3);
+    double u_d = M(0, 0) * d.x + M(0, 1) * d.y + M(0, 2) * d.z;
+    double v_a = M(1, 0) * a.x + M(1, 1) * a.y + M(1, 2) * a.z + M(1, 3);
+    double v_d = M(1, 0) * d.x + M(1, 1) * d.y + M(1, 2) * d.z;
+
+    /* pt.x = (u_a + s u_d) / (w_a + s w_d), the same in y, solved along the better conditioned of the two */
+    double den_x = u_d - pt.x * w_d;
+    double den_y = v_d - pt.y * w_d;
+    double s = 0.0;
+    if (std::abs(den_x) >= std::abs(den_y) && den_x != 0.0) s = (pt.x * w_a - u_a) / den_x;
+    else if (den_y != 0.0) s = (pt.y * w_a - v_a) / den_y;
+    return a + d * s;
+}
+
+/*** chords per full turn when drawing an end face arc, the chords stay within radius * (1 - cos(5 deg)) of the rim ***/
+static const int cylinder_arc_chords = 36;
+
+/*************** silhouette of a capped cylinder in closed form. With the camera at angle phi around the axis and at
+ * distance d from it, the side faces the camera within phi +- acos(radius / d): those two generators are the side
+ * contour, and each end face rim is drawn where the end face and the side face the camera differently, the arc away
+ * from the camera if the end face is front facing, the arc towards it otherwise. Leaves the edges untouched and
+ * returns false when the camera is inside the axis cylinder or a point is behind the camera *******************/
+static bool cylinderEdges(const ToolModel::cylinderShape &cylinder, const cv::Matx44d &G,
+                          const cv::Matx34d &projection, const edgeRange &range,
+                          std::vector<cv::Point2d> &silhouette_edges, std::vector<cv::Point3d> *edge_points = NULL) {
+
+    cv::Point3d eye = cameraPosition(G);
+    double eye_x = eye.x - cylinder.center_x;
+    double eye_z = eye.z - cylinder.center_z;
+    double distance = std::sqrt(eye_x * eye_x + eye_z * eye_z);
+    if (distance <= cylinder.radius * (1.0 + 1e-6)) return false;
+
+    double phi = std::atan2(eye_z, eye_x);
+    double alpha = std::acos(cylinder.radius / distance);
+
+    cv::Matx34d M = projection * G;
+    size_t first = silhouette_edges.size();
+    size_t first_point = edge_points != NULL ? edge_points->size() : 0;
+
+    /* the two tangent generators */
+    for (int k = 0; k < 2; ++k) {
+        double theta = k == 0 ? phi - alpha : phi + alpha;
+        double x = cylinder.center_x + cylinder.radius * std::cos(theta);
+        double z = cylinder.center_z + cylinder.radius * std::sin(theta);
+
+        cv::Point2d prjpt_1, prjpt_2;
+        if (!projectPoint(M, x, cylinder.y_min, z, prjpt_1) || !projectPoint(M, x, cylinder.y_max, z, prjpt_2)) {
+            silhouette_edges.resize(first);
+            if (edge_points != NULL) edge_points->resize(first_point);
+            return false;
+        }
+        if (clipEdge(prjpt_1, prjpt_2, range)) {
+            silhouette_edges.push_back(prjpt_1);
+            silhouette_edges.push_back(prjpt_2);
+            if (edge_points != NULL) {
+                cv::Point3d bottom(x, cylinder.y_min, z), top(x, cylinder.y_max, z);
+                edge_points->push_back(segmentPoint(M, bottom, top, prjpt_1));
+                edge_points->push_back(segmentPoint(M, bottom, top, prjpt_2));
+            }
+        }
+    }
+
+    /* the end face arcs, outward normals -y at y_min and +y at y_max */
+    for (int k = 0; k < 2; ++k) {
+        double y = k == 0 ? cylinder.y_min : cylinder.y_max;
+        bool front_facing = k == 0 ? eye.y < y : eye.y > y;
+        double start = front_facing ? phi + alpha : phi - alpha;
+        double span = front_facing ? 2.0 * CV_PI - 2.0 * alpha : 2.0 * alpha;
+        int chords = std::max(1, (int) std::ceil(span * cylinder_arc_chords / (2.0 * CV_PI)));
+
+        cv::Point2d previous, current;
+        cv::Point3d previous_point, current_point;
+        for (int c = 0; c <= chords; ++c) {
+            double theta = start + span * c / chords;
+            current_point = cv::Point3d(cylinder.center_x + cylinder.radius * std::cos(theta), y,
+                                        cylinder.center_z + cylinder.radius * std::sin(theta));
+            if (!projectPoint(M, current_point.x, current_point.y, current_point.z, current)) {
+                silhouette_edges.resize(first);
+                if (edge_points != NULL) edge_points->resize(first_point);
+                return false;
+            }
+            if (c > 0 && keepEdge(previous, current, range)) {
+                silhouette_edges.push_back(previous);
+                silhouette_edges.push_back(current);
+                if (edge_points != NULL) {
+                    edge_points->push_back(previous_point);
+                    edge_points->push_back(current_point);
+                }
+            }
+            previous = current;
+            previous_point = current_point;
+        }
+    }
+
+    return true;
+}
+
+/*** the part frame ends of a silhouette edge, for the Jacobians ***/
+static inline void pushEdgePoints(const ToolModel::toolMesh &mesh, const int *ends,
+                                  std::vector<cv::Point3d> *edge_points) {
+
+    if (edge_points == NULL) return;
+    edge_points->push_back(cv::Point3d(mesh.vx[ends[0]], mesh.vy[ends[0]], mesh.vz[ends[0]]));
+    edge_points->push_back(cv::Point3d(mesh.vx[ends[2]], mesh.vy[ends[2]], mesh.vz[ends[2]]));
+}
+
+/*** the cache of a part in a render buffer, added on first use ***/
+static ToolModel::silhouetteCache &partCache(std::vector<ToolModel::silhouetteCache> &caches,
+                                             const ToolModel::toolMesh &mesh) {
+
+    for (int i = 0; i < caches.size(); ++i) {
+        if (caches[i].mesh == &mesh) return caches[i];
+    }
+    caches.push_back(ToolModel::silhouetteCache(&mesh));
+    return caches.back();
+}
+
+/*** queue a face for the incremental pass, once per pass ***/
+static inline void queueFace(ToolModel::silhouetteCache &cache, int face) {
+
+    if (cache.queued_stamp[face] == cache.stamp) return;
+    cache.queued_stamp[face] = cache.stamp;
+    cache.queue.push_back(face);
+}
+
+/*** the facing of classifyFaces for one face, computed once per pass ***/
+static inline void cacheFacing(const ToolModel::toolMesh &mesh, ToolModel::silhouetteCache &cache, int face,
+                               const cv::Point3d &eye) {
+
+    if (cache.face_stamp[face] == cache.stamp) return;
+    cache.face_stamp[face] = cache.stamp;
+    cache.facing[face] = faceFacing(mesh, face, eye.x, eye.y, eye.z);
+}
+
+/*** the projection of transformMesh for one vertex, computed once per pass ***/
+static inline cv::Point2d cacheProjected(const ToolModel::toolMesh &mesh, ToolModel::silhouetteCache &cache,
+                                         int vertex, const meshMatx34 &M) {
+
+    if (cache.vertex_stamp[vertex] != cache.stamp) {
+        cache.vertex_stamp[vertex] = cache.stamp;
+        cache.projected[vertex] = projectVertex(M, mesh.vx[vertex], mesh.vy[vertex], mesh.vz[vertex]);
+    }
+    return cache.projected[vertex];
+}
+
+/*************** the silhouette edges of a pose close to the cached one: re-test the edges of the faces along the old
+ * silhouette and of their neighbors, then keep following every silhouette edge found, so the silhouette is tracked
+ * wherever it moved. The edges come out in edge list order, as from the full pass. False when the cache can not be used
+ * and every face has to be tested *******************/
+static bool incrementalEdges(const ToolModel::toolMesh &mesh, const cv::Matx44d &G, const cv::Matx34d &projection,
+                             const edgeRange &range, double max_angle, ToolModel::silhouetteCache &cache,
+                             std::vector<cv::Point2d> &silhouette_edges, std::vector<cv::Point3d> *edge_points = NULL) {
+
+    if (!cache.valid || cache.edges.empty()) return false;
+
+    cv::Point3d eye = cameraPosition(G);
+    cv::Point3d center = (mesh.box_min + mesh.box_max) * 0.5;
+    if (cv::norm(eye - cache.eye) > max_angle * cv::norm(eye - center)) return false;
+
+    if (cache.face_stamp.size() != mesh.numFaces() || cache.stamp == INT_MAX) {
+        cache.face_stamp.assign(mesh.numFaces(), 0);
+        cache.queued_stamp.assign(mesh.numFaces(), 0);
+        cache.facing.resize(mesh.numFaces());
+        cache.edge_stamp.assign(mesh.numEdges(), 0);
+        cache.vertex_stamp.assign(mesh.numVertices(), 0);
+        cache.projected.resize(mesh.numVertices());
+        cache.stamp = 0;
+    }
+    ++cache.stamp;
+
+    /* start from the faces of the old silhouette and their neighbors */
+    cache.queue.clear();
+    for (int i = 0; i < cache.edges.size(); ++i) {
+        for (int side = 0; side < 2; ++side) {
+            int face = mesh.edge_data[10 * cache.edges[i] + side];
+            queueFace(cache, face);
+            for (int j = mesh.neighbor_start[face]; j < mesh.neighbor_start[face + 1]; j += 5) {
+                queueFace(cache, mesh.neighbor_data[j]);
+            }
+        }
+    }
+
+    cache.edges.clear();
+    for (int q = 0; q < cache.queue.size(); ++q) {
+        int face = cache.queue[q];
+        for (int j = mesh.face_edge_start[face]; j < mesh.face_edge_start[face + 1]; ++j) {
+            int e = mesh.face_edge_data[j];
+            if (cache.edge_stamp[e] == cache.stamp) continue;
+            cache.edge_stamp[e] = cache.stamp;
+
+            const int *edge = &mesh.edge_data[10 * e];
+            cacheFacing(mesh, cache, edge[0], eye);
+            cacheFacing(mesh, cache, edge[1], eye);
+            if (silhouetteEnds(edge, cache.facing.data(), 1, false) == NULL) continue;
+
+            cache.edges.push_back(e);
+            queueFace(cache, edge[0]);
+            queueFace(cache, edge[1]);
+        }
+    }
+    std::sort(cache.edges.begin(), cache.edges.end());
+    cache.eye = eye;
+
+    meshMatx34 M = projection * G;
+    for (int i = 0; i < cache.edges.size(); ++i) {
+        const int *ends = silhouetteEnds(&mesh.edge_data[10 * cache.edges[i]], cache.facing.data(), 1, false);
+        cv::Point2d prjpt_1 = cacheProjected(mesh, cache, ends[0], M);
+        cv::Point2d prjpt_2 = cacheProjected(mesh, cache, ends[2], M);
+        if (keepEdge(prjpt_1, prjpt_2, range)) {
+            silhouette_edges.push_back(prjpt_1);
+            silhouette_edges.push_back(prjpt_2);
+            pushEdgePoints(mesh, ends, edge_points);
+        }
+    }
+    return true;
+}
+
+/*** relative margin of clusterSide, far above the rounding of classifyFaces in the mesh precision so its signs agree ***/
+static const double cluster_margin = sizeof(meshScalar) == sizeof(float) ? 1e-5 : 1e-9;
+
+/*** +1 when the normal cone and centroid sphere of a cluster put every face back facing, -1 every face front facing,
+ * 0 when they can not tell. With v from the camera to the sphere center at angle phi to the cone axis, a face normal
+ * is within phi +- half angle of v, and its facing within the sphere radius of |v| cos of that angle. The cosines come
+ * from the angle sums, no trigonometry per cluster ***/
+static inline int clusterSide(const double *bounds, const cv::Point3d &eye) {
+
+    double cos_half = bounds[3], radius = bounds[7];
+    if (cos_half <= 0.0) return 0;  //a cone of half a sphere or more faces every way
+
+    cv::Point3d v(bounds[4] - eye.x, bounds[5] - eye.y, bounds[6] - eye.z);
+    double length = std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+    if (length <= radius) return 0;
+
+    double cos_phi = std::max(-1.0, std::min(1.0, (bounds[0] * v.x + bounds[1] * v.y + bounds[2] * v.z) / length));
+    double sin_phi = std::sqrt(1.0 - cos_phi * cos_phi);
+    double sin_half = std::sqrt(1.0 - cos_half * cos_half);
+    double margin = cluster_margin * (length + radius);
+
+    /* phi + half angle below 90 degrees, and phi - half angle above */
+    if (cos_phi > 0.0 && length * (cos_phi * cos_half - sin_phi * sin_half) - radius > margin) return 1;
+    if (cos_phi < 0.0 && -length * (cos_phi * cos_half + sin_phi * sin_half) - radius > margin) return -1;
+    return 0;
+}
+
+/*** the facing of cluster_faces[p] during the cluster pass: the side of its leaf, or its own when the leaf was opened ***/
+static inline double clusterFacing(const ToolModel::toolMesh &mesh, const ToolModel::cameraMesh &scratch, int p) {
+
+    int side = scratch.cluster_state[mesh.cluster_leaf[p]];
+    return side == 0 ? scratch.facing[p] : side;
+}
+
+/*** classify the faces of a cluster, skipping it whole when its bounds allow, then list the edges that part ways in it
+ * with faces facing differently. Returns the side of every face like clusterSide, also when found face by face, so
+ * the edges between two clusters on the same side are skipped too ***/
+static int visitCluster(const ToolModel::toolMesh &mesh, int cluster, const cv::Point3d &eye,
+                        ToolModel::cameraMesh &scratch) {
+
+    const int *node = &mesh.cluster_data[5 * cluster];
+    int side = clusterSide(&mesh.cluster_bounds[8 * cluster], eye);
+    if (side != 0) {
+        std::fill(scratch.cluster_state.begin() + node[3], scratch.cluster_state.begin() + node[3] + node[4], side);
+        return side;
+    }
+
+    if (node[2] < 0) {
+        scratch.cluster_state[node[3]] = 0;
+        bool front = true, back = true;
+        for (int p = node[0]; p < node[0] + node[1]; ++p) {
+            int face = mesh.cluster_faces[p];
+            meshScalar facing = faceFacing(mesh, face, eye.x, eye.y, eye.z);
+            scratch.facing[p] = facing;
+            front = front && facing < 0.0;
+            back = back && facing > 0.0;
+        }
+        side = front ? -1 : (back ? 1 : 0);
+    } else {
+        int left = visitCluster(mesh, node[2], eye, scratch);
+        int right = visitCluster(mesh, node[2] + 1, eye, scratch);
+        side = left == right ? left : 0;
+    }
+    if (side != 0) return side;
+
+    for (int j = mesh.cluster_edge_start[cluster]; j < mesh.cluster_edge_start[cluster + 1]; ++j) {
+        const int *entry = &mesh.cluster_edge_data[5 * j];
+        int side_a = scratch.cluster_state[entry[3]], side_b = scratch.cluster_state[entry[4]];
+        if (side_a * side_b > 0) continue;  //both faces in clusters on the same side
+        double facing_a = side_a == 0 ? scratch.facing[entry[1]] : side_a;
+        double facing_b = side_b == 0 ? scratch.facing[entry[2]] : side_b;
+        if (facing_a * facing_b <= 0.0) {
+            scratch.silhouette.push_back(j);
+        }
+    }
+    return 0;
+}
+
+/*************** the silhouette edges of a part with a cluster hierarchy: the clusters entirely front or back facing
+ * are skipped with their faces and edges, and only the ends of the silhouette edges are projected. Same edges in the
+ * same order as the full pass, listed in scratch.silhouette *******************/
+static void clusterEdges(const ToolModel::toolMesh &mesh, const cv::Matx44d &G, const cv::Matx34d &projection,
+                         const edgeRange &range, ToolModel::cameraMesh &scratch, std::vector<cv::Point2d> &silhouette_edges,
+                         std::vector<cv::Point3d> *edge_points = NULL) {
+
+    scratch.projected.resize(mesh.numVertices());
+    scratch.facing.resize(mesh.numFaces());
+    scratch.cluster_state.resize(mesh.cluster_data[4]);
+    scratch.silhouette.clear();
+    visitCluster(mesh, 0, cameraPosition(G), scratch);
+
+    /* the candidates are entries of cluster_edge_data, keep the edges with a front facing side in edge list order */
+    int found = 0;
+    for (int i = 0; i < scratch.silhouette.size(); ++i) {
+        const int *entry = &mesh.cluster_edge_data[5 * scratch.silhouette[i]];
+        if (silhouetteEnds(&mesh.edge_data[10 * entry[0]], clusterFacing(mesh, scratch, entry[1]),
+                           clusterFacing(mesh, scratch, entry[2]), false) != NULL) {
+            scratch.silhouette[found++] = entry[0];
+        }
+    }
+    scratch.silhouette.resize(found);
+    std::sort(scratch.silhouette.begin(), scratch.silhouette.end());
+
+    /* project the ends first, then read them back as floats like the full pass does */
+    meshMatx34 M = projection * G;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < found; ++i) {
+            const int *edge = &mesh.edge_data[10 * scratch.silhouette[i]];
+            const int *ends = silhouetteEnds(edge, clusterFacing(mesh, scratch, mesh.cluster_position[edge[0]]),
+                                             clusterFacing(mesh, scratch, mesh.cluster_position[edge[1]]), false);
+            if (pass == 0) {
+                scratch.projected[ends[0]] = projectVertex(M, mesh.vx[ends[0]], mesh.vy[ends[0]], mesh.vz[ends[0]]);
+                scratch.projected[ends[2]] = projectVertex(M, mesh.vx[ends[2]], mesh.vy[ends[2]], mesh.vz[ends[2]]);
+                continue;
+            }
+
+            cv::Point2d prjpt_1 = scratch.projected[ends[0]];
+            cv::Point2d prjpt_2 = scratch.projected[ends[2]];
+            if (keepEdge(prjpt_1, prjpt_2, range)) {
+                silhouette_edges.push_back(prjpt_1);
+                silhouette_edges.push_back(prjpt_2);
+                pushEdgePoints(mesh, ends, edge_points);
+            }
+        }
+    }
+}
+
+/*************** using Vertices to find the contour, output the projected end points of the silhouette edges *******************/
+void ToolModel::Compute_Silhouette_Edges(const toolMesh &mesh, cameraMesh &camera_mesh, cv::Mat &CamMat,
+                                         const cv::Mat &rvec, const cv::Mat &tvec, const cv::Mat &P,
+                                         std::vector<cv::Point2d> &silhouette_edges, silhouetteCache *cache,
+                                         std::vector<cv::Point3d> *edge_points) {
+
+    if (analyticBody && mesh.cylinder.valid &&
+        cylinderEdges(mesh.cylinder, poseTransform(CamMat, rvec, tvec), projectionMatx(P), full_edge_range,
+                      silhouette_edges, edge_points)) {
+        return;
+    }
+    if (cache != NULL && incrementalSilhouetteAngle > 0.0 &&
+        incrementalEdges(mesh, poseTransform(CamMat, rvec, tvec), projectionMatx(P), full_edge_range,
+                         incrementalSilhouetteAngle, *cache, silhouette_edges, edge_points)) {
+        return;
+    }
+    if (mesh.numClusters() > 0) {
+        cv::Matx44d G = poseTransform(CamMat, rvec, tvec);
+        clusterEdges(mesh, G, projectionMatx(P), full_edge_range, camera_mesh, silhouette_edges, edge_points);
+        if (cache != NULL) {
+            cache->valid = true;
+            cache->eye = cameraPosition(G);
+            cache->edges = camera_mesh.silhouette;
+        }
+        return;
+    }
+
+    transformMesh(mesh, CamMat, rvec, tvec, P, camera_mesh); //every point projected to the image
+    classifyFaces(mesh, camera_mesh);  //front or back, once per face
+    const cameraMesh &cam = camera_mesh;
+
+    if (cache != NULL) {
+        cache->valid = true;
+        cache->eye = cameraPosition(cam.transform);
+        cache->edges.clear();
+    }
+
+    for (int e = 0; e < mesh.numEdges(); ++e) {
+        const int *ends = silhouetteEnds(&mesh.edge_data[10 * e], cam.facing.data(), 1, false);
+        if (ends == NULL) continue;
+        if (cache != NULL) cache->edges.push_back(e);
+
+        /*finish finding, drawing the image*/
+        cv::Point2d prjpt_1 = cam.projected[ends[0]];
+        cv::Point2d prjpt_2 = cam.projected[ends[2]];
+        if (keepEdge(prjpt_1, prjpt_2, full_edge_range))
+        {
+            silhouette_edges.push_back(prjpt_1);
+            silhouette_edges.push_back(prjpt_2);
+            pushEdgePoints(mesh, ends, edge_points);
+        }
+    }
+
+};
+
+/*************** using Vertices to draw the contour *******************/
+void ToolModel::Compute_Silhouette(const toolMesh &mesh, cv::Mat &CamMat, cv::Mat &image, const cv::Mat &rvec,
+                                   const cv::Mat &tvec, const cv::Mat &P, cv::OutputArray jac) {
+
+    cameraMesh camera_mesh;
+    std::vector<cv::Point2d> silhouette_edges;
+    std::vector<cv::Point3d> edge_points;
+    Compute_Silhouette_Edges(mesh, camera_mesh, CamMat, rvec, tvec, P, silhouette_edges, NULL,
+                             jac.needed() ? &edge_points : NULL);
+
+    for (int i = 0; i + 1 < silhouette_edges.size(); i += 2) {
+        cv::line(image, silhouette_edges[i], silhouette_edges[i + 1], cv::Scalar(255, 255, 0), 1, 8, 0);
+    }
+
+    if (jac.needed()) {
+        cv::Mat rows;
+        partJacobian(cameraProjection(CamMat, P), rvec, tvec, edge_points, rows);
+        rows.copyTo(jac);
+    }
+
+};
+
+/*************** using Vertices to rasterize the contour into a point list, same pixels as cv::line *******************/
+void ToolModel::Compute_Silhouette(const toolMesh &mesh, cv::Mat &CamMat, renderBuffer &buffer, const cv::Mat &rvec,
+                                   const cv::Mat &tvec, const cv::Mat &P, cv::OutputArray jac) {
+
+    buffer.edges.clear();
+    buffer.edge_points.clear();
+    silhouetteCache *cache = incrementalSilhouetteAngle > 0.0 ? &partCache(buffer.silhouette_caches, mesh) : NULL;
+    Compute_Silhouette_Edges(mesh, buffer.camera_mesh, CamMat, rvec, tvec, P, buffer.edges, cache,
+                             jac.needed() ? &buffer.edge_points : NULL);
+
+    for (int i = 0; i + 1 < buffer.edges.size(); i += 2) {
+        //overlapping edges only count once, as in the rendered image
+        rasterizeEdge(buffer.visited, buffer.edges[i], buffer.edges[i + 1], buffer.sample_step, buffer.points);
+    }
+
+    if (jac.needed()) {
+        cv::Mat rows;
+        partJacobian(cameraProjection(CamMat, P), rvec, tvec, buffer.edge_points, rows);
+        rows.copyTo(jac);
+    }
+
 };
 
-/*************** using Vertices to draw the contour *******************/
-void ToolModel::Compute_Silhouette(const std::vector<std::vector<int> > &input_faces,
-                                   const std::vector<std::vector<int> > &neighbor_faces,
-                                   const cv::Mat &input_Vmat, const cv::Mat &input_Nmat,
-                                   cv::Mat &CamMat, cv::Mat &image, const cv::Mat &rvec, const cv::Mat &tvec,
-                                   const cv::Mat &P, cv::OutputArray jac) {
-
-
-    cv::Mat new_Vertices = transformPoints(input_Vmat, rvec, tvec);
-
-    new_Vertices = camTransformMats(CamMat, new_Vertices); //transform every point under camera frame
-
-    cv::Mat new_Normals = transformPoints(input_Nmat, rvec, tvec);
-    new_Normals = camTransformMats(CamMat, new_Normals); //transform every surface normal under camera frame
-
-    unsigned long neighbor_num = 0;
-    cv::Mat temp(4, 1, CV_64FC1);
-
-    cv::Mat ept_1(4, 1, CV_64FC1);
-    cv::Mat ept_2(4, 1, CV_64FC1);
-
-    for (int i = 0; i < input_faces.size(); ++i) {
-        neighbor_num = (neighbor_faces[i].size()) / 5;  //each neighbor has two vertices, used to be 3 when normals
-
-        if (neighbor_num > 0) {
-            int v1 = input_faces[i][0];
-            int v2 = input_faces[i][1];
-            int v3 = input_faces[i][2];
-            int n1 = input_faces[i][3];
-            int n2 = input_faces[i][4];
-            int n3 = input_faces[i][5];
-
-            new_Vertices.col(v1).copyTo(temp.col(0));
-            cv::Point3d pt1 = convert_MattoPts(temp);
-            new_Vertices.col(v2).copyTo(temp.col(0));
-            cv::Point3d pt2 = convert_MattoPts(temp);
-            new_Vertices.col(v3).copyTo(temp.col(0));
-            cv::Point3d pt3 = convert_MattoPts(temp);
-
-            new_Normals.col(n1).copyTo(temp.col(0));
-            cv::Point3d vn1 = convert_MattoPts(temp);
-            new_Normals.col(n2).copyTo(temp.col(0));
-            cv::Point3d vn2 = convert_MattoPts(temp);
-            new_Normals.col(n3).copyTo(temp.col(0));
-            cv::Point3d vn3 = convert_MattoPts(temp);
-
-            cv::Point3d fnormal = FindFaceNormal(pt1, pt2, pt3, vn1, vn2, vn3); //knowing the direction and normalized
-            cv::Point3d face_point_i = pt1 + pt2 + pt3;
-            face_point_i.x = face_point_i.x / 3;
-            face_point_i.y = face_point_i.y / 3;
-            face_point_i.z = face_point_i.z / 3;
-
-            double isfront_i = dotProduct(fnormal, face_point_i);
-            if(isfront_i < 0.000){
-                for (int neighbor_count = 0; neighbor_count <
-                                             neighbor_num; ++neighbor_count) {  //notice: cannot use J here, since the last j will not be counted
-                    int j = 5 * neighbor_count;
-                    int v1_ = input_faces[neighbor_faces[i][j]][0];
-                    int v2_ = input_faces[neighbor_faces[i][j]][1];
-                    int v3_ = input_faces[neighbor_faces[i][j]][2];
-
-                    int n1_ = input_faces[neighbor_faces[i][j]][3];
-                    int n2_ = input_faces[neighbor_faces[i][j]][4];
-                    int n3_ = input_faces[neighbor_faces[i][j]][5];
-
-                    new_Vertices.col(v1_).copyTo(temp.col(0));
-                    cv::Point3d pt1_ = convert_MattoPts(temp);
-                    new_Vertices.col(v2_).copyTo(temp.col(0));
-                    cv::Point3d pt2_ = convert_MattoPts(temp);
-                    new_Vertices.col(v3_).copyTo(temp.col(0));
-                    cv::Point3d pt3_ = convert_MattoPts(temp);
-
-                    new_Normals.col(n1_).copyTo(temp.col(0));
-                    cv::Point3d vn1_ = convert_MattoPts(temp);
-                    new_Normals.col(n2_).copyTo(temp.col(0));
-                    cv::Point3d vn2_ = convert_MattoPts(temp);
-                    new_Normals.col(n3_).copyTo(temp.col(0));
-                    cv::Point3d vn3_ = convert_MattoPts(temp);
-
-                    cv::Point3d fnormal_n = FindFaceNormal(pt1_, pt2_, pt3_, vn1_, vn2_, vn3_);
-
-                    cv::Point3d face_point_j = pt1_ + pt2_ + pt3_;
-                    face_point_j.x = face_point_j.x / 3;
-                    face_point_j.y = face_point_j.y / 3;
-                    face_point_j.z = face_point_j.z / 3;
-
-                    double isfront_j = dotProduct(fnormal_n, face_point_j);
-
-                    if (isfront_i * isfront_j <= 0.0) // one is front, another is back
-                    {
-                        /*finish finding, drawing the image*/
-                        new_Vertices.col(neighbor_faces[i][j + 1]).copyTo(ept_1);  //under camera frames
-                        new_Vertices.col(neighbor_faces[i][j + 3]).copyTo(ept_2);
-
-                        cv::Point2d prjpt_1 = reproject(ept_1, P);
-                        cv::Point2d prjpt_2 = reproject(ept_2, P);
-                        if (prjpt_1.x <= 640 && prjpt_1.x >= -100 && prjpt_2.x < 640 && prjpt_2.x >= -100)
-                        {
-                            cv::line(image, prjpt_1, prjpt_2, cv::Scalar(255, 255, 0), 1, 8, 0);
-                        }
+/*************** Bresenham into a binary mask, walking the same pixels in the same order as cv::line's LineIterator *******************/
+int ToolModel::rasterizeEdge(cv::Mat &mask, const cv::Point2d &pt1, const cv::Point2d &pt2, int step,
+                             std::vector<cv::Point> &points) {
 
-                    }
-                }
+    cv::Point p1(cvRound(pt1.x), cvRound(pt1.y));
+    cv::Point p2(cvRound(pt2.x), cvRound(pt2.y));
+
+    if ((unsigned) p1.x >= (unsigned) mask.cols || (unsigned) p2.x >= (unsigned) mask.cols ||
+        (unsigned) p1.y >= (unsigned) mask.rows || (unsigned) p2.y >= (unsigned) mask.rows) {
+        if (!cv::clipLine(mask.size(), p1, p2)) return 0;
+    }
+    if (p1.x > p2.x) std::swap(p1, p2);  //left to right
+
+    int dx = p2.x - p1.x;
+    int dy = p2.y - p1.y;
+    int step_y = dy < 0 ? -1 : 1;
+    dy = std::abs(dy);
+
+    bool steep = dy > dx;
+    int major = steep ? dy : dx;  //one pixel per major step, the minor axis moves when the error goes negative
+    int minor = steep ? dx : dy;
+    int err = major - 2 * minor;
+
+    int x = p1.x, y = p1.y;
+    int added = 0;
+    for (int k = 0; k <= major; ++k) {
+        if (k % step == 0) {
+            uchar &pixel = mask.at<uchar>(y, x);
+            if (pixel == 0) {
+                pixel = 1;
+                points.push_back(cv::Point(x, y));
+                ++added;
             }
+        }
 
+        if (err < 0) {
+            err += 2 * (major - minor);
+            x += 1;
+            y += step_y;
+        } else {
+            err -= 2 * minor;
+            if (steep) y += step_y;
+            else x += 1;
         }
     }
 
+    return added;
 };
 
 /*************** extract contour and the vertex normal for measurement model *******************/
-void ToolModel::Compute_Silhouette_UKF(const std::vector<std::vector<int> > &input_faces,
-                                   const std::vector<std::vector<int> > &neighbor_faces,
-                                   const cv::Mat &input_Vmat, const cv::Mat &input_Nmat,
-                                   cv::Mat &CamMat, cv::Mat &image, const cv::Mat &rvec, const cv::Mat &tvec,
-                                   const cv::Mat &P, std::vector<std::vector<double> > &vertices_vector, cv::OutputArray jac){
-
-    cv::Mat new_Vertices = transformPoints(input_Vmat, rvec, tvec);
-
-    new_Vertices = camTransformMats(CamMat, new_Vertices); //transform every point under camera frame
-
-    cv::Mat new_Normals = transformPoints(input_Nmat, rvec, tvec);
-    new_Normals = camTransformMats(CamMat, new_Normals); //transform every surface normal under camera frame
-
-    unsigned long neighbor_num = 0;
-    cv::Mat temp(4, 1, CV_64FC1);
-
-    cv::Mat ept_1(4, 1, CV_64FC1);
-    cv::Mat ept_2(4, 1, CV_64FC1);
-
-    for (int i = 0; i < input_faces.size(); ++i) {
-        neighbor_num = (neighbor_faces[i].size()) / 5;  //each neighbor has two vertices, used to be 3 when normals
-
-        if (neighbor_num > 0) {
-            int v1 = input_faces[i][0];
-            int v2 = input_faces[i][1];
-            int v3 = input_faces[i][2];
-            int n1 = input_faces[i][3];
-            int n2 = input_faces[i][4];
-            int n3 = input_faces[i][5];
-
-            new_Vertices.col(v1).copyTo(temp.col(0));
-            cv::Point3d pt1 = convert_MattoPts(temp);
-            new_Vertices.col(v2).copyTo(temp.col(0));
-            cv::Point3d pt2 = convert_MattoPts(temp);
-            new_Vertices.col(v3).copyTo(temp.col(0));
-            cv::Point3d pt3 = convert_MattoPts(temp);
-
-            new_Normals.col(n1).copyTo(temp.col(0));
-            cv::Point3d vn1 = convert_MattoPts(temp);
-            new_Normals.col(n2).copyTo(temp.col(0));
-            cv::Point3d vn2 = convert_MattoPts(temp);
-            new_Normals.col(n3).copyTo(temp.col(0));
-            cv::Point3d vn3 = convert_MattoPts(temp);
-
-            cv::Point3d fnormal = FindFaceNormal(pt1, pt2, pt3, vn1, vn2, vn3); //knowing the direction and normalized
-            cv::Point3d face_point_i = pt1 + pt2 + pt3;
-            face_point_i.x = face_point_i.x / 3;
-            face_point_i.y = face_point_i.y / 3;
-            face_point_i.z = face_point_i.z / 3;
-
-            double isfront_i = dotProduct(fnormal, face_point_i);
-            if(isfront_i < 0.000){ //first need to find the front facing face
-                for (int neighbor_count = 0; neighbor_count <
-                                             neighbor_num; ++neighbor_count) {  //notice: cannot use J here, since the last j will not be counted
-                    int j = 5 * neighbor_count;
-                    int v1_ = input_faces[neighbor_faces[i][j]][0];
-                    int v2_ = input_faces[neighbor_faces[i][j]][1];
-                    int v3_ = input_faces[neighbor_faces[i][j]][2];
-
-                    int n1_ = input_faces[neighbor_faces[i][j]][3];
-                    int n2_ = input_faces[neighbor_faces[i][j]][4];
-                    int n3_ = input_faces[neighbor_faces[i][j]][5];
-
-
-                    new_Vertices.col(v1_).copyTo(temp.col(0));
-                    cv::Point3d pt1_ = convert_MattoPts(temp);
-                    new_Vertices.col(v2_).copyTo(temp.col(0));
-                    cv::Point3d pt2_ = convert_MattoPts(temp);
-                    new_Vertices.col(v3_).copyTo(temp.col(0));
-                    cv::Point3d pt3_ = convert_MattoPts(temp);
-
-                    new_Normals.col(n1_).copyTo(temp.col(0));
-                    cv::Point3d vn1_ = convert_MattoPts(temp);
-                    new_Normals.col(n2_).copyTo(temp.col(0));
-                    cv::Point3d vn2_ = convert_MattoPts(temp);
-                    new_Normals.col(n3_).copyTo(temp.col(0));
-                    cv::Point3d vn3_ = convert_MattoPts(temp);
-
-                    cv::Point3d fnormal_n = FindFaceNormal(pt1_, pt2_, pt3_, vn1_, vn2_, vn3_);
-
-                    cv::Point3d face_point_j = pt1_ + pt2_ + pt3_;
-                    face_point_j.x = face_point_j.x / 3;
-                    face_point_j.y = face_point_j.y / 3;
-                    face_point_j.z = face_point_j.z / 3;
-
-                    double isfront_j = dotProduct(fnormal_n, face_point_j);
-
-                    if (isfront_i * isfront_j < 0.0) // one is front, another is back
-                    {   /*finish finding, drawing the image*/
-                        new_Vertices.col(neighbor_faces[i][j + 1]).copyTo(ept_1);  //under camera frames
-                        new_Vertices.col(neighbor_faces[i][j + 3]).copyTo(ept_2);
-
-                        cv::Point2d prjpt_1 = reproject(ept_1, P);
-                        cv::Point2d prjpt_2 = reproject(ept_2, P);
-
-                        if(prjpt_1.x <= 640 && prjpt_2.x <= 640 && prjpt_1.y >= 0 && prjpt_1.y <= 480 && prjpt_2.y >= 0 && prjpt_2.y <= 480){
-                           
-                            cv::line(image, prjpt_1, prjpt_2, cv::Scalar(255, 255, 255), 1, 8, 0);
-                            /**** get new vertex ****/
-                            cv::Point2d mid_vertex = prjpt_1 + prjpt_2;
-                            mid_vertex.x = mid_vertex.x / 2;
-                            mid_vertex.y = mid_vertex.y / 2;
-
-                            double delta_y = prjpt_2.y - prjpt_1.y;
-                            double delta_x = prjpt_2.x - prjpt_1.x;
-
-                            double k  = delta_y / delta_x;
-                            cv::Mat temp_normal(1,2,CV_64FC1);
-                            temp_normal.at<double>(0,0) = -1.0 * k;   //n_x
-                            temp_normal.at<double>(0,1) = 1.0 ;     //n_y
-
-                            cv::Mat Vnormal_1 = new_Normals.col(neighbor_faces[i][j + 2]).clone();
-                            cv::Mat Vnormal_2 = new_Normals.col(neighbor_faces[i][j + 4]).clone();
-
-                            cv::Mat mid_normal(1,2,CV_64FC1);
-                            mid_normal.at<double>(0,0) = 0.5 * (Vnormal_1.at<double>(0,0) + Vnormal_2.at<double>(0,0));
-                            mid_normal.at<double>(0,1) = 0.5 * (Vnormal_1.at<double>(1,0) + Vnormal_2.at<double>(1,0));
-
-                            double dot_normal = mid_normal.dot(temp_normal);
-                            if(dot_normal < 0.0){
-                                temp_normal = -1.0 * temp_normal;   //flip?
-                            }
-
-                            /**get measurement points for UKF**/
-                            std::vector<double> vertex_vector;
-                            vertex_vector.resize(4); // vertices, normals
-
-                            if(mid_vertex.x >= 10 && mid_vertex.x <=640 && mid_vertex.y >= 0 && mid_vertex.y <= 480){
-                                vertex_vector[0] = mid_vertex.x;
-                                vertex_vector[1] = mid_vertex.y;
-                                vertex_vector[2] = temp_normal.at<double>(0,0);
-                                vertex_vector[3] = temp_normal.at<double>(0,1);
-                                vertices_vector.push_back(vertex_vector);
-                            }
+/*** the unit vector of a sample normal (-k, 1), which is infinite along a vertical edge ***/
+static cv::Point2d unitNormal(double nx, double ny) {
 
-                        }
+    if (std::isinf(nx)) return cv::Point2d(nx > 0.0 ? 1.0 : -1.0, 0.0);
+    double length = sqrt(nx * nx + ny * ny);
+    if (!(length > 0.0)) return cv::Point2d(0.0, 0.0);
+    return cv::Point2d(nx / length, ny / length);
+}
 
-                    }
+void ToolModel::Compute_Silhouette_UKF(const toolMesh &mesh, cv::Mat &CamMat, cv::Mat &image, const cv::Mat &rvec,
+                                       const cv::Mat &tvec, const cv::Mat &P,
+                                       std::vector<std::vector<double> > &vertices_vector, cv::OutputArray jac){
+
+    size_t first_sample = vertices_vector.size();
+    cameraMesh camera_mesh;
+    transformMesh(mesh, CamMat, rvec, tvec, P, camera_mesh, true); //every point projected, every surface normal under camera frame
+    classifyFaces(mesh, camera_mesh);  //front or back, once per face
+    const cameraMesh &cam = camera_mesh;
+
+    for (int e = 0; e < mesh.numEdges(); ++e) {
+        const int *ends = silhouetteEnds(&mesh.edge_data[10 * e], cam.facing.data(), 1, true);
+        if (ends == NULL) continue;
+
+        /*finish finding, drawing the image*/
+        cv::Point2d prjpt_1 = cam.projected[ends[0]];
+        cv::Point2d prjpt_2 = cam.projected[ends[2]];
+
+        if(prjpt_1.x <= 640 && prjpt_2.x <= 640 && prjpt_1.y >= 0 && prjpt_1.y <= 480 && prjpt_2.y >= 0 && prjpt_2.y <= 480){
+           
+            cv::line(image, prjpt_1, prjpt_2, cv::Scalar(255, 255, 255), 1, 8, 0);
+            /**** get new vertex ****/
+            cv::Point2d mid_vertex = prjpt_1 + prjpt_2;
+            mid_vertex.x = mid_vertex.x / 2;
+            mid_vertex.y = mid_vertex.y / 2;
+
+            double delta_y = prjpt_2.y - prjpt_1.y;
+            double delta_x = prjpt_2.x - prjpt_1.x;
+
+            double k  = delta_y / delta_x;
+            cv::Mat temp_normal(1,2,CV_64FC1);
+            temp_normal.at<double>(0,0) = -1.0 * k;   //n_x
+            temp_normal.at<double>(0,1) = 1.0 ;     //n_y
+
+            int n1 = ends[1];
+            int n2 = ends[3];
+
+            cv::Mat mid_normal(1,2,CV_64FC1);
+            mid_normal.at<double>(0,0) = 0.5 * (cam.nx[n1] + cam.nx[n2]);
+            mid_normal.at<double>(0,1) = 0.5 * (cam.ny[n1] + cam.ny[n2]);
+
+            double dot_normal = mid_normal.dot(temp_normal);
+            if(dot_normal < 0.0){
+                temp_normal = -1.0 * temp_normal;   //flip?
+            }
+
+            /**get measurement points for UKF**/
+            std::vector<double> vertex_vector;
+            vertex_vector.resize(10); // vertices, normals, then the part frame ends for the Jacobian
+
+            if(mid_vertex.x >= 10 && mid_vertex.x <=640 && mid_vertex.y >= 0 && mid_vertex.y <= 480){
+                vertex_vector[0] = mid_vertex.x;
+                vertex_vector[1] = mid_vertex.y;
+                vertex_vector[2] = temp_normal.at<double>(0,0);
+                vertex_vector[3] = temp_normal.at<double>(0,1);
+                for (int k = 0; k < 2; ++k) {
+                    int v = ends[2 * k];
+                    vertex_vector[4 + 3 * k] = mesh.vx[v];
+                    vertex_vector[5 + 3 * k] = mesh.vy[v];
+                    vertex_vector[6 + 3 * k] = mesh.vz[v];
                 }
+                vertices_vector.push_back(vertex_vector);
             }
+
+        }
+    }
+
+    if (!jac.needed()) return;
+
+    /* the sample is the middle of the projected ends, its derivatives the mean of theirs; the normal is held fixed,
+     * and normalized as renderToolUKF gives it */
+    std::vector<cv::Point3d> points;
+    for (size_t i = first_sample; i < vertices_vector.size(); ++i) {
+        const std::vector<double> &sample = vertices_vector[i];
+        points.push_back(cv::Point3d(sample[4], sample[5], sample[6]));
+        points.push_back(cv::Point3d(sample[7], sample[8], sample[9]));
+    }
+    cv::Mat end_rows;
+    partJacobian(cameraProjection(CamMat, P), rvec, tvec, points, end_rows);
+
+    int num_samples = points.size() / 2;
+    jac.create(num_samples, 18, CV_64FC1);
+    cv::Mat rows = jac.getMat();
+    for (int i = 0; i < num_samples; ++i) {
+        const std::vector<double> &sample = vertices_vector[first_sample + i];
+        const double *end_1 = end_rows.ptr<double>(2 * i);
+        const double *end_2 = end_rows.ptr<double>(2 * i + 1);
+        double *row = rows.ptr<double>(i);
+        for (int c = 0; c < 12; ++c) {
+            row[c] = 0.5 * (end_1[c] + end_2[c]);
+        }
+        cv::Point2d normal = unitNormal(sample[2], sample[3]);
+        for (int c = 0; c < 6; ++c) {
+            row[12 + c] = normal.x * row[c] + normal.y * row[6 + c];
         }
     }
 };
@@ -578,53 +1992,106 @@ cv::Point3d ToolModel::convert_MattoPts(cv::Mat &input_Mat) { //should be a 4 by
 
 };
 
-void ToolModel::getFaceInfo(const std::vector<std::vector<int> > &input_faces,
-                            const std::vector<cv::Point3d> &input_vertices,
-                            const std::vector<cv::Point3d> &input_Vnormal, cv::Mat &face_normals,
-                            cv::Mat &face_centroids) {
+void ToolModel::getFaceInfo(toolMesh &mesh) {
 
-    int face_size = input_faces.size();
-    face_normals = cv::Mat(4, face_size, CV_64FC1);
-    face_centroids = cv::Mat(4, face_size, CV_64FC1);
+    int face_size = mesh.numFaces();
+    mesh.fnx.resize(face_size);
+    mesh.fny.resize(face_size);
+    mesh.fnz.resize(face_size);
+    mesh.fcx.resize(face_size);
+    mesh.fcy.resize(face_size);
+    mesh.fcz.resize(face_size);
 
     for (int i = 0; i < face_size; ++i) {
-        int v1 = input_faces[i][0];
-        int v2 = input_faces[i][1];
-        int v3 = input_faces[i][2];
-        int n1 = input_faces[i][3];
-        int n2 = input_faces[i][4];
-        int n3 = input_faces[i][5];
+        int v1 = mesh.face_v[3 * i];
+        int v2 = mesh.face_v[3 * i + 1];
+        int v3 = mesh.face_v[3 * i + 2];
+        int n1 = mesh.face_n[3 * i];
+        int n2 = mesh.face_n[3 * i + 1];
+        int n3 = mesh.face_n[3 * i + 2];
 
-        cv::Point3d pt1 = input_vertices[v1];
-        cv::Point3d pt2 = input_vertices[v2];
-        cv::Point3d pt3 = input_vertices[v3];
+        cv::Point3d pt1(mesh.vx[v1], mesh.vy[v1], mesh.vz[v1]);
+        cv::Point3d pt2(mesh.vx[v2], mesh.vy[v2], mesh.vz[v2]);
+        cv::Point3d pt3(mesh.vx[v3], mesh.vy[v3], mesh.vz[v3]);
 
-        cv::Point3d normal1 = input_Vnormal[n1];
-        cv::Point3d normal2 = input_Vnormal[n2];
-        cv::Point3d normal3 = input_Vnormal[n3];
+        cv::Point3d normal1(mesh.nx[n1], mesh.ny[n1], mesh.nz[n1]);
+        cv::Point3d normal2(mesh.nx[n2], mesh.ny[n2], mesh.nz[n2]);
+        cv::Point3d normal3(mesh.nx[n3], mesh.ny[n3], mesh.nz[n3]);
 
         cv::Point3d fnormal = FindFaceNormal(pt1, pt2, pt3, normal1, normal2,
                                              normal3); //knowing the direction and normalized
 
-        face_normals.at<double>(0, i) = fnormal.x;
-        face_normals.at<double>(1, i) = fnormal.y;
-        face_normals.at<double>(2, i) = fnormal.z;
-        face_normals.at<double>(3, i) = 0;
+        mesh.fnx[i] = fnormal.x;
+        mesh.fny[i] = fnormal.y;
+        mesh.fnz[i] = fnormal.z;
 
         cv::Point3d face_point = pt1 + pt2 + pt3;
 
         face_point.x = face_point.x / 3.000000;
         face_point.y = face_point.y / 3.000000;
         face_point.z = face_point.z / 3.000000;
-        face_point = Normalize(face_point);
 
-        face_centroids.at<double>(0, i) = face_point.x;
-        face_centroids.at<double>(1, i) = face_point.y;
-        face_centroids.at<double>(2, i) = face_point.z;
-        face_centroids.at<double>(3, i) = 1;
+        mesh.fcx[i] = face_point.x;
+        mesh.fcy[i] = face_point.y;
+        mesh.fcz[i] = face_point.z;
+
+    }
+
+};
+
+void ToolModel::fitCylinder(toolMesh &mesh) {
+
+    cylinderShape &cylinder = mesh.cylinder;
+    cylinder = cylinderShape();
+    if (mesh.numVertices() == 0) return;
+
+    getBoundingBox(mesh);
+    cylinder.center_x = (mesh.box_min.x + mesh.box_max.x) / 2;
+    cylinder.center_z = (mesh.box_min.z + mesh.box_max.z) / 2;
+    cylinder.y_min = mesh.box_min.y;
+    cylinder.y_max = mesh.box_max.y;
+
+    /* the rim vertices sit on the circumscribed circle, the end face centers on the axis */
+    std::vector<double> radius(mesh.numVertices());
+    for (int i = 0; i < mesh.numVertices(); ++i) {
+        double x = mesh.vx[i] - cylinder.center_x;
+        double z = mesh.vz[i] - cylinder.center_z;
+        radius[i] = std::sqrt(x * x + z * z);
+        cylinder.radius = std::max(cylinder.radius, radius[i]);
+    }
+
+    double tolerance = 0.01 * cylinder.radius;
+    for (int i = 0; i < mesh.numVertices(); ++i) {
+        if (radius[i] > tolerance && radius[i] < cylinder.radius - tolerance) {
+            ROS_WARN("the tool body is not a capped cylinder, analyticBody will use its mesh.");
+            return;
+        }
+    }
 
+    /* the mesh is a prism, aim between the circumscribed and inscribed circles of its end face polygon */
+    int sides = 0;
+    for (int i = 0; i < mesh.numVertices(); ++i) {
+        if (radius[i] > tolerance && mesh.vy[i] - cylinder.y_min < tolerance) ++sides;
     }
+    if (sides >= 3) {
+        cylinder.radius *= (1.0 + std::cos(CV_PI / sides)) / 2;
+    }
+    cylinder.valid = cylinder.radius > 0.0 && cylinder.y_max > cylinder.y_min;
+};
 
+void ToolModel::getBoundingBox(toolMesh &mesh) {
+
+    if (mesh.numVertices() == 0) return;
+
+    mesh.box_min = mesh.box_max = cv::Point3d(mesh.vx[0], mesh.vy[0], mesh.vz[0]);
+    for (int i = 1; i < mesh.numVertices(); ++i) {
+        mesh.box_min.x = std::min<double>(mesh.box_min.x, mesh.vx[i]);
+        mesh.box_min.y = std::min<double>(mesh.box_min.y, mesh.vy[i]);
+        mesh.box_min.z = std::min<double>(mesh.box_min.z, mesh.vz[i]);
+        mesh.box_max.x = std::max<double>(mesh.box_max.x, mesh.vx[i]);
+        mesh.box_max.y = std::max<double>(mesh.box_max.y, mesh.vy[i]);
+        mesh.box_max.z = std::max<double>(mesh.box_max.z, mesh.vz[i]);
+    }
 };
 
 cv::Point3d ToolModel::crossProduct(cv::Point3d &vec1, cv::Point3d &vec2) {    //3d vector
@@ -689,40 +2156,19 @@ cv::Point3d ToolModel::FindFaceNormal(cv::Point3d &input_v1, cv::Point3d &input_
 };
 
 
-int ToolModel::Compare_vertex(std::vector<int> &vec1, std::vector<int> &vec2, std::vector<int> &match_vec) {
+int ToolModel::Compare_vertex(const toolMesh &mesh, int face1, int face2, std::vector<int> &match_vec) {
     int match_count = 0;
-    if (vec1.size() != vec2.size())  ///face vectors
-    {
-        printf("Two vectors are not in the same size \n");
-    } else {
-        for (int j = 0; j < 3; ++j) {
-            if (vec1[0] == vec2[j]) {
-                match_count += 1;
-                match_vec.push_back(vec1[0]);   //vertex
-                match_vec.push_back(vec1[3]);  // corresponding vertex normal
-
-            }
-
-        }
-
-        for (int j = 0; j < 3; ++j) {
-            if (vec1[1] == vec2[j]) {
-                match_count += 1;
-                match_vec.push_back(vec1[1]);
-                match_vec.push_back(vec1[4]);  // corresponding vertex normal
-
-            }
-
-        }
+    const int *vec1 = &mesh.face_v[3 * face1];
+    const int *normal1 = &mesh.face_n[3 * face1];
+    const int *vec2 = &mesh.face_v[3 * face2];
 
+    for (int i = 0; i < 3; ++i) {
         for (int j = 0; j < 3; ++j) {
-            if (vec1[2] == vec2[j]) {
+            if (vec1[i] == vec2[j]) {
                 match_count += 1;
-                match_vec.push_back(vec1[2]);
-                match_vec.push_back(vec1[5]);  // corresponding vertex normal
-
+                match_vec.push_back(vec1[i]);   //vertex
+                match_vec.push_back(normal1[i]);  // corresponding vertex normal
             }
-
         }
     }
 
@@ -730,37 +2176,15 @@ int ToolModel::Compare_vertex(std::vector<int> &vec1, std::vector<int> &vec2, st
 };
 
 /*******This function is to do transformations to the raw data from the loader, to offset each part*******/
-void ToolModel::modify_model_(std::vector<glm::vec3> &input_vertices, std::vector<glm::vec3> &input_Vnormal,
-                              std::vector<cv::Point3d> &input_Vpts, std::vector<cv::Point3d> &input_Npts,
-                              double &offset, cv::Mat &input_Vmat, cv::Mat &input_Nmat) {
-
-    Convert_glTocv_pts(input_vertices, input_Vpts);
-    ConvertInchtoMeters(input_Vpts);
-
-    int size = input_Vpts.size();
-    // for (int i = 0; i < size; ++i) {
-    //     input_Vpts[i].y = input_Vpts[i].y - offset;
-    // }
-    Convert_glTocv_pts(input_Vnormal, input_Npts); //not using homogeneous for v weight now
-    ConvertInchtoMeters(input_Npts);
-
-    input_Vmat = cv::Mat(4, size, CV_64FC1);
-
-    for (int i = 0; i < size; ++i) {
-        input_Vmat.at<double>(0, i) = input_Vpts[i].x;
-        input_Vmat.at<double>(1, i) = input_Vpts[i].y;
-        input_Vmat.at<double>(2, i) = input_Vpts[i].z;
-        input_Vmat.at<double>(3, i) = 1;
-    }
-
-    int Nsize = input_Npts.size();
-    input_Nmat = cv::Mat(4, Nsize, CV_64FC1);
-
-    for (int i = 0; i < Nsize; ++i) {
-        input_Nmat.at<double>(0, i) = input_Npts[i].x;
-        input_Nmat.at<double>(1, i) = input_Npts[i].y;
-        input_Nmat.at<double>(2, i) = input_Npts[i].z;
-        input_Nmat.at<double>(3, i) = 0;
+void ToolModel::modify_model_(toolMesh &mesh) {
+
+    /* inches to meters, the normals keep the same scaling they always had */
+    std::vector<meshScalar> *arrays[6] = {&mesh.vx, &mesh.vy, &mesh.vz, &mesh.nx, &mesh.ny, &mesh.nz};
+    for (int a = 0; a < 6; ++a) {
+        std::vector<meshScalar> &array = *arrays[a];
+        for (int i = 0; i < array.size(); ++i) {
+            array[i] = array[i] * 0.0254;
+        }
     }
 
 };
@@ -925,43 +2349,382 @@ void ToolModel::computeInvSE(const cv::Mat &inputMat, cv::Mat &outputMat){
 
 }
 
+/*** rvec and tvec of one part of a pose, in the order of renderTool: cylinder, oval, gripper 1, gripper 2 ***/
+static void partPose(const ToolModel::toolModel &tool, int part, cv::Mat &rvec, cv::Mat &tvec) {
+
+    switch (part) {
+        case 0:
+            rvec = cv::Mat(tool.rvec_cyl);
+            tvec = cv::Mat(tool.tvec_cyl);
+            break;
+        case 1:
+            rvec = cv::Mat(tool.rvec_elp);
+            tvec = cv::Mat(tool.tvec_elp);
+            break;
+        case 2:
+            rvec = cv::Mat(tool.rvec_grip1);
+            tvec = cv::Mat(tool.tvec_grip1);
+            break;
+        default:
+            rvec = cv::Mat(tool.rvec_grip2);
+            tvec = cv::Mat(tool.tvec_grip2);
+            break;
+    }
+}
+
+/*************** the Jacobian of renderTool for the part frame points of one part: one row per point, d(u, v) / dq with
+ * q = (rvec_cyl, tvec_cyl, theta_ellipse, theta_grip_1, theta_grip_2). As in computeEllipsePose the oval turns with
+ * theta_ellipse about its z axis through tvec_elp, carrying the jaws, and the jaws turn about their x axis through
+ * tvec_grip1 by -(theta_grip_1 -+ theta_grip_2 / 2). Assumes the jaws open, theta_grip_2 > 0, past the clamp at 0 *******************/
+static void toolJacobian(const ToolModel::toolModel &tool, int part, const cv::Matx34d &M,
+                         const std::vector<cv::Point3d> &points, cv::Mat &jac) {
+
+    cv::Mat rvec, tvec;
+    partPose(tool, part, rvec, tvec);
+    cv::Matx33d R = rotationMatx(rvec);
+    cv::Point3d t(tvec.at<double>(0, 0), tvec.at<double>(1, 0), tvec.at<double>(2, 0));
+
+    cv::Matx33d dR_cyl[3];
+    cv::Matx33d R_cyl = rotationMatx(cv::Mat(tool.rvec_cyl), dR_cyl);
+    cv::Point3d t_cyl(tool.tvec_cyl(0), tool.tvec_cyl(1), tool.tvec_cyl(2));
+
+    cv::Matx33d R_elp = rotationMatx(cv::Mat(tool.rvec_elp));
+    cv::Point3d elp_axis(R_elp(0, 2), R_elp(1, 2), R_elp(2, 2));
+    cv::Point3d t_elp(tool.tvec_elp(0), tool.tvec_elp(1), tool.tvec_elp(2));
+    cv::Point3d jaw_axis(R(0, 0), R(1, 0), R(2, 0));
+
+    jac.create(points.size(), 18, CV_64FC1);
+    for (int i = 0; i < points.size(); ++i) {
+        cv::Point3d X = rotatePoint(R, points[i]) + t;
+        cv::Point3d du, dv;
+        imageDerivative(M, X, du, dv);
+
+        cv::Point3d dX[9];  //dX / dq, one column per parameter
+        cv::Point3d Y = rotatePoint(R_cyl.t(), X - t_cyl);
+        for (int k = 0; k < 3; ++k) {
+            dX[k] = rotatePoint(dR_cyl[k], Y);
+            dX[3 + k] = cv::Point3d(k == 0, k == 1, k == 2);
+        }
+        if (part >= 1) dX[6] = elp_axis.cross(X - t_elp);
+        if (part >= 2) {
+            cv::Point3d turn = jaw_axis.cross(X - t);
+            dX[7] = -turn;
+            dX[8] = turn * (part == 2 ? 0.5 : -0.5);
+        }
+
+        double *row = jac.ptr<double>(i);
+        for (int c = 0; c < 9; ++c) {
+            row[c] = du.dot(dX[c]);
+            row[9 + c] = dv.dot(dX[c]);
+        }
+    }
+}
+
 /****render a rectangle contains the tool model, TODO:*****/
 void
 ToolModel::renderTool(cv::Mat &image, const toolModel &tool, cv::Mat &CamMat, const cv::Mat &P, cv::OutputArray jac) {
 
     /** approach 1: using Vertices mat and normal mat **/
-    Compute_Silhouette(body_faces, body_neighbors, body_Vmat, body_Nmat, CamMat, image, cv::Mat(tool.rvec_cyl),
-                       cv::Mat(tool.tvec_cyl), P, jac);
+    const toolMesh *meshes[4] = {&body_mesh, &ellipse_mesh, &gripper1_mesh, &gripper2_mesh};
+    cv::Mat rvec, tvec;
+    if (!jac.needed()) {
+        for (int part = 0; part < 4; ++part) {
+            partPose(tool, part, rvec, tvec);
+            Compute_Silhouette(*meshes[part], CamMat, image, rvec, tvec, P);
+        }
+        return;
+    }
+
+    /* the same lines, with the part frame ends kept for the Jacobian */
+    cv::Matx34d M = cameraProjection(CamMat, P);
+    cv::Mat rows, part_rows;
+    for (int part = 0; part < 4; ++part) {
+        partPose(tool, part, rvec, tvec);
+        cameraMesh camera_mesh;
+        std::vector<cv::Point2d> silhouette_edges;
+        std::vector<cv::Point3d> edge_points;
+        Compute_Silhouette_Edges(*meshes[part], camera_mesh, CamMat, rvec, tvec, P, silhouette_edges, NULL,
+                                 &edge_points);
+        for (int i = 0; i + 1 < silhouette_edges.size(); i += 2) {
+            cv::line(image, silhouette_edges[i], silhouette_edges[i + 1], cv::Scalar(255, 255, 0), 1, 8, 0);
+        }
+        toolJacobian(tool, part, M, edge_points, part_rows);
+        if (!edge_points.empty()) rows.push_back(part_rows);
+    }
+    jac.create(rows.rows, 18, CV_64FC1);
+    if (!rows.empty()) rows.copyTo(jac);
+
+};
+
+/*** grow the image box [min, max] by the eight projected corners of one part box, false if one is behind the camera ***/
+static bool projectBox(const ToolModel::toolMesh &mesh, const cv::Matx34d &M, cv::Point2d &box_min,
+                       cv::Point2d &box_max) {
+
+    if (mesh.numVertices() == 0) return true;
+
+    for (int k = 0; k < 8; ++k) {
+        double x = (k & 1) ? mesh.box_max.x : mesh.box_min.x;
+        double y = (k & 2) ? mesh.box_max.y : mesh.box_min.y;
+        double z = (k & 4) ? mesh.box_max.z : mesh.box_min.z;
+
+        cv::Point2d corner;
+        if (!projectPoint(M, x, y, z, corner)) return false;
+
+        box_min.x = std::min(box_min.x, corner.x);
+        box_min.y = std::min(box_min.y, corner.y);
+        box_max.x = std::max(box_max.x, corner.x);
+        box_max.y = std::max(box_max.y, corner.y);
+    }
+    return true;
+}
+
+/*************** the projection of a convex box holds the projection of everything inside it, so the silhouette of the
+ * pose can not leave the projected part boxes *******************/
+cv::Rect ToolModel::projectedBoundingBox(const toolModel &tool, const cv::Mat &CamMat, const cv::Mat &P,
+                                         const cv::Size &image_size) {
+
+    cv::Rect image_rect(0, 0, image_size.width, image_size.height);
+    cv::Matx34d projection = projectionMatx(P);
+
+    cv::Point2d box_min(DBL_MAX, DBL_MAX);
+    cv::Point2d box_max(-DBL_MAX, -DBL_MAX);
+    bool in_front = projectBox(body_mesh, projection * poseTransform(CamMat, cv::Mat(tool.rvec_cyl), cv::Mat(tool.tvec_cyl)), box_min, box_max)
+                    && projectBox(ellipse_mesh, projection * poseTransform(CamMat, cv::Mat(tool.rvec_elp), cv::Mat(tool.tvec_elp)), box_min, box_max)
+                    && projectBox(gripper1_mesh, projection * poseTransform(CamMat, cv::Mat(tool.rvec_grip1), cv::Mat(tool.tvec_grip1)), box_min, box_max)
+                    && projectBox(gripper2_mesh, projection * poseTransform(CamMat, cv::Mat(tool.rvec_grip2), cv::Mat(tool.tvec_grip2)), box_min, box_max);
+
+    if (!in_front) return image_rect; //the perspective division flips the corners behind the camera, keep everything
+    if (box_min.x > box_max.x) return cv::Rect(); //no part loaded
+
+    /* a pixel more on every side for the rounding of the line end points; clamp before converting so the far away
+     * poses do not overflow an int */
+    double left = std::max(std::floor(box_min.x) - 1.0, -1.0);
+    double top = std::max(std::floor(box_min.y) - 1.0, -1.0);
+    double right = std::min(std::ceil(box_max.x) + 2.0, (double) image_size.width + 1.0);
+    double bottom = std::min(std::ceil(box_max.y) + 2.0, (double) image_size.height + 1.0);
+    if (right <= left || bottom <= top) return cv::Rect();
+
+    return cv::Rect((int) left, (int) top, (int) (right - left), (int) (bottom - top)) & image_rect;
+};
+
+void ToolModel::resetSilhouetteCaches(renderBuffer &buffer) {
+
+    for (int i = 0; i < buffer.silhouette_caches.size(); ++i) {
+        buffer.silhouette_caches[i].valid = false;
+    }
+};
+
+/*** render the four body parts into a list of silhouette pixels, for the sparse chamfer scoring ***/
+void ToolModel::renderToolPoints(renderBuffer &buffer, const toolModel &tool, cv::Mat &CamMat, const cv::Mat &P,
+                                 cv::OutputArray jac) {
+
+    buffer.points.clear();
+    buffer.tool_edges.clear();
+    if (jac.needed()) jac.create(0, 18, CV_64FC1);
+
+    /* off-image particles are rejected here, they score as an empty render */
+    buffer.roi = projectedBoundingBox(tool, CamMat, P, buffer.visited.size());
+    if (buffer.roi.area() == 0) return;
+
+    const toolMesh *meshes[4] = {&body_mesh, &ellipse_mesh, &gripper1_mesh, &gripper2_mesh};
+    cv::Matx34d M = cameraProjection(CamMat, P);
+    cv::Mat rvec, tvec;
+    cv::Mat rows, part_rows;
+    for (int part = 0; part < 4; ++part) {
+        partPose(tool, part, rvec, tvec);
+        if (!jac.needed()) {
+            Compute_Silhouette(*meshes[part], CamMat, buffer, rvec, tvec, P);
+        } else {
+            /* as Compute_Silhouette, keeping buffer.edge_points for the joint space rows only */
+            const toolMesh &mesh = *meshes[part];
+            buffer.edges.clear();
+            buffer.edge_points.clear();
+            silhouetteCache *cache = incrementalSilhouetteAngle > 0.0 ? &partCache(buffer.silhouette_caches, mesh) : NULL;
+            Compute_Silhouette_Edges(mesh, buffer.camera_mesh, CamMat, rvec, tvec, P, buffer.edges, cache,
+                                     &buffer.edge_points);
+            for (int i = 0; i + 1 < buffer.edges.size(); i += 2) {
+                rasterizeEdge(buffer.visited, buffer.edges[i], buffer.edges[i + 1], buffer.sample_step, buffer.points);
+            }
+            toolJacobian(tool, part, M, buffer.edge_points, part_rows);
+            if (!buffer.edge_points.empty()) rows.push_back(part_rows);
+        }
+        buffer.tool_edges.insert(buffer.tool_edges.end(), buffer.edges.begin(), buffer.edges.end());
+    }
+    if (!rows.empty()) rows.copyTo(jac);
+
+    /* only clear the pixels we touched, so the mask is ready for the next particle */
+    for (int i = 0; i < buffer.points.size(); ++i) {
+        buffer.visited.at<uchar>(buffer.points[i]) = 0;
+    }
+
+};
+
+/*************** renderToolPoints for many poses: each part is streamed once per block of poses, the block projected
+ * and classified together, then every shared edge tested for the whole block *******************/
+void ToolModel::renderToolBatch(const std::vector<toolModel> &tools, const std::vector<cv::Mat> &cams,
+                                const cv::Mat &P, renderBatch &outputs, const cv::Range &range, int level) {
+
+    cv::Range poses = (range == cv::Range::all()) ? cv::Range(0, (int) tools.size()) : range;
+    renderBuffer &buffer = outputs.buffer;
+
+    outputs.points.resize(poses.size());
+    outputs.rois.resize(poses.size());
+    outputs.tool_edges.resize(poses.size());
+    outputs.edges.resize(render_block);
+
+    /* off-image poses are rejected first, as in renderToolPoints, the others are rendered in blocks */
+    outputs.visible.clear();
+    for (int i = 0; i < poses.size(); ++i) {
+        int pose = poses.start + i;
+        outputs.points[i].clear();
+        outputs.tool_edges[i].clear();
+        outputs.rois[i] = projectedBoundingBox(tools[pose], cams[pose], P, buffer.visited.size());
+        if (outputs.rois[i].area() > 0) outputs.visible.push_back(i);
+    }
+
+    const toolMesh *meshes[4] = {&body_mesh, &ellipse_mesh, &gripper1_mesh, &gripper2_mesh};
+    cv::Matx34d projection = projectionMatx(P);
+    edgeRange edge_range = pyramidEdgeRange(level);
+    meshScalar m[12 * render_block];    //P * g_CT * [R | t] of the block, pose minor
+    meshScalar eye_x[render_block], eye_y[render_block], eye_z[render_block];
+    cv::Mat rvec, tvec;
+
+    int num_visible = outputs.visible.size();
+    for (int first = 0; first < num_visible; first += render_block) {
+        int block_size = std::min(render_block, num_visible - first);
+        for (int b = 0; b < block_size; ++b) {
+            outputs.edges[b].clear();
+        }
+
+        for (int part = 0; part < 4; ++part) {
+            const toolMesh &mesh = *meshes[part];
+            bool analytic = analyticBody && mesh.cylinder.valid;
+            silhouetteCache *cache = incrementalSilhouetteAngle > 0.0 ? &partCache(buffer.silhouette_caches, mesh) : NULL;
+            bool use_mesh[render_block];  //the poses neither the closed form nor the cache could draw
+            int record = -1;              //the last of them, its silhouette goes to the cache
+
+            for (int b = 0; b < render_block; ++b) {
+                if (b < block_size) {
+                    int pose = poses.start + outputs.visible[first + b];
+                    partPose(tools[pose], part, rvec, tvec);
+                    cv::Matx44d G = poseTransform(cams[pose], rvec, tvec);
+                    cv::Matx34d M = projection * G;
+                    cv::Point3d eye = cameraPosition(G);
+                    for (int k = 0; k < 12; ++k) m[k * render_block + b] = M.val[k];
+                    eye_x[b] = eye.x;
+                    eye_y[b] = eye.y;
+                    eye_z[b] = eye.z;
+
+                    use_mesh[b] = !(analytic && cylinderEdges(mesh.cylinder, G, projection, edge_range,
+                                                                  outputs.edges[b]));
+                    if (use_mesh[b] && cache != NULL) {
+                        use_mesh[b] = !incrementalEdges(mesh, G, projection, edge_range, incrementalSilhouetteAngle,
+                                                        *cache, outputs.edges[b]);
+                    }
+                    if (use_mesh[b] && mesh.numClusters() > 0) {  //cheaper per pose than a block over every face
+                        clusterEdges(mesh, G, projection, edge_range, buffer.camera_mesh, outputs.edges[b]);
+                        if (cache != NULL) {
+                            cache->valid = true;
+                            cache->eye = eye;
+                            cache->edges = buffer.camera_mesh.silhouette;
+                        }
+                        use_mesh[b] = false;
+                    }
+                    if (use_mesh[b]) record = b;
+                } else {  //a short last block repeats its last pose, the extra lanes are not read
+                    for (int k = 0; k < 12; ++k) m[k * render_block + b] = m[k * render_block + b - 1];
+                    eye_x[b] = eye_x[b - 1];
+                    eye_y[b] = eye_y[b - 1];
+                    eye_z[b] = eye_z[b - 1];
+                }
+            }
 
-    Compute_Silhouette(ellipse_faces, ellipse_neighbors, ellipse_Vmat, ellipse_Nmat, CamMat, image,
-                       cv::Mat(tool.rvec_elp), cv::Mat(tool.tvec_elp), P, jac);
+            if (record < 0) continue;
+            if (cache != NULL) {
+                cache->valid = true;
+                cache->eye = cv::Point3d(eye_x[record], eye_y[record], eye_z[record]);
+                cache->edges.clear();
+            }
 
-    Compute_Silhouette(griper1_faces, griper1_neighbors, gripper1_Vmat, gripper1_Nmat, CamMat, image,
-                       cv::Mat(tool.rvec_grip1), cv::Mat(tool.tvec_grip1), P, jac);
+            outputs.projected.resize(mesh.numVertices() * render_block);
+            outputs.facing.resize(mesh.numFaces() * render_block);
+            projectVerticesBlock(m, mesh.vx.data(), mesh.vy.data(), mesh.vz.data(), mesh.numVertices(),
+                                 outputs.projected.data());
+            classifyFacesBlock(mesh.fnx.data(), mesh.fny.data(), mesh.fnz.data(), mesh.fcx.data(), mesh.fcy.data(),
+                               mesh.fcz.data(), mesh.numFaces(), eye_x, eye_y, eye_z, outputs.facing.data());
+
+            for (int e = 0; e < mesh.numEdges(); ++e) {
+                const int *edge = &mesh.edge_data[10 * e];
+                for (int b = 0; b < block_size; ++b) {
+                    if (!use_mesh[b]) continue;
+                    const int *ends = silhouetteEnds(edge, outputs.facing.data() + b, render_block, false);
+                    if (ends == NULL) continue;
+                    if (b == record && cache != NULL) cache->edges.push_back(e);
+
+                    cv::Point2d prjpt_1 = outputs.projected[ends[0] * render_block + b];
+                    cv::Point2d prjpt_2 = outputs.projected[ends[2] * render_block + b];
+                    if (keepEdge(prjpt_1, prjpt_2, edge_range)) {
+                        outputs.edges[b].push_back(prjpt_1);
+                        outputs.edges[b].push_back(prjpt_2);
+                    }
+                }
+            }
+        }
 
-    Compute_Silhouette(griper2_faces, griper2_neighbors, gripper2_Vmat, gripper2_Nmat, CamMat, image,
-                       cv::Mat(tool.rvec_grip2), cv::Mat(tool.tvec_grip2), P, jac);
+        /* every pose has the edges of its four parts in the order of renderToolPoints, rasterize them through the
+         * shared mask and clear the touched pixels for the next pose */
+        for (int b = 0; b < block_size; ++b) {
+            std::vector<cv::Point> &points = outputs.points[outputs.visible[first + b]];
+            const std::vector<cv::Point2d> &edges = outputs.edges[b];
+            for (int i = 0; i + 1 < edges.size(); i += 2) {
+                rasterizeEdge(buffer.visited, edges[i], edges[i + 1], buffer.sample_step, points);
+            }
+            for (int i = 0; i < points.size(); ++i) {
+                buffer.visited.at<uchar>(points[i]) = 0;
+            }
+            outputs.tool_edges[outputs.visible[first + b]].swap(outputs.edges[b]);
+        }
+    }
 
 };
 
+/*** append the part index to the samples of Compute_Silhouette_UKF from first on, for the Jacobian ***/
+static void tagSamples(std::vector< std::vector<double> > &samples, size_t first, int part) {
+
+    for (size_t i = first; i < samples.size(); ++i) {
+        samples[i].push_back(part);
+    }
+}
+
+/*** the samples gatherNormals sees as the same: the image point and normal, whatever part frame ends they carry ***/
+static bool sameSample(const std::vector<double> &a, const std::vector<double> &b) {
+
+    return std::equal(a.begin(), a.begin() + 4, b.begin());
+}
+
 /*** difference: give tool_normals ***/
 void ToolModel::renderToolUKF(cv::Mat &image, const toolModel &tool, cv::Mat &CamMat, const cv::Mat &P,
                          cv::Mat &tool_points, cv::Mat &tool_normals, cv::OutputArray jac) {
 
     std::vector< std::vector<double> > tool_vertices_normals;
-    Compute_Silhouette_UKF(body_faces, body_neighbors, body_Vmat, body_Nmat, CamMat, image, cv::Mat(tool.rvec_cyl),
-                       cv::Mat(tool.tvec_cyl), P, tool_vertices_normals, jac);
+    Compute_Silhouette_UKF(body_mesh, CamMat, image, cv::Mat(tool.rvec_cyl), cv::Mat(tool.tvec_cyl), P,
+                           tool_vertices_normals);
+    tagSamples(tool_vertices_normals, 0, 0);
 
     std::vector< std::vector<double> > tool_oval_normals;
-    Compute_Silhouette_UKF(oval_normal_faces, oval_normal_neighbors, oval_normal_Vmat, oval_normal_Nmat, CamMat, image,
-                       cv::Mat(tool.rvec_elp), cv::Mat(tool.tvec_elp), P, tool_oval_normals, jac);
+    Compute_Silhouette_UKF(oval_normal_mesh, CamMat, image, cv::Mat(tool.rvec_elp), cv::Mat(tool.tvec_elp), P,
+                           tool_oval_normals);
+    tagSamples(tool_oval_normals, 0, 1);
 
     std::vector< std::vector<double> > tool_gripper_normals;
-    Compute_Silhouette_UKF(griper1_faces, griper1_neighbors, gripper1_Vmat, gripper1_Nmat, CamMat, image,
-                           cv::Mat(tool.rvec_grip1), cv::Mat(tool.tvec_grip1), P, tool_gripper_normals, jac);
+    Compute_Silhouette_UKF(gripper1_mesh, CamMat, image, cv::Mat(tool.rvec_grip1), cv::Mat(tool.tvec_grip1), P,
+                           tool_gripper_normals);
+    size_t gripper1_samples = tool_gripper_normals.size();
+    tagSamples(tool_gripper_normals, 0, 2);
 
-    Compute_Silhouette_UKF(griper2_faces, griper2_neighbors, gripper2_Vmat, gripper2_Nmat, CamMat, image,
-                           cv::Mat(tool.rvec_grip2), cv::Mat(tool.tvec_grip2), P, tool_gripper_normals, jac);
+    Compute_Silhouette_UKF(gripper2_mesh, CamMat, image, cv::Mat(tool.rvec_grip2), cv::Mat(tool.tvec_grip2), P,
+                           tool_gripper_normals);
+    tagSamples(tool_gripper_normals, gripper1_samples, 3);
 
     int point_size = tool_oval_normals.size();
     for (int i = 0; i < point_size; ++i) {
@@ -975,20 +2738,48 @@ void ToolModel::renderToolUKF(cv::Mat &image, const toolModel &tool, cv::Mat &Ca
         tool_oval_normals[i][3] = temp_normal.at<double>(0,1);
 
     }
-    gatherNormals(tool_vertices_normals, tool_oval_normals, tool_gripper_normals, tool_points, tool_normals);
+    if (!jac.needed()) {
+        gatherNormals(tool_vertices_normals, tool_oval_normals, tool_gripper_normals, tool_points, tool_normals);
+        return;
+    }
+
+    std::vector< std::vector<double> > samples;
+    gatherNormals(tool_vertices_normals, tool_oval_normals, tool_gripper_normals, tool_points, tool_normals,
+                  &samples);
+
+    /* the sample is the middle of the projected ends, dz the normalized normal along its derivatives */
+    cv::Matx34d M = cameraProjection(CamMat, P);
+    jac.create(samples.size(), 27, CV_64FC1);
+    cv::Mat rows = jac.getMat();
+    std::vector<cv::Point3d> points(2);
+    cv::Mat end_rows;
+    for (int i = 0; i < samples.size(); ++i) {
+        points[0] = cv::Point3d(samples[i][4], samples[i][5], samples[i][6]);
+        points[1] = cv::Point3d(samples[i][7], samples[i][8], samples[i][9]);
+        toolJacobian(tool, (int) samples[i][10], M, points, end_rows);
+
+        double *row = rows.ptr<double>(i);
+        for (int c = 0; c < 18; ++c) {
+            row[c] = 0.5 * (end_rows.at<double>(0, c) + end_rows.at<double>(1, c));
+        }
+        for (int c = 0; c < 9; ++c) {
+            row[18 + c] = tool_normals.at<double>(i, 0) * row[c] + tool_normals.at<double>(i, 1) * row[9 + c];
+        }
+    }
 
 };
 
-void ToolModel::gatherNormals(std::vector< std::vector<double> > &part1_normals, std::vector< std::vector<double> > &part2_normals, std::vector< std::vector<double> > &part3_normals, cv::Mat &tool_points, cv::Mat &tool_normals){
+void ToolModel::gatherNormals(std::vector< std::vector<double> > &part1_normals, std::vector< std::vector<double> > &part2_normals, std::vector< std::vector<double> > &part3_normals, cv::Mat &tool_points, cv::Mat &tool_normals,
+                              std::vector< std::vector<double> > *samples){
 
     std::sort(part1_normals.begin(), part1_normals.end());
-    part1_normals.erase(std::unique(part1_normals.begin(), part1_normals.end()), part1_normals.end());
+    part1_normals.erase(std::unique(part1_normals.begin(), part1_normals.end(), sameSample), part1_normals.end());
 
     std::sort(part2_normals.begin(), part2_normals.end());
-    part2_normals.erase(std::unique(part2_normals.begin(), part2_normals.end()), part2_normals.end());
+    part2_normals.erase(std::unique(part2_normals.begin(), part2_normals.end(), sameSample), part2_normals.end());
 
     std::sort(part3_normals.begin(), part3_normals.end());
-    part3_normals.erase(std::unique(part3_normals.begin(), part3_normals.end()), part3_normals.end());
+    part3_normals.erase(std::unique(part3_normals.begin(), part3_normals.end(), sameSample), part3_normals.end());
 
     int point_dim = part1_normals.size();
 
@@ -1042,90 +2833,485 @@ void ToolModel::gatherNormals(std::vector< std::vector<double> > &part1_normals,
         cv::normalize(tool_normals.row(i), temp);
         temp.copyTo(tool_normals.row(i));
     }
+
+    if (samples != NULL) *samples = temp_vec_normals;
 };
 
+/*** the blurred segmented image of the matching score, scaled to [0, 1], and the sum of its squares ***/
+static void blurSegmented(const cv::Mat &segmentedImage, cv::Mat &blurred, double &energy) {
+
+    cv::Mat segImageGrey;
+    segmentedImage.convertTo(segImageGrey, CV_32FC1, 1.0 / 255); //scaled before the blur, same thing
+    cv::GaussianBlur(segImageGrey, blurred, cv::Size(9,9),4,4);
+    energy = blurred.dot(blurred);
+}
+
 float ToolModel::calculateMatchingScore(cv::Mat &toolImage, const cv::Mat &segmentedImage) {
 
-    float matchingScore;
+    scoringContext context;
+    blurSegmented(segmentedImage, context.blurSEG, context.blur_energy);
+
+    return calculateMatchingScore(toolImage, context);
+}
+
+/*** CV_TM_CCORR_NORMED of two images of the same size, on the rendered pixels only: the tool image is zero elsewhere ***/
+float ToolModel::calculateMatchingScore(cv::Mat &toolImage, const scoringContext &context) {
+
+    if (context.blurSEG.empty()) {
+        ROS_WARN("the scoring context has no blurred image, set correlationScoring before preparing it.");
+        return 0.0;
+    }
+
+    cv::Mat toolImageGrey = toolImage; //grey scale of toolImage
+    if (toolImage.channels() == 3) {
+        cv::cvtColor(toolImage, toolImageGrey, CV_BGR2GRAY); //convert it to grey scale
+    }
 
-    /*** When ROI is an empty rec, the position of tool is simply just not match, return 0 matching score ***/
-    cv::Mat ROI_toolImage = toolImage.clone(); //(ROI); //crop tool image
-    cv::Mat segImageGrey = segmentedImage.clone(); //(ROI); //crop segmented image, notice the size of the segmented image
+    double correlation = 0.0, tool_energy = 0.0;
+    for (int k = 0; k < toolImageGrey.rows; ++k) {
+        const uchar *grey = toolImageGrey.ptr<uchar>(k);
+        const float *blur = context.blurSEG.ptr<float>(k);
+        for (int i = 0; i < toolImageGrey.cols; ++i) {
+            if (grey[i] == 0) continue;
+            correlation += grey[i] * blur[i];
+            tool_energy += grey[i] * grey[i];
+        }
+    }
 
-    segImageGrey.convertTo(segImageGrey, CV_32FC1);
-    cv::Mat segImgBlur;
-    cv::GaussianBlur(segImageGrey,segImgBlur, cv::Size(9,9),4,4);
-    segImgBlur /= 255; //scale the blurred image
+    double norm = sqrt(tool_energy * context.blur_energy);
+    return norm > 0.0 ? (float) (correlation / norm) : 0.0f;
+};
 
-    cv::Mat toolImageGrey; //grey scale of toolImage since tool image has 3 channels
-    cv::Mat toolImFloat; //Float data type of grey scale tool image
+float ToolModel::calculateMatchingScore(const std::vector<cv::Point> &points, int sample_step,
+                                        const scoringContext &context) {
 
-    cv::cvtColor(ROI_toolImage, toolImageGrey, CV_BGR2GRAY); //convert it to grey scale
+    if (context.blurSEG.empty()) {
+        ROS_WARN("the scoring context has no blurred image, set correlationScoring before preparing it.");
+        return 0.0;
+    }
 
-    toolImageGrey.convertTo(toolImFloat, CV_32FC1); // convert grey scale to float
-    cv::Mat result(1, 1, CV_32FC1);
+    double correlation = 0.0;
+    for (int i = 0; i < points.size(); ++i) {
+        correlation += context.blurSEG.at<float>(points[i]);
+    }
 
-    cv::matchTemplate(segImgBlur, toolImFloat, result, CV_TM_CCORR_NORMED); //seg, toolImg
-    matchingScore = static_cast<float> (result.at<float>(0));
+    /* every kept pixel stands for sample_step of them along the edge, in the correlation and in the tool energy */
+    double norm = sqrt(points.size() * context.blur_energy / sample_step);
+    return norm > 0.0 ? (float) (correlation / norm) : 0.0f;
+};
 
-    return matchingScore;
+/*** the lines of orientation channel q run along its major axis, x when the channel is closer to horizontal, y
+ * otherwise; slope is their minor step per major step, in [-1, 1] ***/
+static bool channelAxis(int q, int channels, double &slope) {
+    double theta = q * CV_PI / channels;
+    double c = cos(theta), s = sin(theta);
+    bool x_major = std::abs(c) >= std::abs(s);
+    slope = x_major ? s / c : c / s;
+    return x_major;
 }
 
-/*** chamfer matching algorithm, using distance transform, generate measurement model for PF ***/
-float ToolModel::calculateChamferScore(cv::Mat &toolImage, const cv::Mat &segmentedImage) {
+/*** minor offset between major coordinates k - 1 and k of a channel line; a line through a pixel of major coordinate
+ * a reaches, at major coordinate k, the minor coordinate moved by round(k * slope) - round(a * slope) ***/
+static inline int traceOffset(double slope, int k) {
+    return cvRound(k * slope) - cvRound((k - 1) * slope);
+}
+
+/*************** directional chamfer context: the segmented edges split into orientation channels, each with its own
+ * distance transform, then the orientation mismatch added across channels (a distance along the orientation axis,
+ * weight pixels per radian, wrapping around at pi) and the result truncated and scaled like normDIST. Each channel is
+ * summed along its own direction, stored major axis first (x-major channels transposed), so that row r adds row r - 1
+ * shifted by the channel line, and any run of a channel line is the difference of two entries *******************/
+static void directionalDistances(const cv::Mat &edges, int channels, double weight, double truncation, double scale,
+                                 std::vector<cv::Mat> &integrals) {
+
+    /* edge orientations from the structure tensor of the edge map: the gradients on the two sides of a thin edge
+     * point opposite ways, their outer products agree */
+    cv::Mat edge_map, gx, gy;
+    edges.convertTo(edge_map, CV_32FC1, 1.0 / 255);
+    cv::Sobel(edge_map, gx, CV_32F, 1, 0, 3);
+    cv::Sobel(edge_map, gy, CV_32F, 0, 1, 3);
+    cv::Mat jxx = gx.mul(gx), jyy = gy.mul(gy), jxy = gx.mul(gy);
+    cv::GaussianBlur(jxx, jxx, cv::Size(5, 5), 1.0);
+    cv::GaussianBlur(jyy, jyy, cv::Size(5, 5), 1.0);
+    cv::GaussianBlur(jxy, jxy, cv::Size(5, 5), 1.0);
+
+    std::vector<cv::Mat> channel_edges(channels);
+    for (int q = 0; q < channels; ++q) {
+        channel_edges[q] = cv::Mat(edges.size(), CV_8UC1, cv::Scalar(255));
+    }
+    for (int y = 0; y < edges.rows; ++y) {
+        const uchar *edge = edges.ptr<uchar>(y);
+        for (int x = 0; x < edges.cols; ++x) {
+            if (edge[x] == 0) continue;
+            double normal = 0.5 * atan2(2.0 * jxy.at<float>(y, x), jxx.at<float>(y, x) - jyy.at<float>(y, x));
+            double line = normal + CV_PI / 2;    //in [0, pi], both ends go to channel 0
+            int q = cvRound(line * channels / CV_PI) % channels;
+            channel_edges[q].at<uchar>(y, x) = 0;
+        }
+    }
+
+    integrals.resize(channels);
+    for (int q = 0; q < channels; ++q) {
+        cv::distanceTransform(channel_edges[q], integrals[q], CV_DIST_L2, 3);
+    }
+
+    /* min over the channels of their distance plus the orientation step, two rounds each way cover the circle */
+    float step_cost = (float) (weight * CV_PI / channels);
+    for (int k = 1; k < 2 * channels; ++k) {
+        cv::Mat &cur = integrals[k % channels];
+        cv::min(cur, integrals[(k - 1) % channels] + step_cost, cur);
+    }
+    for (int k = 2 * channels - 2; k >= 0; --k) {
+        cv::Mat &cur = integrals[k % channels];
+        cv::min(cur, integrals[(k + 1) % channels] + step_cost, cur);
+    }
+
+    for (int q = 0; q < channels; ++q) {
+        cv::Mat dist = cv::min(integrals[q], truncation);
+        double slope;
+        if (channelAxis(q, channels, slope)) {
+            cv::transpose(dist, integrals[q]);
+        } else {
+            integrals[q] = dist;
+        }
+        integrals[q] *= scale;
+
+        cv::Mat &sum = integrals[q];
+        for (int r = 1; r < sum.rows; ++r) {
+            int offset = traceOffset(slope, r);
+            const float *prev = sum.ptr<float>(r - 1);
+            float *row = sum.ptr<float>(r);
+            int begin = std::max(0, offset), end = std::min(sum.cols, sum.cols + offset);
+            for (int c = begin; c < end; ++c) {
+                row[c] += prev[c - offset];
+            }
+        }
+    }
+}
+
+/*** build the distance transform of the segmented image once per frame, shared by all the particles ***/
+void ToolModel::prepareScoringContext(const cv::Mat &segmentedImage, scoringContext &context, bool directional) {
+
+    cv::Mat segImgGrey; //CV_8UC1
+    segmentedImage.convertTo(segImgGrey, CV_8UC1);
+
+    /***segmented image process, edges become the zero pixels of the distance transform**/
+    cv::Mat segImgInv = 255 - segImgGrey;
+
+    cv::Mat distance_img;
+    cv::distanceTransform(segImgInv, distance_img, CV_DIST_L2, 3);
+    if (!quantizedDistance) {
+        cv::normalize(distance_img, context.normDIST, 0.00, 1.00, cv::NORM_MINMAX);
+        context.distance_scale = 1.0;
+    } else {
+        /* the levels of [0, truncation] rounded, the farther pixels saturated; 8 bits when half a level is within
+         * the tolerance */
+        double min_distance, max_distance;
+        cv::minMaxLoc(distance_img, &min_distance, &max_distance);
+        double range = max_distance - min_distance;
+        double truncation = distanceTruncation > 0.0 ? std::min(distanceTruncation, range) : range;
+        bool bytes = truncation / 255 / 2 <= distanceTolerance;
+        double levels = bytes ? 255.0 : 65535.0;
+        double alpha = truncation > 0.0 ? levels / truncation : 0.0;
+        distance_img.convertTo(context.normDIST, bytes ? CV_8UC1 : CV_16UC1, alpha, -min_distance * alpha);
+        context.distance_scale = range > 0.0 ? truncation / levels / range : 0.0;
+    }
+
+    if (correlationScoring) {
+        blurSegmented(segmentedImage, context.blurSEG, context.blur_energy);
+    } else {
+        context.blurSEG.release();
+    }
+
+    if (directional && directionalChannels > 0) {
+        double min_distance, max_distance;
+        cv::minMaxLoc(distance_img, &min_distance, &max_distance);
+        double scale = max_distance > min_distance ? 1.0 / (max_distance - min_distance) : 0.0;
+        directionalDistances(segImgGrey, directionalChannels, directionalWeight, directionalTruncation, scale,
+                             context.directionalDIST);
+    } else {
+        context.directionalDIST.clear();
+    }
+
+};
+
+/*** sum of the distance levels times the grey levels of the rendered pixels, whatever the storage of the map ***/
+template<typename T>
+static double greyDistanceSum(const cv::Mat &toolImageGrey, const cv::Mat &distance, int &non_zero) {
+
+    double sum = 0.0;
+    for (int k = 0; k < toolImageGrey.rows; ++k) {
+        const uchar *grey = toolImageGrey.ptr<uchar>(k);
+        const T *dist = distance.ptr<T>(k);
+        for (int i = 0; i < toolImageGrey.cols; ++i) {
+            if (grey[i] == 0) continue;
+            ++non_zero;
+            sum += dist[i] * grey[i];
+        }
+    }
+    return sum;
+}
+
+/*** sum of the distance levels at the silhouette pixels from first on ***/
+template<typename T>
+static double pointDistanceSum(const std::vector<cv::Point> &points, int first, const cv::Mat &distance) {
+
+    double sum = 0.0;
+    for (int i = first; i < points.size(); ++i) {
+        sum += distance.at<T>(points[i]);
+    }
+    return sum;
+}
+
+static double pointDistanceSum(const std::vector<cv::Point> &points, int first,
+                               const ToolModel::scoringContext &context) {
+
+    switch (context.normDIST.depth()) {
+        case CV_8U:
+            return pointDistanceSum<uchar>(points, first, context.normDIST);
+        case CV_16U:
+            return pointDistanceSum<ushort>(points, first, context.normDIST);
+        default:
+            return pointDistanceSum<float>(points, first, context.normDIST);
+    }
+}
+
+/*** the sparse chamfer score of a distance sum gathered over that many silhouette pixels ***/
+static float sparseChamferScore(double dist_sum, size_t pixels, int sample_step,
+                                const ToolModel::scoringContext &context) {
 
     float output = 0;
-    cv::Mat ROI_toolImage = toolImage.clone(); //CV_8UC3
-    cv::Mat segImgGrey = segmentedImage.clone(); //CV_8UC1
 
-    segImgGrey.convertTo(segImgGrey, CV_8UC1);
+    /* same scale as the dense path: every rendered pixel has the grey value of the render color there */
+    double point_weight = silhouette_grey * sample_step;
+
+    if (pixels * sample_step < 200) {
+        output = 1000; //avoid empty image
+    } else {
+        output = dist_sum * context.distance_scale * point_weight;
+    }
+
+    output = exp(-1 * output/80);
+
+    return output;
+}
+
+/*** chamfer matching algorithm, using distance transform, generate measurement model for PF ***/
+float ToolModel::calculateChamferScore(cv::Mat &toolImage, const scoringContext &context) {
 
-    /***tool image process**/
-    cv::Mat toolImageGrey(ROI_toolImage.size(), CV_8UC1); //grey scale of toolImage since tool image has 3 channels
-    cv::Mat toolImFloat(ROI_toolImage.size(), CV_32FC1); //Float data type of grey scale tool image
-    cv::cvtColor(ROI_toolImage, toolImageGrey, CV_BGR2GRAY); //convert it to grey scale
+    float output = 0;
 
-    toolImageGrey.convertTo(toolImFloat, CV_32FC1); // get float img
+    /***tool image process, single channel renders are used as they are**/
+    cv::Mat toolImageGrey = toolImage; //grey scale of toolImage
+    if (toolImage.channels() == 3) {
+        cv::cvtColor(toolImage, toolImageGrey, CV_BGR2GRAY); //convert it to grey scale
+    }
 
-    cv::Mat BinaryImg(toolImFloat.size(), toolImFloat.type());
-    BinaryImg = toolImFloat * (1.0/255);
+    /***multiplication process, on the fly: the distance transform times the grey level scaled to [0, 1]**/
+    int non_zero = 0;
+    double dist_sum;
+    switch (context.normDIST.depth()) {
+        case CV_8U:
+            dist_sum = greyDistanceSum<uchar>(toolImageGrey, context.normDIST, non_zero);
+            break;
+        case CV_16U:
+            dist_sum = greyDistanceSum<ushort>(toolImageGrey, context.normDIST, non_zero);
+            break;
+        default:
+            dist_sum = greyDistanceSum<float>(toolImageGrey, context.normDIST, non_zero);
+    }
+    output = dist_sum * context.distance_scale / 255;
 
-    if(countNonZero(BinaryImg) < 200){
+    if(non_zero < 200){
         output = 1000; //avoid empty image
-    } else{
-        /***segmented image process**/
-        for (int i = 0; i < segImgGrey.rows; i++) {
-            for (int j = 0; j < segImgGrey.cols; j++) {
-                segImgGrey.at<uchar>(i,j) = 255 - segImgGrey.at<uchar>(i,j);
+    }
+
+    //ROS_INFO_STREAM("OUTPUT: " << output);
+    output = exp(-1 * output/80);
+
+    return output;
+
+};
+
+/*** sparse chamfer matching: gather the distance transform at the silhouette pixels instead of multiplying full images ***/
+float ToolModel::calculateChamferScore(const renderBuffer &buffer, const scoringContext &context) {
+
+    return calculateChamferScore(buffer.points, buffer.sample_step, context);
+};
+
+float ToolModel::calculateChamferScore(const std::vector<cv::Point> &points, int sample_step,
+                                       const scoringContext &context) {
+
+    double dist_sum = points.size() * sample_step < 200 ? 0.0 : pointDistanceSum(points, 0, context);
+    return sparseChamferScore(dist_sum, points.size(), sample_step, context);
+};
 
+/*************** the sparse chamfer of both cameras with early termination: after every part of either camera, the
+ * scores of the distances gathered so far are upper bounds of the final ones (an empty render scores lower still),
+ * and a camera that rendered nothing yet can score 1 at most *******************/
+double ToolModel::scoreToolPoints(renderBuffer &buffer_left, renderBuffer &buffer_right, const toolModel &tool,
+                                  cv::Mat &Cam_left, const cv::Mat &P_left, const scoringContext &context_left,
+                                  cv::Mat &Cam_right, const cv::Mat &P_right, const scoringContext &context_right,
+                                  double min_score, bool &aborted) {
+
+    renderBuffer *buffers[2] = {&buffer_left, &buffer_right};
+    cv::Mat *cams[2] = {&Cam_left, &Cam_right};
+    const cv::Mat *projections[2] = {&P_left, &P_right};
+    const scoringContext *contexts[2] = {&context_left, &context_right};
+
+    aborted = false;
+    bool visible[2];
+    double dist_sums[2] = {0.0, 0.0};
+    double scores[2];
+    for (int c = 0; c < 2; ++c) {
+        renderBuffer &buffer = *buffers[c];
+        buffer.points.clear();
+        buffer.tool_edges.clear();
+        buffer.roi = projectedBoundingBox(tool, *cams[c], *projections[c], buffer.visited.size());
+        visible[c] = buffer.roi.area() > 0;
+        scores[c] = visible[c] ? 1.0 : sparseChamferScore(0.0, 0, buffer.sample_step, *contexts[c]);
+    }
+
+    /* the shaft first, it has the longest silhouette and tells the most about the pose */
+    const toolMesh *meshes[4] = {&body_mesh, &ellipse_mesh, &gripper1_mesh, &gripper2_mesh};
+    cv::Mat rvec, tvec;
+    for (int part = 0; part < 4 && !aborted; ++part) {
+        partPose(tool, part, rvec, tvec);
+        for (int c = 0; c < 2; ++c) {
+            if (!visible[c]) continue;
+            renderBuffer &buffer = *buffers[c];
+            int first = buffer.points.size();
+            Compute_Silhouette(*meshes[part], *cams[c], buffer, rvec, tvec, *projections[c]);
+            buffer.tool_edges.insert(buffer.tool_edges.end(), buffer.edges.begin(), buffer.edges.end());
+            dist_sums[c] += pointDistanceSum(buffer.points, first, *contexts[c]);
+
+            scores[c] = sparseChamferScore(dist_sums[c], std::max<size_t>(buffer.points.size(), 200),
+                                           buffer.sample_step, *contexts[c]);
+            bool last = part == 3 && (c == 1 || !visible[1]);
+            if (!last && pow(scores[0], 2) + pow(scores[1], 2) < pow(min_score, 2)) {
+                aborted = true;
+                break;
             }
         }
+    }
+
+    for (int c = 0; c < 2; ++c) {
+        renderBuffer &buffer = *buffers[c];
+        if (!aborted && visible[c]) {
+            scores[c] = sparseChamferScore(dist_sums[c], buffer.points.size(), buffer.sample_step, *contexts[c]);
+        }
+        for (int i = 0; i < buffer.points.size(); ++i) {
+            buffer.visited.at<uchar>(buffer.points[i]) = 0;
+        }
+    }
 
-        cv::Mat normDIST;
-        cv::Mat distance_img;
-        cv::distanceTransform(segImgGrey, distance_img, CV_DIST_L2, 3);
-        cv::normalize(distance_img, normDIST, 0.00, 1.00, cv::NORM_MINMAX);
+    return sqrt(pow(scores[0], 2) + pow(scores[1], 2));
+};
 
-//    cv::imshow("segImgGrey img", segImgGrey);
-//    cv::imshow("Normalized img", normDIST);
-////    cv::imshow("distance_img", distance_img);
-//    cv::waitKey();
+float ToolModel::calculateChamferScore(cv::Mat &toolImage, const cv::Mat &segmentedImage) {
 
-        /***multiplication process**/
-        cv::Mat resultImg; //initialize
-        cv::multiply(normDIST, BinaryImg, resultImg);
+    scoringContext context;
+    prepareScoringContext(segmentedImage, context);
 
-        for (int k = 0; k < resultImg.rows; ++k) {
-            for (int i = 0; i < resultImg.cols; ++i) {
+    return calculateChamferScore(toolImage, context);
+};
 
-                double mul = resultImg.at<float>(k,i);
-                if(mul > 0.0)
-                    output += mul;
-            }
+/*** clip the segment a-b to [0, width] x [0, height], false when it misses the box ***/
+static bool clipSegment(cv::Point2d &a, cv::Point2d &b, double width, double height) {
+
+    double t0 = 0.0, t1 = 1.0;
+    double d[2] = {b.x - a.x, b.y - a.y};
+    double p[2] = {a.x, a.y};
+    double hi[2] = {width, height};
+    for (int k = 0; k < 2; ++k) {
+        if (d[k] == 0.0) {
+            if (p[k] < 0.0 || p[k] > hi[k]) return false;
+            continue;
         }
+        double ta = -p[k] / d[k], tb = (hi[k] - p[k]) / d[k];
+        if (ta > tb) std::swap(ta, tb);
+        t0 = std::max(t0, ta);
+        t1 = std::min(t1, tb);
+    }
+    if (t0 > t1) return false;
+
+    cv::Point2d start = a;
+    a = cv::Point2d(start.x + t0 * d[0], start.y + t0 * d[1]);
+    b = cv::Point2d(start.x + t1 * d[0], start.y + t1 * d[1]);
+    return true;
+}
+
+/*************** directional chamfer cost of one edge: the edge is cut into pieces that stay within a pixel of a
+ * line of its channel, each piece one difference of the channel integral. An edge along the channel direction is a
+ * single lookup *******************/
+static double directionalEdgeCost(const std::vector<cv::Mat> &integrals, cv::Point2d a, cv::Point2d b,
+                                  int &pixels) {
+
+    /* the channel of the edge orientation, in [0, pi) like the segmented edges */
+    int channels = integrals.size();
+    double angle = atan2(b.y - a.y, b.x - a.x);
+    if (angle < 0.0) angle += CV_PI;
+    int q = cvRound(angle * channels / CV_PI) % channels;
+    double slope;
+    bool x_major = channelAxis(q, channels, slope);
+    const cv::Mat &sum = integrals[q];
+
+    /* to the (major, minor) coordinates of the integral, major increasing */
+    if (!x_major) {
+        std::swap(a.x, a.y);
+        std::swap(b.x, b.y);
+    }
+    int majors = sum.rows, minors = sum.cols;
+    if (!clipSegment(a, b, majors - 1, minors - 1)) return 0.0;
+    if (a.x > b.x) std::swap(a, b);
+
+    int first = cvRound(a.x), last = cvRound(b.x);
+    double edge_slope = b.x - a.x > 1e-9 ? (b.y - a.y) / (b.x - a.x) : 0.0;
+    double drift = std::abs(edge_slope - slope);    //pixels off the channel line per major step
+    int piece = drift > 1.0 ? 1 : (int) std::min(1.0 / std::max(drift, 1e-9), (double) (last - first + 1));
+
+    double cost = 0.0;
+    for (int r = first; r <= last; ) {
+        int n = std::min(piece, last - r + 1);
+        int c = std::min(std::max(cvRound(a.y + (r - a.x) * edge_slope), 0), minors - 1);
+        int c_end = c + cvRound((r + n - 1) * slope) - cvRound(r * slope);
+        while (n > 1 && (c_end < 0 || c_end >= minors)) {    //the channel line leaves the image before the edge
+            --n;
+            c_end = c + cvRound((r + n - 1) * slope) - cvRound(r * slope);
+        }
+
+        cost += sum.at<float>(r + n - 1, c_end);
+        int c_prev = c - traceOffset(slope, r);
+        if (r > 0 && c_prev >= 0 && c_prev < minors) cost -= sum.at<float>(r - 1, c_prev);
+        pixels += n;
+        r += n;
+    }
+
+    return cost;
+}
+
+/*** directional chamfer matching, on the silhouette edges instead of their pixels ***/
+float ToolModel::calculateDirectionalScore(const std::vector<cv::Point2d> &edges, const scoringContext &context) {
+
+    float output = 0;
+
+    if (context.directionalDIST.empty()) {
+        ROS_WARN("the scoring context has no orientation channels, set directionalChannels before preparing it.");
+        return 0.0;
+    }
+
+    double cost = 0.0;
+    int pixels = 0;
+    for (int i = 0; i + 1 < edges.size(); i += 2) {
+        cost += directionalEdgeCost(context.directionalDIST, edges[i], edges[i + 1], pixels);
+    }
+
+    if (pixels < 200) {
+        output = 1000; //avoid empty image
+    } else {
+        output = cost * silhouette_grey;
     }
 
-    //ROS_INFO_STREAM("OUTPUT: " << output);
     output = exp(-1 * output/80);
 
     return output;
@@ -39,6 +39,7 @@
 #define PARTICLEFILTER_H
 
 #include <vector>
+#include <algorithm>
 #include <stdio.h>
 #include <iostream>
 
@@ -81,14 +82,70 @@ private:
     unsigned int numParticles; //total number of particles
 
 /**
- * @brief left and right rendered Images for ARM 1, used for calculating matching score
+ * @brief KLD-sampling: with adaptiveParticles, the particle count of the next frame is the one keeping the
+ * resampled set within kldError (Kullback-Leibler divergence) of the posterior, with the probability whose upper
+ * standard normal quantile is kldQuantile (2.326 for 99%). It follows the number of histogram bins of kldBinSize
+ * (radians, meters for the insertion) the set occupies over the four joints placing the tool. A steady tool collapses into a few bins
+ * and a fast or uncertain one spreads over many; the count stays within [minParticles, maxParticles] and is logged
+ * every frame. Read from the adaptive_particles, min_particles, max_particles, kld_error, kld_quantile and
+ * kld_bin_size parameters
  */
-    cv::Mat toolImage_left_arm_1;
-    cv::Mat toolImage_right_arm_1;
+    bool adaptiveParticles;
+    unsigned int minParticles;
+    unsigned int maxParticles;
+    double kldError;
+    double kldQuantile;
+    double kldBinSize;
+
+/**
+ * @brief silhouette pixels of the left and right renderings for ARM 1, used for calculating matching score.
+ * One batch per scoring thread, so the particles can be evaluated in parallel
+ */
+    std::vector<ToolModel::renderBatch> renderBatches_arm_1;
+
+/**
+ * @brief evaluate the particles with cv::parallel_for_, and the number of threads (and render buffers) to use.
+ * The scores do not depend on the number of threads, except with ToolModel::incrementalSilhouetteAngle > 0: each
+ * stripe of particles then follows the silhouette from one particle to the next, and where a stripe starts depends on
+ * the number of threads
+ */
+    bool parallelScoring;
+    int numScoringThreads;
+
+/**
+ * @brief coarse-to-fine scoring: every particle is scored first against the segmented images downsampled
+ * pyramidLevels times (each level halves both sides, with a projection scaled to match), then only the best
+ * pyramidFraction of them again at full resolution; the others keep their coarse score, rescaled below the lowest
+ * full resolution one. 0 levels scores every particle at full resolution. With pyramidCheck, every frame also scores
+ * all the particles at full resolution and logs the speedup and how far the best particle moved, to tune both on
+ * recorded sequences. Read from the pyramid_levels, pyramid_fraction and pyramid_check parameters
+ */
+    int pyramidLevels;
+    double pyramidFraction;
+    bool pyramidCheck;
+    std::vector<ToolModel::renderBatch> coarseBatches_arm_1;
+
+/**
+ * @brief early termination of the full resolution scoring: a particle stops being rendered, part by part from the
+ * shaft with the two cameras in turn (see ToolModel::scoreToolPoints), once its combined score cannot reach
+ * abortRatio times the best score of the previous frame, and gets a hundredth of the lowest score of the particles
+ * rendered to the end. The threshold does not depend on the scoring order, so neither do the scores. The particles
+ * are then rendered one by one instead of in batches; 0 turns it off, and so do contexts scored with something else
+ * than the chamfer. Read from the abort_ratio parameter
+ */
+    double abortRatio;
+    double lastBestScore;
 
     std::vector<double> matchingScores_arm_1; // particle scores (matching scores)
 
-    std::vector<std::vector<double> > particles_arm_1; // particles
+/**
+ * @brief particles, state major: CV_64FC1 of L rows, row d holds state d of every particle, particle k in column k.
+ * The rows are padded to a multiple of 8 columns so each of them is aligned like the buffer, and the per-state
+ * kernels (noise, motion) run along contiguous rows. Resampling gathers into the second buffer, then swaps them
+ */
+    cv::Mat particles_arm_1;
+    cv::Mat resampled_arm_1;
+    std::vector<int> resampleIndices_arm_1; // the particle each resampled one is copied from
     std::vector<double> particleWeights_arm_1; // particle weights calculated from matching scores
 
 /**
@@ -185,43 +242,101 @@ public:
 
 /**
  * @brief low variance resampling
- * @param sampleModel : input particles
  * @param particleWeight : input normalized weights
- * @param update_particles : output particles
+ * @param count : the number of particles to draw
+ * @param indices : output, the particle every resampled particle is a copy of
  */
-    void resamplingParticles(const std::vector<std::vector<double> > &sampleModel,
-                             const std::vector<double> &particleWeight,
-                             std::vector<std::vector<double> > &update_particles);
+    void resamplingParticles(const std::vector<double> &particleWeight, int count, std::vector<int> &indices);
 
 /**
- * @brief get the p(z_t|x_t), compute the matching score based on the camera view image and rendered image
- * @param toolImage_left
- * @param toolImage_right
- * @param toolPose
- * @param segmented_left
- * @param segmented_right
- * @param Cam_left
- * @param Cam_right
- * @return matching score using matching functions: chamfer matching
+ * @brief the particle count of KLD-sampling for a resampled set, see adaptiveParticles
+ * @param particles : the particles, state major
+ * @param indices : the resampled set, see resamplingParticles
+ * @param bins : output, the number of histogram bins the resampled set occupies
+ * @return the particle count, within [minParticles, maxParticles]
+ */
+    unsigned int kldParticleCount(const cv::Mat &particles, const std::vector<int> &indices, int &bins);
+
+/**
+ * @brief copy the resampled particles, one pass per state
+ * @param particles : input particles, state major
+ * @param indices : the particle every resampled particle is a copy of, see resamplingParticles
+ * @param resampled : output particles, of the size of the input ones
+ */
+    void gatherParticles(const cv::Mat &particles, const std::vector<int> &indices, cv::Mat &resampled);
+
+/**
+ * @brief the score of one rendering against one camera, with the likelihood its context was prepared for: the
+ * normalized cross correlation with correlationScoring, the directional chamfer with directionalChannels, the
+ * chamfer otherwise (see ToolModel::prepareScoringContext)
+ * @param points : silhouette pixels of the rendering
+ * @param edges : its silhouette edges, two end points each
+ * @param sample_step : the sample step of the pixels
+ * @param context : scoring context of the segmented image
+ */
+    double scoreRendering(const std::vector<cv::Point> &points, const std::vector<cv::Point2d> &edges,
+                          int sample_step, const ToolModel::scoringContext &context);
+
+/**
+ * @brief get the p(z_t|x_t) of a range of particles, rendered together with renderToolBatch: the silhouettes under
+ * both cameras are scored with scoreRendering, and combined into sqrt(left^2 + right^2). With early termination
+ * the particles are scored one by one with ToolModel::scoreToolPoints instead, same scores except for the ones
+ * stopped early, see abortRatio
+ * @param batch : scratch batch for the rendered silhouette pixels, reused for both cameras
+ * @param toolPoses
+ * @param context_left : per-frame scoring context of the left segmented image
+ * @param context_right : per-frame scoring context of the right segmented image
+ * @param Cams_left : left camera matrix of every particle
+ * @param Cams_right : right camera matrix of every particle
+ * @param particles : the range of particles to evaluate
+ * @param scores : output, the matching score of particle i in scores[i], -1 for a particle the early termination gave
+ * up on (see abortRatio), which scoreParticles then scores
+ * @param level : pyramid level of the contexts and of the batch, see pyramidLevels; the projections are scaled to it
+ * and every pixel stands for 2^level full resolution ones, so the scores keep their scale
+ */
+    void measureFuncBatch(ToolModel::renderBatch &batch, const std::vector<ToolModel::toolModel> &toolPoses,
+                          const ToolModel::scoringContext &context_left,
+                          const ToolModel::scoringContext &context_right, const std::vector<cv::Mat> &Cams_left,
+                          const std::vector<cv::Mat> &Cams_right, const cv::Range &particles,
+                          std::vector<double> &scores, int level = 0);
+
+/**
+ * @brief score the particles with measureFuncBatch, in parallel stripes when parallelScoring; the particles the early
+ * termination gave up on get a hundredth of the lowest score of the others
+ * @param batches : one render batch per stripe, of the image size of the level
+ * @param level : pyramid level of the contexts, see pyramidLevels
+ */
+    void scoreParticles(std::vector<ToolModel::renderBatch> &batches,
+                        std::vector<ToolModel::toolModel> &particle_models, std::vector<cv::Mat> &cams_left,
+                        std::vector<cv::Mat> &cams_right, const ToolModel::scoringContext &context_left,
+                        const ToolModel::scoringContext &context_right, int level, std::vector<double> &scores);
+
+/**
+ * @brief coarse-to-fine scoring of all the particles, see pyramidLevels
+ * @param segmented_left : segmented image for left camera
+ * @param segmented_right : segmented image for right camera
+ * @param context_left : full resolution scoring context of the left segmented image
+ * @param context_right : full resolution scoring context of the right segmented image
+ * @param scores : output, the matching score of particle i in scores[i]
  */
-    double measureFuncSameCam(cv::Mat &toolImage_left, cv::Mat &toolImage_right, ToolModel::toolModel &toolPose,
-                              const cv::Mat &segmented_left, const cv::Mat &segmented_right, cv::Mat &Cam_left,
-                              cv::Mat &Cam_right);
+    void scoreParticlesPyramid(const cv::Mat &segmented_left, const cv::Mat &segmented_right,
+                               std::vector<ToolModel::toolModel> &particle_models, std::vector<cv::Mat> &cams_left,
+                               std::vector<cv::Mat> &cams_right, const ToolModel::scoringContext &context_left,
+                               const ToolModel::scoringContext &context_right, std::vector<double> &scores);
 
 /**
  * @brief Motion model, propagte the particles using velocity computed from joint sensors
  * @param best_particle_last: last time step best particle, used to compute the nominal velocity
- * @param updatedParticles : input and output particles
+ * @param updatedParticles : input and output particles, state major
  */
-    void updateParticles(std::vector<double> &best_particle_last, double &maxScore,
-                         std::vector<std::vector<double> > &updatedParticles);
+    void updateParticles(std::vector<double> &best_particle_last, double &maxScore, cv::Mat &updatedParticles);
 
 /**
  * @brief Getting the particles by addding Gaussain noise to the initialization
  * @param inputParticle
- * @param noisedParticles
+ * @param noisedParticles : output, state major, numParticles of them
  */
-    void computeNoisedParticles(std::vector<double> &inputParticle, std::vector<std::vector<double> > &noisedParticles);
+    void computeNoisedParticles(std::vector<double> &inputParticle, cv::Mat &noisedParticles);
 
 /**
  * @brief Extract the Rodrigues vector (the rotation part) given an Eigen::Affine3d
@@ -239,11 +354,12 @@ public:
 
 /**
  * @brief Each particle contains both left camera-robot transformation and the joint angle, decompose it for rendering
- * @param input_particle
+ * @param particles : state major, see particles_arm_1
+ * @param k : the particle to decompose
  * @param tool_pose
  * @param left_cam
  */
-    void StateDecomposition(std::vector<double> &input_particle, ToolModel::toolModel &tool_pose, cv::Mat &left_cam);
+    void StateDecomposition(const cv::Mat &particles, int k, ToolModel::toolModel &tool_pose, cv::Mat &left_cam);
 };
 
 #endif
@@ -40,8 +40,72 @@
 
 using namespace std;
 
+/*** evaluates the particles of a range of stripes, each stripe with its own render batch, see trackingTool ***/
+class ParticleScoringBody : public cv::ParallelLoopBody {
+public:
+    ParticleScoringBody(ParticleFilter &filter, std::vector<ToolModel::renderBatch> &batches,
+                        std::vector<ToolModel::toolModel> &particle_models, std::vector<cv::Mat> &cams_left,
+                        std::vector<cv::Mat> &cams_right, const ToolModel::scoringContext &context_left,
+                        const ToolModel::scoringContext &context_right, int level, int num_stripes,
+                        std::vector<double> &scores) :
+            filter_(filter), batches_(batches), particle_models_(particle_models), cams_left_(cams_left),
+            cams_right_(cams_right), context_left_(context_left), context_right_(context_right), level_(level),
+            num_stripes_(num_stripes), scores_(scores) {};
+
+    void operator()(const cv::Range &range) const {
+        int num_particles = particle_models_.size();
+        for (int stripe = range.start; stripe < range.end; ++stripe) {
+            /* every particle only writes its own score, so the result is the same for any thread count */
+            int first = stripe * num_particles / num_stripes_;
+            int last = (stripe + 1) * num_particles / num_stripes_;
+            filter_.measureFuncBatch(batches_[stripe], particle_models_, context_left_, context_right_, cams_left_,
+                                     cams_right_, cv::Range(first, last), scores_, level_);
+        }
+    };
+
+private:
+    ParticleFilter &filter_;
+    std::vector<ToolModel::renderBatch> &batches_;
+    std::vector<ToolModel::toolModel> &particle_models_;
+    std::vector<cv::Mat> &cams_left_;
+    std::vector<cv::Mat> &cams_right_;
+    const ToolModel::scoringContext &context_left_;
+    const ToolModel::scoringContext &context_right_;
+    int level_;
+    int num_stripes_;
+    std::vector<double> &scores_;
+};
+
+/*** a particle given up on by the early termination scores this much of the lowest particle scored to the end ***/
+static const double aborted_factor = 0.01;
+
+/*** orders particle indices by decreasing score ***/
+struct ScoreGreater {
+    ScoreGreater(const std::vector<double> &scores) : scores_(scores) {};
+    bool operator()(int a, int b) const { return scores_[a] > scores_[b]; };
+    const std::vector<double> &scores_;
+};
+
+/*** the segmented edges at a pyramid level: area averaged, a cell with any edge in it stays an edge ***/
+static void pyramidEdges(const cv::Mat &segmented, int level, cv::Mat &coarse) {
+    cv::resize(segmented, coarse, cv::Size(segmented.cols >> level, segmented.rows >> level), 0, 0, cv::INTER_AREA);
+    cv::threshold(coarse, coarse, 0, 255, cv::THRESH_BINARY);
+}
+
+/*** the projection onto a pyramid level, pixel centres aligned as cv::resize aligns them (and as renderToolBatch
+ * expects them on that level) ***/
+static cv::Mat pyramidProjection(const cv::Mat &P, int level) {
+    if (level == 0) return P;
+    double s = 1.0 / (1 << level);
+    cv::Mat S = (cv::Mat_<double>(3, 3) << s, 0, 0.5 * (s - 1), 0, s, 0.5 * (s - 1), 0, 0, 1);
+    return S * P;
+}
+
 ParticleFilter::ParticleFilter(ros::NodeHandle *nodehandle) :
-        node_handle(*nodehandle), numParticles(180), down_sample_joint(0.0008), down_sample_cam(0.0008), L(13) {
+        node_handle(*nodehandle), numParticles(180), adaptiveParticles(false), minParticles(50), maxParticles(400),
+        kldError(0.1), kldQuantile(2.326), kldBinSize(0.002), parallelScoring(true),
+        numScoringThreads(cv::getNumThreads()), pyramidLevels(0), pyramidFraction(0.25), pyramidCheck(false),
+        abortRatio(0.0), lastBestScore(0.0), down_sample_joint(0.0008), down_sample_cam(0.0008), L(13) {
     /********** using calibration results: camera-base transformation *******/
     g_cr_cl = cv::Mat::eye(4, 4, CV_64FC1);
 
@@ -85,8 +149,32 @@ ParticleFilter::ParticleFilter(ros::NodeHandle *nodehandle) :
     projectionMat_subscriber_l = node_handle.subscribe("/davinci_endo/left/camera_info", 1,
                                                        &ParticleFilter::projectionLeftCB, this);
                                                        
-    toolImage_left_arm_1 = cv::Mat::zeros(480, 640, CV_8UC3);
-    toolImage_right_arm_1 = cv::Mat::zeros(480, 640, CV_8UC3);
+    /* KLD-sampling, ROS has no unsigned parameters */
+    int min_particles = minParticles, max_particles = maxParticles;
+    node_handle.param("adaptive_particles", adaptiveParticles, adaptiveParticles);
+    node_handle.param("min_particles", min_particles, min_particles);
+    node_handle.param("max_particles", max_particles, max_particles);
+    node_handle.param("kld_error", kldError, kldError);
+    node_handle.param("kld_quantile", kldQuantile, kldQuantile);
+    node_handle.param("kld_bin_size", kldBinSize, kldBinSize);
+    minParticles = std::max(min_particles, 1);
+    maxParticles = std::max(max_particles, (int) minParticles);
+
+    /* early termination of the full resolution scoring */
+    node_handle.param("abort_ratio", abortRatio, abortRatio);
+
+    /* the coarse-to-fine scoring, read before the coarse batches are sized */
+    node_handle.param("pyramid_levels", pyramidLevels, pyramidLevels);
+    node_handle.param("pyramid_fraction", pyramidFraction, pyramidFraction);
+    node_handle.param("pyramid_check", pyramidCheck, pyramidCheck);
+    if (pyramidLevels < 0) pyramidLevels = 0;
+
+    /* push one at a time, resize() would copy a single cv::Mat header and all the batches would share its data */
+    if (numScoringThreads < 1) numScoringThreads = 1;
+    for (int i = 0; i < numScoringThreads; ++i) {
+        renderBatches_arm_1.push_back(ToolModel::renderBatch(480, 640));
+        if (pyramidLevels > 0) coarseBatches_arm_1.push_back(ToolModel::renderBatch(480 >> pyramidLevels, 640 >> pyramidLevels));
+    }
 
     raw_image_left = cv::Mat::zeros(480, 640, CV_8UC3);
     raw_image_right = cv::Mat::zeros(480, 640, CV_8UC3);
@@ -106,7 +194,9 @@ void ParticleFilter::initializeParticles() {
     ROS_INFO("---- Initialize particle is called---");
     matchingScores_arm_1.resize(numParticles); //initialize matching score array
 
-    particles_arm_1.resize(numParticles); //initialize particle array
+    particles_arm_1.create(L, (numParticles + 7) & ~7, CV_64FC1); //initialize particle array, see particles_arm_1
+    resampled_arm_1.create(particles_arm_1.rows, particles_arm_1.cols, CV_64FC1);
+    resampleIndices_arm_1.resize(numParticles);
     particleWeights_arm_1.resize(numParticles); //initialize particle weight array
 
     /******Find and convert our various params and inputs******/
@@ -197,36 +287,29 @@ void ParticleFilter::getCoarseGuess() {
     computeNoisedParticles(initialParticle, particles_arm_1);
 };
 
-void ParticleFilter::computeNoisedParticles(std::vector<double> &inputParticle,
-                                            std::vector<std::vector<double> > &noisedParticles) {
-
-    for (int i = 0; i < noisedParticles.size(); ++i) {
-        noisedParticles[i].resize(L);
-
-        // inputParticle[0] = inputParticle[0] + newToolModel.randomNumber(0.005, -0.002);
-        // // ROS_INFO_STREAM("inputParticle[0]" << inputParticle[0]);
-        // inputParticle[1] = inputParticle[1] + newToolModel.randomNumber(0.001, 0);
-        // inputParticle[2] = inputParticle[2] + newToolModel.randomNumber(0.002, 0.0);
-        // inputParticle[3] = inputParticle[3] + newToolModel.randomNumber(0.003, -0.001);
-        // // ROS_INFO_STREAM("inputParticle[3]" << inputParticle[3]);
-        // inputParticle[4] = inputParticle[4] + newToolModel.randomNumber(0.0003, 0);
-        // inputParticle[5] = inputParticle[5] + newToolModel.randomNumber(0.0002, 0.0);
-        // // ROS_INFO_STREAM("inputParticle[5]" << inputParticle[5]);
-        // inputParticle[6] = inputParticle[6] + newToolModel.randomNumber(0.0003, 0);
-
-        // /**
-        //  * left camera-base matrix, There is offset for positions from initial calibration results
-        //  */
+void ParticleFilter::computeNoisedParticles(std::vector<double> &inputParticle, cv::Mat &noisedParticles) {
 
-        inputParticle[7] = inputParticle[7] + newToolModel.randomNumber(0.0001, 0);
-        inputParticle[8] = inputParticle[8] + newToolModel.randomNumber(0.0001, 0);
-        inputParticle[9] = inputParticle[9] + newToolModel.randomNumber(0.0001, 0);
+    // inputParticle[0] = inputParticle[0] + newToolModel.randomNumber(0.005, -0.002);
+    // // ROS_INFO_STREAM("inputParticle[0]" << inputParticle[0]);
+    // inputParticle[1] = inputParticle[1] + newToolModel.randomNumber(0.001, 0);
+    // inputParticle[2] = inputParticle[2] + newToolModel.randomNumber(0.002, 0.0);
+    // inputParticle[3] = inputParticle[3] + newToolModel.randomNumber(0.003, -0.001);
+    // // ROS_INFO_STREAM("inputParticle[3]" << inputParticle[3]);
+    // inputParticle[4] = inputParticle[4] + newToolModel.randomNumber(0.0003, 0);
+    // inputParticle[5] = inputParticle[5] + newToolModel.randomNumber(0.0002, 0.0);
+    // // ROS_INFO_STREAM("inputParticle[5]" << inputParticle[5]);
+    // inputParticle[6] = inputParticle[6] + newToolModel.randomNumber(0.0003, 0);
 
-        inputParticle[10] = inputParticle[10] + newToolModel.randomNumber(0.0001, 0.0);
-        inputParticle[11] = inputParticle[11] + newToolModel.randomNumber(0.0001, 0.0);
-        inputParticle[12] = inputParticle[12] + newToolModel.randomNumber(0.0001, 0.0);
-
-        noisedParticles[i] = inputParticle;
+    /**
+     * left camera-base matrix, There is offset for positions from initial calibration results. Every particle adds
+     * its noise to the one before, state by state
+     */
+    for (int d = 0; d < L; ++d) {
+        double *state = noisedParticles.ptr<double>(d);
+        for (int i = 0; i < numParticles; ++i) {
+            if (d >= 7) inputParticle[d] = inputParticle[d] + newToolModel.randomNumber(0.0001, 0);
+            state[i] = inputParticle[d];
+        }
     }
 
 };
@@ -288,6 +371,10 @@ void ParticleFilter::trackingTool(const cv::Mat &segmented_left, const cv::Mat &
    // cv::Mat toolImage_left_temp = cv::Mat::zeros(480, 640, CV_8UC3);
    // cv::Mat toolImage_right_temp = cv::Mat::zeros(480, 640, CV_8UC3);
 
+    /* the particle count may change every frame with adaptiveParticles */
+    matchingScores_arm_1.resize(numParticles);
+    particleWeights_arm_1.resize(numParticles);
+
     std::vector<ToolModel::toolModel> particle_models;
     particle_models.resize(numParticles);
 
@@ -299,7 +386,7 @@ void ParticleFilter::trackingTool(const cv::Mat &segmented_left, const cv::Mat &
 
     for (int k = 0; k < numParticles; ++k) {
         /* particles contain both tool joint angle and camera transformation for rendering */
-        StateDecomposition(particles_arm_1[k], temp_model, cam_matrices_left_arm_1[k]);
+        StateDecomposition(particles_arm_1, k, temp_model, cam_matrices_left_arm_1[k]);
 
         particle_models[k] = temp_model;
         /**
@@ -308,11 +395,22 @@ void ParticleFilter::trackingTool(const cv::Mat &segmented_left, const cv::Mat &
         cam_matrices_right_arm_1[k] = g_cr_cl * cam_matrices_left_arm_1[k];
     }
 
+    /*** the distance transforms only depend on the segmented images, compute them once for all the particles ***/
+    ToolModel::scoringContext context_left;
+    ToolModel::scoringContext context_right;
+    newToolModel.prepareScoringContext(segmented_left, context_left);
+    newToolModel.prepareScoringContext(segmented_right, context_right);
+
     /*** do the sampling and get the matching score ***/
+    if (pyramidLevels > 0) {
+        scoreParticlesPyramid(segmented_left, segmented_right, particle_models, cam_matrices_left_arm_1,
+                              cam_matrices_right_arm_1, context_left, context_right, matchingScores_arm_1);
+    } else {
+        scoreParticles(renderBatches_arm_1, particle_models, cam_matrices_left_arm_1, cam_matrices_right_arm_1,
+                       context_left, context_right, 0, matchingScores_arm_1);
+    }
+
     for (int i = 0; i < numParticles; ++i) {
-        matchingScores_arm_1[i] = measureFuncSameCam(toolImage_left_arm_1, toolImage_right_arm_1, particle_models[i],
-                                                     segmented_left, segmented_right, cam_matrices_left_arm_1[i],
-                                                     cam_matrices_right_arm_1[i]);
     /**
      * show the distribution of the particles
      */
@@ -325,15 +423,26 @@ void ParticleFilter::trackingTool(const cv::Mat &segmented_left, const cv::Mat &
         }
         totalScore_1 += matchingScores_arm_1[i];
     }
+    lastBestScore = maxScore_1;
     /* debug */
     //    ROS_INFO_STREAM("Maxscore arm 1: " << maxScore_1);
 
     /*** calculate weights using matching score and do the resampling ***/
-    for (int j = 0; j < numParticles; ++j) { // normalize the weights
-        particleWeights_arm_1[j] = (matchingScores_arm_1[j] / totalScore_1);
+    if (totalScore_1 > 0.0) {
+        for (int j = 0; j < numParticles; ++j) { // normalize the weights
+            particleWeights_arm_1[j] = (matchingScores_arm_1[j] / totalScore_1);
+        }
+    } else {
+        /* nothing matched (the correlation is 0 for every empty render, and for all of them on a blank image): keep
+         * every particle alike rather than dividing by zero */
+        ROS_WARN("every particle scored 0, resampling with uniform weights.");
+        std::fill(particleWeights_arm_1.begin(), particleWeights_arm_1.end(), 1.0 / numParticles);
     }
 
-    std::vector<double> best_particle = particles_arm_1[maxScoreIdx_1];
+    std::vector<double> best_particle(L);
+    for (int d = 0; d < L; ++d) {
+        best_particle[d] = particles_arm_1.at<double>(d, maxScoreIdx_1);
+    }
 
 //    ROS_WARN("Particle ARM AT (%f %f %f): %f %f %f, ", best_tool_pose.tvec_cyl(0), best_tool_pose.tvec_cyl(1),
 //             best_tool_pose.tvec_cyl(2), best_tool_pose.rvec_cyl(0), best_tool_pose.rvec_cyl(1),
@@ -362,8 +471,18 @@ void ParticleFilter::trackingTool(const cv::Mat &segmented_left, const cv::Mat &
     /// showing the best particle on left and right image
 
     //each time will clear the particles and resample them, resample using low variance resampling method
-    std::vector<std::vector<double> > oldParticles = particles_arm_1;
-    resamplingParticles(oldParticles, particleWeights_arm_1, particles_arm_1);
+    resamplingParticles(particleWeights_arm_1, numParticles, resampleIndices_arm_1);
+    if (adaptiveParticles) {
+        int bins;
+        unsigned int count = kldParticleCount(particles_arm_1, resampleIndices_arm_1, bins);
+        if (count != numParticles) {
+            numParticles = count;
+            resamplingParticles(particleWeights_arm_1, numParticles, resampleIndices_arm_1);
+        }
+        ROS_INFO("KLD sampling: %d bins, %u particles", bins, numParticles);
+    }
+    gatherParticles(particles_arm_1, resampleIndices_arm_1, resampled_arm_1);
+    std::swap(particles_arm_1, resampled_arm_1);
 
     cv::waitKey(20);
 
@@ -372,7 +491,7 @@ void ParticleFilter::trackingTool(const cv::Mat &segmented_left, const cv::Mat &
 
 /***** update particles to find and reach to the best pose ***/
 void ParticleFilter::updateParticles(std::vector<double> &best_particle_last, double &maxScore,
-                                     std::vector<std::vector<double> > &updatedParticles) {
+                                     cv::Mat &updatedParticles) {
                                      
     psm_controller psm1(1, node_handle, true);
 	// psm_controller psm2(2, node_handle, true);
@@ -408,30 +527,30 @@ void ParticleFilter::updateParticles(std::vector<double> &best_particle_last, do
     ROS_INFO_STREAM("velocity_bar " << velocity_bar);
     if (fabs(velocity_bar) > 0.001) {
         ROS_WARN(" Refresh state! ");
-        /******** using the obtained velocity to propagate the particles ********/
-        for (int j = 0; j < updatedParticles.size(); ++j) {
-            for (int i = 0; i < 7; ++i) {
-                current_joint.at<double>(i, 0) = updatedParticles[j][i];
-            }
-            cv::Mat new_joint_state = current_joint + nom_vel * delta_t;
-            for (int k = 0; k < 7; ++k) {
-                updatedParticles[j][k] = new_joint_state.at<double>(k, 0);
+        /******** using the obtained velocity to propagate the particles, joint by joint ********/
+        for (int k = 0; k < 7; ++k) {
+            double *joint = updatedParticles.ptr<double>(k);
+            double delta = nom_vel.at<double>(k, 0) * delta_t;
+            for (int j = 0; j < numParticles; ++j) {
+                joint[j] = joint[j] + delta;
             }
+        }
 
-            cv::Mat rotationmatrix(3, 3, CV_64FC1);
-            cv::Mat p(3, 1, CV_64FC1);
-            rotationmatrix = Cam_left_arm_1.colRange(0, 3).rowRange(0, 3);
-            p = Cam_left_arm_1.colRange(3, 4).rowRange(0, 3);
-            cv::Mat cat_vec(3, 1, CV_64FC1);
-            cv::Rodrigues(rotationmatrix, cat_vec);
-
-            updatedParticles[j][7] = p.at<double>(0, 0);
-            updatedParticles[j][8] = p.at<double>(1, 0);
-            updatedParticles[j][9] = p.at<double>(2, 0);
-
-            updatedParticles[j][10] = cat_vec.at<double>(0, 0);
-            updatedParticles[j][11] = cat_vec.at<double>(1, 0);
-            updatedParticles[j][12] = cat_vec.at<double>(2, 0);
+        /* and the camera back to the calibration */
+        cv::Mat rotationmatrix(3, 3, CV_64FC1);
+        cv::Mat p(3, 1, CV_64FC1);
+        rotationmatrix = Cam_left_arm_1.colRange(0, 3).rowRange(0, 3);
+        p = Cam_left_arm_1.colRange(3, 4).rowRange(0, 3);
+        cv::Mat cat_vec(3, 1, CV_64FC1);
+        cv::Rodrigues(rotationmatrix, cat_vec);
+
+        double camera[6] = {p.at<double>(0, 0), p.at<double>(1, 0), p.at<double>(2, 0), cat_vec.at<double>(0, 0),
+                            cat_vec.at<double>(1, 0), cat_vec.at<double>(2, 0)};
+        for (int k = 7; k < 13; ++k) {
+            double *state = updatedParticles.ptr<double>(k);
+            for (int j = 0; j < numParticles; ++j) {
+                state[j] = camera[k - 7];
+            }
         }
         //if necessary
 //        down_sample_cam = 0.001;
@@ -440,85 +559,251 @@ void ParticleFilter::updateParticles(std::vector<double> &best_particle_last, do
     if (down_sample_joint < 0.0001) {
         down_sample_joint = 0.0001;
     };
-    /**** add noise for propagated particles ****/
-    for (int m = 0; m < updatedParticles.size(); ++m) {
-
-        updatedParticles[m][0] = updatedParticles[m][0] + newToolModel.randomNumber(0.0001, -0.002);
-        updatedParticles[m][1] = updatedParticles[m][1] + newToolModel.randomNumber(0.0001, 0.0);
-        updatedParticles[m][2] = updatedParticles[m][2] + newToolModel.randomNumber(0.0005, 0.00);
-        updatedParticles[m][3] = updatedParticles[m][3] + newToolModel.randomNumber(0.0005, -0.1);
+    /**** add noise for propagated particles, state by state ****/
+    // [4]: 0.0003, [5]: down_sample_joint, [6]: 0.002, left cam [7 - 12]: down_sample_cam
+    static const double noise_stdev[13] = {0.0001, 0.0001, 0.0005, 0.0005, 0.0, 0.0, 0.0,
+                                           0.0001, 0.0001, 0.00001, 0.0001, 0.0001, 0.0001};
+    static const double noise_mean[13] = {-0.002, 0.0, 0.00, -0.1, 0.0, 0.0, 0.0,
+                                          0, 0, 0, 0.0, 0.0, 0.0};
+    for (int k = 0; k < 13; ++k) {
+        if (noise_stdev[k] == 0.0) continue;
+        double *state = updatedParticles.ptr<double>(k);
+        for (int m = 0; m < numParticles; ++m) {
+            state[m] = state[m] + newToolModel.randomNumber(noise_stdev[k], noise_mean[k]);
+        }
+    }
 
-        // updatedParticles[m][4] = updatedParticles[m][4] + newToolModel.randomNumber(0.0003, 0);
-        // updatedParticles[m][5] = updatedParticles[m][5] + newToolModel.randomNumber(down_sample_joint, 0);
-        // updatedParticles[m][6] = updatedParticles[m][6] + newToolModel.randomNumber(0.002, 0);
+    // down_sample_cam -= 0.0001;
+    // if (down_sample_cam < 0.0001) {
+    //     down_sample_cam = 0.0001;
+    // };
 
-        // //left cam
-        // // for (int j = 7; j < 13; ++j) {
-        // //     updatedParticles[m][j] = updatedParticles[m][j] + newToolModel.randomNumber(down_sample_cam, 0);
-        // // }
+};
 
-        updatedParticles[m][7] = updatedParticles[m][7] + newToolModel.randomNumber(0.0001, 0);
-        updatedParticles[m][8] = updatedParticles[m][8] + newToolModel.randomNumber(0.0001, 0);
-        updatedParticles[m][9] = updatedParticles[m][9] + newToolModel.randomNumber(0.00001, 0);
+/*** one stripe of particles per render batch ***/
+void ParticleFilter::scoreParticles(std::vector<ToolModel::renderBatch> &batches,
+                                    std::vector<ToolModel::toolModel> &particle_models, std::vector<cv::Mat> &cams_left,
+                                    std::vector<cv::Mat> &cams_right, const ToolModel::scoringContext &context_left,
+                                    const ToolModel::scoringContext &context_right, int level,
+                                    std::vector<double> &scores) {
+
+    int num_stripes = parallelScoring ? batches.size() : 1;
+    ParticleScoringBody scoring_body(*this, batches, particle_models, cams_left, cams_right, context_left,
+                                     context_right, level, num_stripes, scores);
+    if (num_stripes > 1) {
+        cv::parallel_for_(cv::Range(0, num_stripes), scoring_body);
+    } else {
+        scoring_body(cv::Range(0, 1));
+    }
 
-        updatedParticles[m][10] = updatedParticles[m][10] + newToolModel.randomNumber(0.0001, 0.0);
-        updatedParticles[m][11] = updatedParticles[m][11] + newToolModel.randomNumber(0.0001, 0.0);
-        updatedParticles[m][12] = updatedParticles[m][12] + newToolModel.randomNumber(0.0001, 0.0);
+    /* the particles the early termination gave up on, marked -1, score below every one rendered to the end */
+    double min_done = -1.0;
+    for (int i = 0; i < scores.size(); ++i) {
+        if (scores[i] >= 0.0 && (min_done < 0.0 || scores[i] < min_done)) min_done = scores[i];
+    }
+    for (int i = 0; i < scores.size(); ++i) {
+        if (scores[i] < 0.0) scores[i] = min_done > 0.0 ? aborted_factor * min_done : 0.0;
+    }
+};
 
+void ParticleFilter::scoreParticlesPyramid(const cv::Mat &segmented_left, const cv::Mat &segmented_right,
+                                           std::vector<ToolModel::toolModel> &particle_models,
+                                           std::vector<cv::Mat> &cams_left, std::vector<cv::Mat> &cams_right,
+                                           const ToolModel::scoringContext &context_left,
+                                           const ToolModel::scoringContext &context_right,
+                                           std::vector<double> &scores) {
+
+    double start = (double) cv::getTickCount();
+
+    /*** every particle against the coarse images first, the plain distance transform is enough to rank them ***/
+    cv::Mat coarse_left, coarse_right;
+    pyramidEdges(segmented_left, pyramidLevels, coarse_left);
+    pyramidEdges(segmented_right, pyramidLevels, coarse_right);
+    ToolModel::scoringContext coarse_context_left;
+    ToolModel::scoringContext coarse_context_right;
+    newToolModel.prepareScoringContext(coarse_left, coarse_context_left, false);
+    newToolModel.prepareScoringContext(coarse_right, coarse_context_right, false);
+    scoreParticles(coarseBatches_arm_1, particle_models, cams_left, cams_right, coarse_context_left,
+                   coarse_context_right, pyramidLevels, scores);
+
+    /*** then the best of them again at full resolution ***/
+    int num_particles = particle_models.size();
+    int num_fine = std::min(num_particles, std::max(1, (int) ceil(pyramidFraction * num_particles)));
+    std::vector<int> order(num_particles);
+    for (int i = 0; i < num_particles; ++i) {
+        order[i] = i;
+    }
+    std::nth_element(order.begin(), order.begin() + num_fine - 1, order.end(), ScoreGreater(scores));
+    double min_kept = scores[order[num_fine - 1]];   //lowest coarse score refined
+
+    std::vector<ToolModel::toolModel> fine_models(num_fine);
+    std::vector<cv::Mat> fine_cams_left(num_fine);
+    std::vector<cv::Mat> fine_cams_right(num_fine);
+    std::vector<double> fine_scores(num_fine);
+    for (int i = 0; i < num_fine; ++i) {
+        fine_models[i] = particle_models[order[i]];
+        fine_cams_left[i] = cams_left[order[i]];
+        fine_cams_right[i] = cams_right[order[i]];
+    }
+    scoreParticles(renderBatches_arm_1, fine_models, fine_cams_left, fine_cams_right, context_left, context_right, 0,
+                   fine_scores);
+    for (int i = 0; i < num_fine; ++i) {
+        scores[order[i]] = fine_scores[i];
     }
 
-    // down_sample_cam -= 0.0001;
-    // if (down_sample_cam < 0.0001) {
-    //     down_sample_cam = 0.0001;
-    // };
+    /* the coarse scores are optimistic (the downsampled edges are thicker), so a culled particle must not outrank a
+     * refined one: its coarse score is rescaled from [0, lowest coarse score refined] to [0, lowest fine score] */
+    double min_fine = *std::min_element(fine_scores.begin(), fine_scores.end());
+    for (int i = num_fine; i < num_particles; ++i) {
+        double &score = scores[order[i]];
+        score = min_kept > 0.0 ? min_fine * std::min(1.0, score / min_kept) : std::min(score, min_fine);
+    }
 
+    if (!pyramidCheck) return;
+
+    /*** benchmark against scoring every particle at full resolution: the speedup, and how far the best particle
+     * (its tool origin under the left camera) moved ***/
+    double pyramid_time = ((double) cv::getTickCount() - start) / cv::getTickFrequency();
+    start = (double) cv::getTickCount();
+    std::vector<double> full_scores(num_particles);
+    scoreParticles(renderBatches_arm_1, particle_models, cams_left, cams_right, context_left, context_right, 0,
+                   full_scores);
+    double full_time = ((double) cv::getTickCount() - start) / cv::getTickFrequency();
+
+    int best = std::max_element(scores.begin(), scores.end()) - scores.begin();
+    int full_best = std::max_element(full_scores.begin(), full_scores.end()) - full_scores.begin();
+    cv::Mat origin = (cv::Mat_<double>(4, 1) << particle_models[best].tvec_cyl(0), particle_models[best].tvec_cyl(1),
+            particle_models[best].tvec_cyl(2), 1.0);
+    cv::Mat full_origin = (cv::Mat_<double>(4, 1) << particle_models[full_best].tvec_cyl(0),
+            particle_models[full_best].tvec_cyl(1), particle_models[full_best].tvec_cyl(2), 1.0);
+    cv::Mat position = cams_left[best] * origin;
+    cv::Mat full_position = cams_left[full_best] * full_origin;
+    double offset = cv::norm(position - full_position);
+
+    ROS_INFO("pyramid scoring: %d of %d particles at full resolution, %.2f ms vs %.2f ms (%.1fx), best particle "
+             "%.2f mm off, score %.4f vs %.4f", num_fine, num_particles, pyramid_time * 1000, full_time * 1000,
+             full_time / std::max(pyramid_time, 1e-9), offset * 1000, full_scores[best], full_scores[full_best]);
 };
 
-double
-ParticleFilter::measureFuncSameCam(cv::Mat &toolImage_left, cv::Mat &toolImage_right, ToolModel::toolModel &toolPose,
-                                   const cv::Mat &segmented_left, const cv::Mat &segmented_right, cv::Mat &Cam_left,
-                                   cv::Mat &Cam_right) {
+/*** the likelihood the context was prepared for: normalized cross correlation, directional chamfer, or chamfer ***/
+double ParticleFilter::scoreRendering(const std::vector<cv::Point> &points, const std::vector<cv::Point2d> &edges,
+                                      int sample_step, const ToolModel::scoringContext &context) {
 
-    toolImage_left.setTo(0);
-    toolImage_right.setTo(0);
+    if (!context.blurSEG.empty()) return newToolModel.calculateMatchingScore(points, sample_step, context);
+    if (!context.directionalDIST.empty()) return newToolModel.calculateDirectionalScore(edges, context);
+    return newToolModel.calculateChamferScore(points, sample_step, context);
+};
 
-    /***do the sampling and get the matching score***/
-    //first get the rendered image using 3d model of the tool
-    newToolModel.renderTool(toolImage_left, toolPose, Cam_left, P_left);
-    double left = newToolModel.calculateChamferScore(toolImage_left, segmented_left);  //get the matching score calculateMatchingScore(cv::Mat &toolImage, const cv::Mat &segmentedImage)
+void ParticleFilter::measureFuncBatch(ToolModel::renderBatch &batch, const std::vector<ToolModel::toolModel> &toolPoses,
+                                      const ToolModel::scoringContext &context_left,
+                                      const ToolModel::scoringContext &context_right,
+                                      const std::vector<cv::Mat> &Cams_left, const std::vector<cv::Mat> &Cams_right,
+                                      const cv::Range &particles, std::vector<double> &scores, int level) {
+
+    /* a stripe never starts from the silhouettes of the previous frame, or of another stripe */
+    newToolModel.resetSilhouetteCaches(batch.buffer);
+    newToolModel.resetSilhouetteCaches(batch.right_buffer);
+
+    /*** with early termination the particles go one by one, a batch renders every part of a block together. The
+     * parts of both cameras go in turn, so the bound on the combined score tightens with every part of either. An
+     * aborted particle is marked with -1, scoreParticles puts it below every completed one: its upper bound would sit
+     * just below the threshold, above the completed particles that scored less ***/
+    double threshold = abortRatio * lastBestScore;
+    bool chamfer = context_left.directionalDIST.empty() && context_left.blurSEG.empty() &&
+                   context_right.directionalDIST.empty() && context_right.blurSEG.empty();
+    if (level == 0 && threshold > 0.0 && chamfer) {
+        for (int p = particles.start; p < particles.end; ++p) {
+            cv::Mat cam_left = Cams_left[p], cam_right = Cams_right[p];
+            bool aborted;
+            double score = newToolModel.scoreToolPoints(batch.buffer, batch.right_buffer, toolPoses[p], cam_left,
+                                                        P_left, context_left, cam_right, P_right, context_right,
+                                                        threshold, aborted);
+            scores[p] = aborted ? -1.0 : score;
+        }
+        return;
+    }
 
-    newToolModel.renderTool(toolImage_right, toolPose, Cam_right, P_right);
-    double right = newToolModel.calculateChamferScore(toolImage_right, segmented_right);
+    /* on a pyramid level every pixel along an edge stands for 2^level full resolution ones */
+    int step = batch.buffer.sample_step << level;
 
-    double matchingScore = sqrt(pow(left, 2) + pow(right, 2));
+    /*** the left renderings of the whole range first, the scores wait in the output until the right ones are done ***/
+    newToolModel.renderToolBatch(toolPoses, Cams_left, pyramidProjection(P_left, level), batch, particles,
+                                 level);
+    for (int i = 0; i < particles.size(); ++i) {
+        scores[particles.start + i] = scoreRendering(batch.points[i], batch.tool_edges[i], step, context_left);
+    }
 
-    return matchingScore;
+    newToolModel.renderToolBatch(toolPoses, Cams_right, pyramidProjection(P_right, level), batch, particles,
+                                 level);
+    for (int i = 0; i < particles.size(); ++i) {
+        double left = scores[particles.start + i];
+        double right = scoreRendering(batch.points[i], batch.tool_edges[i], step, context_right);
+        scores[particles.start + i] = sqrt(pow(left, 2) + pow(right, 2));
+    }
 };
 
 /**** resampling method ****/
-void ParticleFilter::resamplingParticles(const std::vector<std::vector<double> > &sampleModel,
-                                         const std::vector<double> &particleWeight,
-                                         std::vector<std::vector<double> > &update_particles) {
+void ParticleFilter::resamplingParticles(const std::vector<double> &particleWeight, int count,
+                                         std::vector<int> &indices) {
 
-    int M = sampleModel.size(); //total number of particles
+    int N = particleWeight.size(); //total number of weighted particles
+    int M = count; //total number of particles drawn
     double max = 1.0 / M;
 
     double r = newToolModel.randomNum(0.0, max);
     double w = particleWeight[0]; //first particle weight
     int idx = 0;
 
-    update_particles.clear(); ///start fresh
+    indices.resize(M);
 
     for (int i = 0; i < M; ++i) {
 
         double U = r + ((double) (i - 1) * max);
 
-        while (U > w) {
+        while (U > w && idx + 1 < N) {
             idx += 1;
             w = w + particleWeight[idx];
         }
 
-        update_particles.push_back(sampleModel[idx]);
+        indices[i] = idx;
+    }
+
+};
+
+/*** KLD-sampling bound (Fox, 2003) over the bins of the joints 0 - 3, 16 bits of bin index each ***/
+unsigned int ParticleFilter::kldParticleCount(const cv::Mat &particles, const std::vector<int> &indices, int &bins) {
+
+    std::vector<uint64_t> keys(indices.size());
+    for (int i = 0; i < indices.size(); ++i) {
+        uint64_t key = 0;
+        for (int d = 0; d < 4; ++d) {
+            int bin = (int) floor(particles.at<double>(d, indices[i]) / kldBinSize);
+            key = (key << 16) | (uint64_t) ((bin + 32768) & 0xffff);
+        }
+        keys[i] = key;
+    }
+    std::sort(keys.begin(), keys.end());
+    bins = std::unique(keys.begin(), keys.end()) - keys.begin();
+
+    double count = minParticles;
+    if (bins > 1) {
+        double a = 2.0 / (9.0 * (bins - 1));
+        double c = 1.0 - a + sqrt(a) * kldQuantile;
+        count = (bins - 1) / (2.0 * kldError) * c * c * c;
+    }
+
+    return (unsigned int) std::min<double>(std::max<double>(ceil(count), minParticles), maxParticles);
+};
+
+void ParticleFilter::gatherParticles(const cv::Mat &particles, const std::vector<int> &indices, cv::Mat &resampled) {
+
+    resampled.create(particles.rows, (indices.size() + 7) & ~7, CV_64FC1);
+    for (int d = 0; d < particles.rows; ++d) {
+        const double *state = particles.ptr<double>(d);
+        double *resampled_state = resampled.ptr<double>(d);
+        for (int i = 0; i < indices.size(); ++i) {
+            resampled_state[i] = state[indices[i]];
+        }
     }
 
 };
@@ -575,16 +860,19 @@ void ParticleFilter::convertEigenToMat(const Eigen::Affine3d &trans, cv::Mat &ou
 
 };
 
-void ParticleFilter::StateDecomposition(std::vector<double> &input_particle, ToolModel::toolModel &tool_pose, cv::Mat &left_cam){
+void ParticleFilter::StateDecomposition(const cv::Mat &particles, int k, ToolModel::toolModel &tool_pose,
+                                        cv::Mat &left_cam) {
+
+    const cv::Mat input_particle = particles.col(k);
 
     Eigen::Affine3d a1_pos_1 = kinematics.computeAffineOfDH(DH_a_params[0], DH_d1, DH_alpha_params[0],
-                                                            input_particle[0] + DH_q_offset0);
+                                                            input_particle.at<double>(0) + DH_q_offset0);
     Eigen::Affine3d a1_pos_2 = kinematics.computeAffineOfDH(DH_a_params[1], DH_d2, DH_alpha_params[1],
-                                                            input_particle[1] + DH_q_offset1);
-    Eigen::Affine3d a1_pos_3 = kinematics.computeAffineOfDH(DH_a_params[2], input_particle[2] + DH_q_offset2,
+                                                            input_particle.at<double>(1) + DH_q_offset1);
+    Eigen::Affine3d a1_pos_3 = kinematics.computeAffineOfDH(DH_a_params[2], input_particle.at<double>(2) + DH_q_offset2,
                                                             DH_alpha_params[2], 0.0);
     Eigen::Affine3d a1_pos_4 = kinematics.computeAffineOfDH(DH_a_params[3], DH_d4, DH_alpha_params[3],
-                                                            input_particle[3] + DH_q_offset3);
+                                                            input_particle.at<double>(3) + DH_q_offset3);
 
     Eigen::Affine3d a1_pos = kinematics.affine_frame0_wrt_base_ * a1_pos_1 * a1_pos_2 * a1_pos_3 *
                              a1_pos_4;// *a1_5 * a1_6 * a1_7 * kinematics.affine_gripper_wrt_frame6_ ;
@@ -600,20 +888,20 @@ void ParticleFilter::StateDecomposition(std::vector<double> &input_particle, Too
     tool_pose.rvec_cyl(1) = a1_rvec.at<double>(1, 0);
     tool_pose.rvec_cyl(2) = a1_rvec.at<double>(2, 0);
 
-    newToolModel.computeEllipsePose(tool_pose, input_particle[4], input_particle[5],
-                                    input_particle[6]);
+    newToolModel.computeEllipsePose(tool_pose, input_particle.at<double>(4), input_particle.at<double>(5),
+                                    input_particle.at<double>(6));
 
     /**** left camera ***/
     cv::Mat rotationmatrix(3, 3, CV_64FC1);
     cv::Mat p(3, 1, CV_64FC1);
     cv::Mat cat_vec(3, 1, CV_64FC1);
-    p.at<double>(0, 0) = input_particle[7];
-    p.at<double>(1, 0) = input_particle[8];
-    p.at<double>(2, 0) = input_particle[9];
+    p.at<double>(0, 0) = input_particle.at<double>(7);
+    p.at<double>(1, 0) = input_particle.at<double>(8);
+    p.at<double>(2, 0) = input_particle.at<double>(9);
 
-    cat_vec.at<double>(0, 0) = input_particle[10];
-    cat_vec.at<double>(1, 0) = input_particle[11];
-    cat_vec.at<double>(2, 0) = input_particle[12];
+    cat_vec.at<double>(0, 0) = input_particle.at<double>(10);
+    cat_vec.at<double>(1, 0) = input_particle.at<double>(11);
+    cat_vec.at<double>(2, 0) = input_particle.at<double>(12);
 
     cv::Rodrigues(cat_vec, rotationmatrix);
     left_cam = cv::Mat::eye(4, 4, CV_64FC1);